@@ -0,0 +1,428 @@
+#define MQTT_IMPL
+#include "mqtt.h"
+
+#include <getopt.h>
+#include <time.h>
+
+/*
+ * codec benchmark over mqtt.h alone, no sockets. every case is serialized
+ * and parsed back in several ways, allocations are counted by linking with
+ * --wrap=malloc,--wrap=calloc,--wrap=realloc.
+ */
+
+static volatile uint64_t allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *
+__wrap_malloc(size_t size) {
+    allocs++;
+    return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t nmemb, size_t size) {
+    allocs++;
+    return __real_calloc(nmemb, size);
+}
+
+void *
+__wrap_realloc(void *ptr, size_t size) {
+    allocs++;
+    return __real_realloc(ptr, size);
+}
+
+static struct {
+    int ms;
+    size_t fragment;
+    size_t stream;
+    mqtt_version_t version;
+    const char *only;
+} B = {
+    .ms = 300,
+    .fragment = 7,
+    .stream = 64 * 1024,
+    .version = 0,
+    .only = 0,
+};
+
+static uint64_t
+bench_now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static const char *SUBSCRIBE_FILTERS[] = {
+    "pms5003st/+/pm1.0",   "pms5003st/+/pm2.5",   "pms5003st/+/pm10",   "pms5003st/+/hcho",
+    "pms5003st/+/temp",    "pms5003st/+/humi",    "pms5003st/room1/#",  "pms5003st/room2/#",
+    "home/+/light/state",  "home/+/light/set",    "home/+/door/+",      "home/kitchen/#",
+    "sensors/+/battery",   "sensors/+/rssi",      "sensors/gw1/#",      "sensors/gw2/#",
+    "alerts/#",            "logs/+/error",        "logs/+/warn",        "status/+",
+    "cmd/device1/+",       "cmd/device2/+",       "cmd/device3/+",      "cmd/device4/+",
+    "fw/+/progress",       "fw/+/result",         "metrics/cpu/+",      "metrics/mem/+",
+    "bridge/envelope",     "$SYS/broker/clients", "$SYS/broker/load/#", "test/a/b/c/d/e/f",
+};
+
+#define SUBSCRIBE_N (int)(sizeof(SUBSCRIBE_FILTERS) / sizeof(SUBSCRIBE_FILTERS[0]))
+
+static char PAYLOAD[1024];
+
+static void
+_build_publish_small(mqtt_packet_t *pkt, mqtt_version_t ver) {
+    mqtt_packet_init(pkt, ver, MQTT_PUBLISH);
+    mqtt_str_from(&pkt->v.publish.topic_name, "pms5003st/room1/pm2.5");
+    mqtt_str_init(&pkt->p.publish.message, PAYLOAD, 32);
+}
+
+static void
+_build_publish_qos1(mqtt_packet_t *pkt, mqtt_version_t ver) {
+    mqtt_packet_init(pkt, ver, MQTT_PUBLISH);
+    pkt->f.bits.qos = MQTT_QOS_1;
+    pkt->v.publish.packet_id = 4242;
+    mqtt_str_from(&pkt->v.publish.topic_name, "pms5003st/room1/pm2.5");
+    mqtt_str_init(&pkt->p.publish.message, PAYLOAD, 512);
+}
+
+static void
+_build_publish_props(mqtt_packet_t *pkt, mqtt_version_t ver) {
+    uint8_t format = 1;
+    uint32_t expiry = 3600;
+
+    _build_publish_qos1(pkt, ver);
+    mqtt_properties_add(&pkt->v.publish.v5.properties, MQTT_PROPERTY_PAYLOAD_FORMAT_INDICATOR, &format, 0);
+    mqtt_properties_add(&pkt->v.publish.v5.properties, MQTT_PROPERTY_MESSAGE_EXPIRY_INTERVAL, &expiry, 0);
+    mqtt_properties_add(&pkt->v.publish.v5.properties, MQTT_PROPERTY_CONTENT_TYPE, "application/json", 0);
+    mqtt_properties_add(&pkt->v.publish.v5.properties, MQTT_PROPERTY_USER_PROPERTY, "room1", "location");
+    mqtt_properties_add(&pkt->v.publish.v5.properties, MQTT_PROPERTY_USER_PROPERTY, "pms5003st", "sensor");
+}
+
+static void
+_build_subscribe(mqtt_packet_t *pkt, mqtt_version_t ver) {
+    int i;
+
+    mqtt_packet_init(pkt, ver, MQTT_SUBSCRIBE);
+    pkt->v.subscribe.packet_id = 7;
+    mqtt_subscribe_generate(pkt, SUBSCRIBE_N);
+    for (i = 0; i < SUBSCRIBE_N; i++) {
+        mqtt_str_from(&pkt->p.subscribe.topic_filters[i], SUBSCRIBE_FILTERS[i]);
+        pkt->p.subscribe.options[i].bits.qos = i % 3;
+    }
+}
+
+static void
+_build_puback(mqtt_packet_t *pkt, mqtt_version_t ver) {
+    mqtt_packet_init(pkt, ver, MQTT_PUBACK);
+    pkt->v.puback.packet_id = 4242;
+}
+
+static void
+_build_connect(mqtt_packet_t *pkt, mqtt_version_t ver) {
+    mqtt_packet_init(pkt, ver, MQTT_CONNECT);
+    pkt->v.connect.keep_alive = 60;
+    pkt->v.connect.connect_flags.bits.clean_session = 1;
+    pkt->v.connect.connect_flags.bits.username_flag = 1;
+    pkt->v.connect.connect_flags.bits.password_flag = 1;
+    pkt->v.connect.connect_flags.bits.will_flag = 1;
+    pkt->v.connect.connect_flags.bits.will_qos = MQTT_QOS_1;
+    mqtt_str_from(&pkt->p.connect.client_id, "pms5003st-room1-0001");
+    mqtt_str_from(&pkt->p.connect.username, "sensor");
+    mqtt_str_from(&pkt->p.connect.password, "secret");
+    mqtt_str_from(&pkt->p.connect.will_topic, "pms5003st/room1/status");
+    mqtt_str_from(&pkt->p.connect.will_message, "offline");
+    if (ver == MQTT_VERSION_5) {
+        uint32_t expiry = 300;
+        uint16_t receive = 64;
+
+        mqtt_properties_add(&pkt->v.connect.v5.properties, MQTT_PROPERTY_SESSION_EXPIRY_INTERVAL, &expiry, 0);
+        mqtt_properties_add(&pkt->v.connect.v5.properties, MQTT_PROPERTY_RECEIVE_MAXIMUM, &receive, 0);
+    }
+}
+
+typedef struct {
+    const char *name;
+    mqtt_version_t min;
+    void (*build)(mqtt_packet_t *pkt, mqtt_version_t ver);
+} bench_case_t;
+
+static const bench_case_t CASES[] = {
+    { "publish-small", MQTT_VERSION_3, _build_publish_small },
+    { "publish-qos1", MQTT_VERSION_3, _build_publish_qos1 },
+    { "publish-props", MQTT_VERSION_5, _build_publish_props },
+    { "subscribe-32", MQTT_VERSION_3, _build_subscribe },
+    { "puback", MQTT_VERSION_3, _build_puback },
+    { "connect", MQTT_VERSION_3, _build_connect },
+};
+
+typedef struct {
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t allocs;
+    uint64_t ns;
+} bench_result_t;
+
+static void
+_report(const char *name, mqtt_version_t ver, const char *op, const bench_result_t *r) {
+    double s;
+
+    s = (double)r->ns / 1e9;
+    printf("%-14s v%d  %-10s %12.0f %10.1f %10.2f\n", name, ver, op, (double)r->packets / s,
+           (double)r->bytes / s / 1e6, (double)r->allocs / (double)r->packets);
+}
+
+#define BENCH_LOOP(r, body)                                                    \
+    do {                                                                       \
+        uint64_t _start, _end, _a;                                             \
+        _a = allocs;                                                           \
+        _start = bench_now_ns();                                               \
+        _end = _start + (uint64_t)B.ms * 1000000;                              \
+        do {                                                                   \
+            body;                                                              \
+        } while (bench_now_ns() < _end);                                       \
+        (r)->ns = bench_now_ns() - _start;                                     \
+        (r)->allocs = allocs - _a;                                             \
+    } while (0)
+
+static void
+_bench_serialize(mqtt_packet_t *pkt, bench_result_t *r) {
+    memset(r, 0, sizeof *r);
+    BENCH_LOOP(r, {
+        int i;
+
+        for (i = 0; i < 1024; i++) {
+            mqtt_str_t b;
+
+            mqtt_serialize(pkt, &b);
+            r->bytes += b.n;
+            mqtt_str_free(&b);
+        }
+        r->packets += 1024;
+    });
+}
+
+static void
+_bench_serialize_into(mqtt_packet_t *pkt, char *buf, size_t cap, bench_result_t *r) {
+    memset(r, 0, sizeof *r);
+    BENCH_LOOP(r, {
+        int i;
+
+        for (i = 0; i < 1024; i++) {
+            r->bytes += mqtt_serialize_into(pkt, buf, cap);
+        }
+        r->packets += 1024;
+    });
+}
+
+static void
+_bench_template(const mqtt_publish_template_t *tpl, const mqtt_packet_t *pkt, char *buf, bench_result_t *r) {
+    memset(r, 0, sizeof *r);
+    BENCH_LOOP(r, {
+        int i;
+
+        for (i = 0; i < 1024; i++) {
+            mqtt_str_t b;
+
+            mqtt_str_init(&b, buf, 0);
+            mqtt_publish_template_write(&b, tpl, pkt->v.publish.packet_id, &pkt->p.publish.message);
+            r->bytes += b.n;
+        }
+        r->packets += 1024;
+    });
+}
+
+/* parse the whole stream, chunk bytes at a time, 0 hands it over at once. */
+static void
+_bench_parse(mqtt_version_t ver, const mqtt_str_t *stream, size_t chunk, int zero_copy, bench_result_t *r) {
+    mqtt_parser_t parser;
+
+    mqtt_parser_init(&parser);
+    mqtt_parser_version(&parser, ver);
+    mqtt_parser_zero_copy(&parser, zero_copy);
+    memset(r, 0, sizeof *r);
+    BENCH_LOOP(r, {
+        size_t off;
+
+        for (off = 0; off < stream->n;) {
+            mqtt_str_t b;
+            mqtt_packet_t pkt;
+            size_t n;
+
+            n = chunk && chunk < stream->n - off ? chunk : stream->n - off;
+            mqtt_str_init(&b, stream->s + off, n);
+            while (mqtt_parse(&parser, &b, &pkt) == 1) {
+                r->packets++;
+                mqtt_packet_unit(&pkt);
+            }
+            off += n;
+        }
+        r->bytes += stream->n;
+    });
+    mqtt_parser_unit(&parser);
+}
+
+typedef struct {
+    const mqtt_str_t *stream;
+    size_t off;
+    size_t chunk;
+    uint64_t bytes;
+} bench_io_t;
+
+/* an endless socket replaying the stream in reads of at most chunk bytes. */
+static ssize_t
+_bench_io_read(void *io, void *buf, size_t n) {
+    bench_io_t *bio;
+
+    bio = (bench_io_t *)io;
+    if (n > bio->chunk)
+        n = bio->chunk;
+    if (n > bio->stream->n - bio->off)
+        n = bio->stream->n - bio->off;
+    memcpy(buf, bio->stream->s + bio->off, n);
+    bio->off = (bio->off + n) % bio->stream->n;
+    bio->bytes += n;
+    return (ssize_t)n;
+}
+
+static void
+_bench_read(mqtt_version_t ver, const mqtt_str_t *stream, bench_result_t *r) {
+    mqtt_reader_t reader;
+    bench_io_t bio;
+
+    bio.stream = stream;
+    bio.off = 0;
+    bio.chunk = 1460;
+    bio.bytes = 0;
+    memset(r, 0, sizeof *r);
+    if (mqtt_reader_init_buffered(&reader, &bio, _bench_io_read)) {
+        fprintf(stderr, "mqtt_reader_init_buffered(): out of memory\n");
+        return;
+    }
+    mqtt_parser_version(&reader.parser, ver);
+    BENCH_LOOP(r, {
+        int i;
+
+        for (i = 0; i < 256; i++) {
+            mqtt_packet_t pkt;
+
+            if (mqtt_read(&reader, &pkt) != 1)
+                break;
+            r->packets++;
+            mqtt_packet_unit(&pkt);
+        }
+    });
+    r->bytes = bio.bytes;
+    mqtt_reader_unit(&reader);
+}
+
+static void
+_bench_case(const bench_case_t *c, mqtt_version_t ver) {
+    mqtt_packet_t pkt;
+    mqtt_str_t one, stream;
+    bench_result_t r;
+    size_t copies, i;
+
+    c->build(&pkt, ver);
+    if (mqtt_serialize(&pkt, &one)) {
+        fprintf(stderr, "%s v%d: mqtt_serialize() failed\n", c->name, ver);
+        mqtt_packet_unit(&pkt);
+        return;
+    }
+
+    _bench_serialize(&pkt, &r);
+    _report(c->name, ver, "serialize", &r);
+    _bench_serialize_into(&pkt, one.s, one.n, &r);
+    _report(c->name, ver, "into", &r);
+    if (pkt.f.bits.type == MQTT_PUBLISH && pkt.v.publish.v5.properties.n == 0) {
+        mqtt_publish_template_t tpl;
+
+        mqtt_publish_template_init(&tpl, ver, pkt.v.publish.topic_name.s, (mqtt_qos_t)pkt.f.bits.qos,
+                                   pkt.f.bits.retain);
+        _bench_template(&tpl, &pkt, one.s, &r);
+        _report(c->name, ver, "template", &r);
+    }
+
+    /* the same packet back to back, enough copies to fill the stream. */
+    copies = B.stream / one.n + 1;
+    stream.n = copies * one.n;
+    stream.s = (char *)malloc(stream.n);
+    for (i = 0; i < copies; i++) {
+        memcpy(stream.s + i * one.n, one.s, one.n);
+    }
+
+    _bench_parse(ver, &stream, 0, 0, &r);
+    _report(c->name, ver, "parse", &r);
+    _bench_parse(ver, &stream, 0, 1, &r);
+    _report(c->name, ver, "parse-zc", &r);
+    _bench_parse(ver, &stream, B.fragment, 1, &r);
+    _report(c->name, ver, "fragment", &r);
+    _bench_read(ver, &stream, &r);
+    _report(c->name, ver, "read", &r);
+
+    free(stream.s);
+    mqtt_str_free(&one);
+    mqtt_packet_unit(&pkt);
+}
+
+static void
+_usage(const char *name) {
+    size_t i;
+
+    printf("usage: %s [-t ms] [-f fragment] [-s stream] [-V version] [case]\n", name);
+    printf("  -t milliseconds spent on every measurement\n");
+    printf("  -f bytes handed to mqtt_parse at a time in the fragment run\n");
+    printf("  -s bytes of back to back packets the parse runs go through\n");
+    printf("cases:");
+    for (i = 0; i < sizeof(CASES) / sizeof(CASES[0]); i++) {
+        printf(" %s", CASES[i].name);
+    }
+    printf("\n");
+}
+
+int
+main(int argc, char *argv[]) {
+    size_t i;
+    int opt, ver;
+
+    while ((opt = getopt(argc, argv, "t:f:s:V:")) != -1) {
+        switch (opt) {
+        case 't':
+            B.ms = atoi(optarg);
+            break;
+        case 'f':
+            B.fragment = strtoul(optarg, 0, 10);
+            break;
+        case 's':
+            B.stream = strtoul(optarg, 0, 10);
+            break;
+        case 'V':
+            B.version = (mqtt_version_t)atoi(optarg);
+            break;
+        default:
+            _usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (B.ms <= 0 || B.fragment == 0 || (B.version && !MQTT_IS_VERSION(B.version))) {
+        _usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (optind < argc)
+        B.only = argv[optind];
+
+    memset(PAYLOAD, 'x', sizeof PAYLOAD);
+    printf("%-14s %-3s %-10s %12s %10s %10s\n", "case", "ver", "op", "pkt/s", "MB/s", "allocs/pkt");
+    for (i = 0; i < sizeof(CASES) / sizeof(CASES[0]); i++) {
+        if (B.only && strcmp(B.only, CASES[i].name))
+            continue;
+        for (ver = MQTT_VERSION_3; ver <= MQTT_VERSION_5; ver++) {
+            if (ver < (int)CASES[i].min || (B.version && ver != (int)B.version))
+                continue;
+            _bench_case(&CASES[i], (mqtt_version_t)ver);
+        }
+    }
+
+    return 0;
+}
@@ -31,6 +31,7 @@
 #define _MQTT_H_
 
 /* generic includes. */
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -42,6 +43,9 @@
 #define MQTT_WS_PORT    8083
 #define MQTT_WSS_PORT   8084
 
+/* largest remaining length a variable byte integer can carry */
+#define MQTT_MAX_REMAINING_LENGTH 268435455
+
 /* mqtt-sn gateway port */
 #define MQTT_SN_UDP_PORT    1884
 
@@ -853,8 +857,9 @@ typedef struct {
     size_t n;
 } mqtt_str_t;
 
-typedef struct mqtt_property_s {
+typedef struct {
     mqtt_property_code_t code;
+    uint32_t length;
     union {
         uint8_t b1;
         uint16_t b2;
@@ -867,15 +872,19 @@ typedef struct mqtt_property_s {
             mqtt_str_t value;
         } pair;
     };
-    struct mqtt_property_s *next;
 } mqtt_property_t;
 
+/* first allocation of a properties array, it doubles from there. */
+#define MQTT_PROPERTIES_MIN 4
+
 #define MQTT_PROPERTIES_INITIALIZER \
-    { 0, 0 }
+    { 0, 0, 0 }
 
+/* a heap array in wire order, allocated by the first property added. */
 typedef struct {
-    mqtt_property_t *head;
-    size_t length;
+    mqtt_property_t *items;
+    int n;
+    uint32_t length;
 } mqtt_properties_t;
 
 typedef union {
@@ -937,7 +946,8 @@ typedef struct {
 typedef struct {
     mqtt_str_t client_id;
     struct {
-        mqtt_properties_t will_properties;
+        /* rare, so kept off the packet, 0 reads as no properties. */
+        mqtt_properties_t *will_properties;
     } v5;
     mqtt_str_t will_topic;
     mqtt_str_t will_message;
@@ -1227,6 +1237,28 @@ typedef struct {
     mqtt_str_t b;
 } mqtt_packet_t;
 
+/*
+ * PUBLISH header prepared once for a fixed topic, qos and retain. the topic
+ * is not copied, it must outlive the template.
+ */
+typedef struct {
+    uint8_t flags;
+    uint8_t topic_length[2];
+    mqtt_version_t ver;
+    mqtt_str_t topic;
+    /* remaining length without the message. */
+    size_t remaining;
+} mqtt_publish_template_t;
+
+/* compile-time template, topic must be a string literal. */
+#define MQTT_PUBLISH_TEMPLATE_INITIALIZER(v, t, q, r)                                                  \
+    {                                                                                                  \
+        .flags = (uint8_t)(MQTT_PUBLISH << 4 | (q) << 1 | ((r) ? 1 : 0)),                              \
+        .topic_length = { (uint8_t)((sizeof(t) - 1) >> 8), (uint8_t)(sizeof(t) - 1) }, .ver = (v),    \
+        .topic = { (char *)(t), sizeof(t) - 1 },                                                       \
+        .remaining = 2 + sizeof(t) - 1 + ((q) > MQTT_QOS_0 ? 2 : 0) + ((v) == MQTT_VERSION_5 ? 1 : 0), \
+    }
+
 typedef enum {
     MQTT_ST_FIXED,
     MQTT_ST_LENGTH,
@@ -1238,13 +1270,21 @@ typedef struct {
     mqtt_parser_state_t state;
     size_t require;
     int multiplier;
+    int zero_copy;
+    int strict;
     mqtt_packet_t pkt;
 } mqtt_parser_t;
 
+/* read-ahead buffer size of a buffered mqtt_reader_t. */
+#define MQTT_READER_BUFF_SIZE 4096
+
 typedef struct {
     mqtt_parser_t parser;
     void *io;
     ssize_t (*read)(void *io, void *, size_t);
+    char *buff;
+    size_t off;
+    size_t n;
 } mqtt_reader_t;
 
 typedef union {
@@ -1458,6 +1498,49 @@ typedef struct {
     ssize_t (*read)(void *io, void *, size_t);
 } mqtt_sn_reader_t;
 
+/* topic filter trie, one node per level, + and # children kept apart. */
+typedef struct mqtt_topic_node_s {
+    mqtt_str_t level;
+    struct mqtt_topic_node_s **children;
+    int n;
+    int size;
+    struct mqtt_topic_node_s *plus;
+    struct mqtt_topic_node_s *hash;
+    void **values;
+    int nvalues;
+} mqtt_topic_node_t;
+
+typedef struct {
+    mqtt_topic_node_t root;
+    size_t count;
+} mqtt_topic_tree_t;
+
+typedef void (*mqtt_topic_match_pt)(void *ud, void *value);
+
+typedef enum {
+    MQTT_TOPIC_TOKEN_LEVEL,
+    MQTT_TOPIC_TOKEN_PLUS,
+    MQTT_TOPIC_TOKEN_HASH
+} mqtt_topic_token_op_t;
+
+typedef struct {
+    uint8_t op;
+    uint16_t off;
+    uint16_t n;
+} mqtt_topic_token_t;
+
+/*
+ * a topic filter compiled for repeated matching. the literal bytes before
+ * the first wildcard are compared at once, the levels after it run as tokens.
+ */
+typedef struct {
+    char *s;
+    size_t n;
+    size_t prefix;
+    mqtt_topic_token_t *tokens;
+    int ntokens;
+} mqtt_topic_filter_t;
+
 static inline void
 mqtt_str_init(mqtt_str_t *b, char *s, size_t n) {
     b->s = s;
@@ -1599,12 +1682,16 @@ mqtt_vbi_length(size_t length) {
 static inline size_t
 mqtt_str_read_utf(mqtt_str_t *b, mqtt_str_t *r) {
     uint8_t *s = (uint8_t *)b->s;
-    size_t n = ((*s << 8) + *(s + 1));
-    if (n > 0 && b->n >= n) {
+    size_t n;
+
+    if (b->n < 2)
+        return 0;
+    n = ((*s << 8) + *(s + 1));
+    if (b->n >= n + 2) {
         r->n = n;
-        r->s = b->s + 2;
-        b->s += r->n + 2;
-        b->n -= r->n + 2;
+        r->s = n > 0 ? b->s + 2 : 0;
+        b->s += n + 2;
+        b->n -= n + 2;
         return 2 + n;
     }
     return 0;
@@ -1642,20 +1729,28 @@ mqtt_str_read_u32(mqtt_str_t *b) {
 
 static inline uint32_t
 mqtt_str_read_vbi(mqtt_str_t *b, size_t *len) {
-    uint32_t vbi = 0;
-    size_t n = 0;
-    int multiplier = 1;
-    uint8_t c;
+    const uint8_t *s = (const uint8_t *)b->s;
+    uint32_t vbi;
+    size_t n;
 
-    do {
-        if (!b->n)
-            break;
-        c = *((uint8_t *)b->s++);
-        b->n--;
-        n++;
-        vbi += (c & 0x7F) * multiplier;
-        multiplier *= 0x80;
-    } while ((c & 0x80));
+    /* one and two byte values cover everything below 16 KB. */
+    if (b->n >= 1 && s[0] < 0x80) {
+        vbi = s[0];
+        n = 1;
+    } else if (b->n >= 2 && s[1] < 0x80) {
+        vbi = (uint32_t)(s[0] & 0x7F) | (uint32_t)s[1] << 7;
+        n = 2;
+    } else {
+        vbi = 0;
+        n = 0;
+        while (n < b->n && n < 4) {
+            vbi |= (uint32_t)(s[n] & 0x7F) << (7 * n);
+            if (!(s[n++] & 0x80))
+                break;
+        }
+    }
+    b->s += n;
+    b->n -= n;
     if (len)
         *len = n;
     return vbi;
@@ -1690,19 +1785,32 @@ mqtt_str_write_u32(mqtt_str_t *b, uint32_t r) {
     b->s[b->n++] = (char)(r & 0x000000ff);
 }
 
+/* vbi is at most MQTT_MAX_REMAINING_LENGTH. */
 static inline int
 mqtt_str_write_vbi(mqtt_str_t *b, uint32_t vbi) {
-    int n = 0;
+    uint8_t *s = (uint8_t *)b->s + b->n;
+    int n;
 
-    do {
-        uint8_t c;
-        c = vbi % 0x80;
-        vbi /= 0x80;
-        if (vbi > 0)
-            c |= 0x80;
-        b->s[b->n++] = (char)c;
-        n++;
-    } while (vbi > 0);
+    if (vbi < 0x80) {
+        s[0] = (uint8_t)vbi;
+        n = 1;
+    } else if (vbi < 0x4000) {
+        s[0] = (uint8_t)(vbi | 0x80);
+        s[1] = (uint8_t)(vbi >> 7);
+        n = 2;
+    } else if (vbi < 0x200000) {
+        s[0] = (uint8_t)(vbi | 0x80);
+        s[1] = (uint8_t)(vbi >> 7 | 0x80);
+        s[2] = (uint8_t)(vbi >> 14);
+        n = 3;
+    } else {
+        s[0] = (uint8_t)(vbi | 0x80);
+        s[1] = (uint8_t)(vbi >> 7 | 0x80);
+        s[2] = (uint8_t)(vbi >> 14 | 0x80);
+        s[3] = (uint8_t)(vbi >> 21);
+        n = 4;
+    }
+    b->n += n;
     return n;
 }
 
@@ -1720,6 +1828,29 @@ mqtt_topic_wildcard(mqtt_str_t *topic) {
     return 0;
 }
 
+/* + and # must fill a level, and # must be the last one. */
+static inline int
+mqtt_topic_filter_valid(const mqtt_str_t *filter) {
+    size_t i;
+
+    if (filter->n == 0)
+        return 0;
+    for (i = 0; i < filter->n; i++) {
+        char c;
+
+        c = filter->s[i];
+        if (c != '+' && c != '#')
+            continue;
+        if (i > 0 && filter->s[i - 1] != '/')
+            return 0;
+        if (c == '#' && i + 1 != filter->n)
+            return 0;
+        if (c == '+' && i + 1 < filter->n && filter->s[i + 1] != '/')
+            return 0;
+    }
+    return 1;
+}
+
 static inline void
 mqtt_sn_topic_set(mqtt_sn_topic_t *dst, mqtt_sn_topic_t *src) {
     if (src->type == MQTT_SN_TOPIC_ID_TYPE_NORMAL) {
@@ -1815,15 +1946,18 @@ mqtt_property_valid(mqtt_property_code_t code, mqtt_packet_type_t type, int will
     return 0;
 }
 
+static inline mqtt_property_t *
+mqtt_properties_at(const mqtt_properties_t *properties, int i) {
+    return &properties->items[i];
+}
+
 static inline int
 mqtt_properties_valid(const mqtt_properties_t *properties, mqtt_packet_type_t type, int will) {
-    mqtt_property_t *property;
+    int i;
 
-    property = properties->head;
-    while (property) {
-        if (!mqtt_property_valid(property->code, type, will))
+    for (i = 0; i < properties->n; i++) {
+        if (!mqtt_property_valid(mqtt_properties_at(properties, i)->code, type, will))
             return 0;
-        property = property->next;
     }
     return 1;
 }
@@ -1867,6 +2001,12 @@ mqtt_unsuback_generate(mqtt_packet_t *pkt, int n) {
     }
 }
 
+static inline void
+mqtt_will_properties_generate(mqtt_packet_t *pkt) {
+    if (!pkt->p.connect.v5.will_properties)
+        pkt->p.connect.v5.will_properties = (mqtt_properties_t *)calloc(1, sizeof(mqtt_properties_t));
+}
+
 void mqtt_packet_init(mqtt_packet_t *pkt, mqtt_version_t ver, mqtt_packet_type_t type);
 
 void mqtt_packet_unit(mqtt_packet_t *pkt);
@@ -1876,6 +2016,39 @@ void mqtt_packet_unit(mqtt_packet_t *pkt);
  */
 int mqtt_serialize(mqtt_packet_t *pkt, mqtt_str_t *b);
 
+/**
+ * bytes mqtt_serialize_into() needs for pkt, -1 when pkt is invalid.
+ */
+ssize_t mqtt_serialized_size(const mqtt_packet_t *pkt);
+
+/**
+ * serialize pkt into buf without allocating.
+ * returns the bytes written, -1 when pkt is invalid or does not fit in cap.
+ */
+ssize_t mqtt_serialize_into(const mqtt_packet_t *pkt, char *buf, size_t cap);
+
+/**
+ * PUBLISH fast path, no intermediate mqtt_packet_t.
+ * mqtt_publish_length returns the exact encoded size of the packet,
+ * mqtt_publish_write writes it at b->s + b->n, the caller makes sure there is room.
+ * properties is only used for mqttv5.0 and may be null.
+ */
+size_t mqtt_publish_length(mqtt_version_t ver, mqtt_qos_t qos, const mqtt_str_t *topic,
+                           const mqtt_properties_t *properties, size_t message_n);
+void mqtt_publish_write(mqtt_str_t *b, mqtt_version_t ver, mqtt_fixed_header_t f, const mqtt_str_t *topic,
+                        uint16_t packet_id, const mqtt_properties_t *properties, const mqtt_str_t *message);
+
+/**
+ * PUBLISH from a template, per message only the remaining length, packet id
+ * and message are written. init returns -1 for a topic a PUBLISH can not
+ * carry, length and write follow mqtt_publish_length and mqtt_publish_write.
+ */
+int mqtt_publish_template_init(mqtt_publish_template_t *tpl, mqtt_version_t ver, const char *topic, mqtt_qos_t qos,
+                               int retain);
+size_t mqtt_publish_template_length(const mqtt_publish_template_t *tpl, size_t message_n);
+void mqtt_publish_template_write(mqtt_str_t *b, const mqtt_publish_template_t *tpl, uint16_t packet_id,
+                                 const mqtt_str_t *message);
+
 /**
  * mqtt packet parser funcs.
  */
@@ -1883,6 +2056,24 @@ void mqtt_parser_init(mqtt_parser_t *parser);
 void mqtt_parser_version(mqtt_parser_t *parser, mqtt_version_t version);
 void mqtt_parser_unit(mqtt_parser_t *parser);
 
+/**
+ * with zero_copy a packet wholly inside the input is parsed in place, its
+ * fields point into the input and pkt->b is left empty. packets split across
+ * inputs are still reassembled in a buffer of their own.
+ */
+void mqtt_parser_zero_copy(mqtt_parser_t *parser, int zero_copy);
+
+/**
+ * with strict, topic names, topic filters, the connect strings and v5 string
+ * properties must be well-formed UTF-8 without U+0000, else parsing fails.
+ */
+void mqtt_parser_strict(mqtt_parser_t *parser, int strict);
+
+/**
+ * 1 when s is well-formed UTF-8 without U+0000, as MQTT requires of strings.
+ */
+int mqtt_utf8_valid(const char *s, size_t n);
+
 /**
  * parse data/size pair into mqtt packets
  * return:
@@ -1893,9 +2084,27 @@ void mqtt_parser_unit(mqtt_parser_t *parser);
 int mqtt_parse(mqtt_parser_t *parser, mqtt_str_t *b, mqtt_packet_t *pkt);
 
 /**
- * mqtt packet reader funcs.
+ * parse up to max packets from b into pkts, each needs mqtt_packet_unit().
+ * frame boundaries are found first, then every complete packet is decoded
+ * straight into pkts. a trailing partial packet is kept by the parser.
+ * return the number of packets parsed, -1 on a parse error. packets before
+ * a malformed one are still returned, the error comes with the next call.
+ */
+int mqtt_parse_batch(mqtt_parser_t *parser, mqtt_str_t *b, mqtt_packet_t *pkts, int max);
+
+/**
+ * mqtt packet reader funcs. read must return exactly the size asked for,
+ * anything else fails the packet.
  */
 void mqtt_reader_init(mqtt_reader_t *reader, void *io, ssize_t (*read)(void *io, void *, size_t));
+
+/**
+ * reader whose read behaves like read(2), it returns what is available up
+ * to the size asked for. what goes beyond the current packet is kept in a
+ * read-ahead buffer for the next one, mqtt_reader_unit frees it.
+ * return -1 when the buffer cannot be allocated.
+ */
+int mqtt_reader_init_buffered(mqtt_reader_t *reader, void *io, ssize_t (*read)(void *io, void *, size_t));
 void mqtt_reader_version(mqtt_reader_t *reader, mqtt_version_t version);
 void mqtt_reader_unit(mqtt_reader_t *reader);
 
@@ -1912,7 +2121,35 @@ int mqtt_read(mqtt_reader_t *reader, mqtt_packet_t *pkt);
  */
 void mqtt_properties_add(mqtt_properties_t *properties, mqtt_property_code_t code, const void *value, const char *name);
 mqtt_property_t *mqtt_properties_find(mqtt_properties_t *properties, mqtt_property_code_t code);
-mqtt_property_t *mqtt_properties_remove(mqtt_properties_t *properties, mqtt_property_code_t code);
+int mqtt_properties_remove(mqtt_properties_t *properties, mqtt_property_code_t code);
+
+/**
+ * topic filter trie. a filter may hold several values, match calls back
+ * once for every value whose filter matches the topic name.
+ */
+void mqtt_topic_tree_init(mqtt_topic_tree_t *tree);
+void mqtt_topic_tree_unit(mqtt_topic_tree_t *tree, void (*free_value)(void *value));
+int mqtt_topic_tree_insert(mqtt_topic_tree_t *tree, const mqtt_str_t *filter, void *value);
+int mqtt_topic_tree_remove(mqtt_topic_tree_t *tree, const mqtt_str_t *filter, void *value);
+void **mqtt_topic_tree_get(mqtt_topic_tree_t *tree, const mqtt_str_t *filter, int *n);
+void mqtt_topic_tree_match(mqtt_topic_tree_t *tree, const mqtt_str_t *topic, mqtt_topic_match_pt match, void *ud);
+
+/**
+ * 1 if topic name matches filter, for checking a single pair.
+ */
+int mqtt_topic_match(const mqtt_str_t *filter, const mqtt_str_t *topic);
+
+/**
+ * compile filter for matching against many topic names, the filter is copied.
+ * return -1 if filter is not a valid topic filter.
+ */
+int mqtt_topic_filter_compile(mqtt_topic_filter_t *compiled, const mqtt_str_t *filter);
+void mqtt_topic_filter_unit(mqtt_topic_filter_t *compiled);
+
+/**
+ * 1 if topic name matches the compiled filter, never allocates.
+ */
+int mqtt_topic_filter_match(const mqtt_topic_filter_t *compiled, const mqtt_str_t *topic);
 
 void mqtt_sn_packet_init(mqtt_sn_packet_t *pkt, mqtt_sn_packet_type_t type);
 
@@ -1956,24 +2193,128 @@ int mqtt_sn_read(mqtt_sn_reader_t *reader, mqtt_sn_packet_t *pkt);
 
 #ifdef MQTT_IMPL
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* every parser and stack packet pays for this, fail the build if it creeps back up. */
+_Static_assert(sizeof(mqtt_packet_t) <= 160, "mqtt_packet_t grew");
+
 static void
 __properties_free(mqtt_properties_t *properties) {
+    if (properties->items)
+        free(properties->items);
+    properties->items = 0;
+    properties->n = 0;
+    properties->length = 0;
+}
+
+/* append a slot for code, the caller fills in the value and its length. */
+static mqtt_property_t *
+__properties_push(mqtt_properties_t *properties, mqtt_property_code_t code) {
     mqtt_property_t *property;
+    int i;
+
+    /* the size follows from n, full at MQTT_PROPERTIES_MIN and every power of two above. */
+    i = properties->n;
+    if (!properties->items || (i >= MQTT_PROPERTIES_MIN && !(i & (i - 1)))) {
+        properties->items = (mqtt_property_t *)realloc(
+            properties->items, (i < MQTT_PROPERTIES_MIN ? MQTT_PROPERTIES_MIN : i * 2) * sizeof(mqtt_property_t));
+    }
+    properties->n++;
+    property = mqtt_properties_at(properties, i);
+    memset(property, 0, sizeof *property);
+    property->code = code;
+    return property;
+}
 
-    property = properties->head;
-    while (property) {
-        mqtt_property_t *next;
-        next = property->next;
-        free(property);
-        property = next;
+static void
+__properties_reset(mqtt_properties_t *properties) {
+    properties->items = 0;
+    properties->n = 0;
+    properties->length = 0;
+}
+
+/*
+ * clear the fields of type only, every variable header keeps its properties
+ * last, so it is zeroed up to them and the container is reset.
+ */
+static void
+__packet_reset(mqtt_packet_t *pkt, mqtt_packet_type_t type) {
+    pkt->ver = (mqtt_version_t)0;
+    pkt->f.flags = 0;
+    pkt->f.bits.type = type;
+    mqtt_str_init(&pkt->b, 0, 0);
+    switch (type) {
+    case MQTT_CONNECT:
+        memset(&pkt->v.connect, 0, offsetof(mqtt_v_connect_t, v5.properties));
+        __properties_reset(&pkt->v.connect.v5.properties);
+        memset(&pkt->p.connect, 0, sizeof pkt->p.connect);
+        break;
+    case MQTT_CONNACK:
+        memset(&pkt->v.connack, 0, offsetof(mqtt_v_connack_t, v5.properties));
+        __properties_reset(&pkt->v.connack.v5.properties);
+        break;
+    case MQTT_PUBLISH:
+        memset(&pkt->v.publish, 0, offsetof(mqtt_v_publish_t, v5.properties));
+        __properties_reset(&pkt->v.publish.v5.properties);
+        memset(&pkt->p.publish, 0, sizeof pkt->p.publish);
+        break;
+    case MQTT_PUBACK:
+        memset(&pkt->v.puback, 0, offsetof(mqtt_v_puback_t, v5.properties));
+        __properties_reset(&pkt->v.puback.v5.properties);
+        break;
+    case MQTT_PUBREC:
+        memset(&pkt->v.pubrec, 0, offsetof(mqtt_v_pubrec_t, v5.properties));
+        __properties_reset(&pkt->v.pubrec.v5.properties);
+        break;
+    case MQTT_PUBREL:
+        memset(&pkt->v.pubrel, 0, offsetof(mqtt_v_pubrel_t, v5.properties));
+        __properties_reset(&pkt->v.pubrel.v5.properties);
+        break;
+    case MQTT_PUBCOMP:
+        memset(&pkt->v.pubcomp, 0, offsetof(mqtt_v_pubcomp_t, v5.properties));
+        __properties_reset(&pkt->v.pubcomp.v5.properties);
+        break;
+    case MQTT_SUBSCRIBE:
+        memset(&pkt->v.subscribe, 0, offsetof(mqtt_v_subscribe_t, v5.properties));
+        __properties_reset(&pkt->v.subscribe.v5.properties);
+        memset(&pkt->p.subscribe, 0, sizeof pkt->p.subscribe);
+        break;
+    case MQTT_SUBACK:
+        memset(&pkt->v.suback, 0, offsetof(mqtt_v_suback_t, v5.properties));
+        __properties_reset(&pkt->v.suback.v5.properties);
+        memset(&pkt->p.suback, 0, sizeof pkt->p.suback);
+        break;
+    case MQTT_UNSUBSCRIBE:
+        memset(&pkt->v.unsubscribe, 0, offsetof(mqtt_v_unsubscribe_t, v5.properties));
+        __properties_reset(&pkt->v.unsubscribe.v5.properties);
+        memset(&pkt->p.unsubscribe, 0, sizeof pkt->p.unsubscribe);
+        break;
+    case MQTT_UNSUBACK:
+        memset(&pkt->v.unsuback, 0, offsetof(mqtt_v_unsuback_t, v5.properties));
+        __properties_reset(&pkt->v.unsuback.v5.properties);
+        memset(&pkt->p.unsuback, 0, sizeof pkt->p.unsuback);
+        break;
+    case MQTT_DISCONNECT:
+        memset(&pkt->v.disconnect, 0, offsetof(mqtt_v_disconnect_t, v5.properties));
+        __properties_reset(&pkt->v.disconnect.v5.properties);
+        break;
+    case MQTT_AUTH:
+        memset(&pkt->v.auth, 0, offsetof(mqtt_v_auth_t, v5.properties));
+        __properties_reset(&pkt->v.auth.v5.properties);
+        break;
+    case MQTT_PINGREQ:
+    case MQTT_PINGRESP:
+    case MQTT_RESERVED:
+        break;
     }
 }
 
 void
 mqtt_packet_init(mqtt_packet_t *pkt, mqtt_version_t ver, mqtt_packet_type_t type) {
-    memset(pkt, 0, sizeof *pkt);
+    __packet_reset(pkt, type);
     pkt->ver = ver;
-    pkt->f.bits.type = type;
     if (type == MQTT_CONNECT) {
         mqtt_str_from(&pkt->v.connect.protocol_name, MQTT_PROTOCOL_NAMES[pkt->ver]);
         pkt->v.connect.protocol_version = pkt->ver;
@@ -1985,7 +2326,10 @@ mqtt_packet_unit(mqtt_packet_t *pkt) {
     switch (pkt->f.bits.type) {
     case MQTT_CONNECT:
         __properties_free(&pkt->v.connect.v5.properties);
-        __properties_free(&pkt->p.connect.v5.will_properties);
+        if (pkt->p.connect.v5.will_properties) {
+            __properties_free(pkt->p.connect.v5.will_properties);
+            free(pkt->p.connect.v5.will_properties);
+        }
         break;
     case MQTT_CONNACK:
         __properties_free(&pkt->v.connack.v5.properties);
@@ -2060,6 +2404,8 @@ __property_parse(mqtt_property_t *property, mqtt_str_t *b) {
     if (!b->n)
         return -1;
     property->code = (mqtt_property_code_t)mqtt_str_read_u8(b);
+    if (!MQTT_IS_PROPERTY(property->code))
+        return -1;
 
     len = 1;
     type = MQTT_PROPERTY_DEFS[property->code].type;
@@ -2097,6 +2443,7 @@ __property_parse(mqtt_property_t *property, mqtt_str_t *b) {
         len += mqtt_str_read_utf(b, &property->pair.value);
         break;
     }
+    property->length = (uint32_t)len;
     return len;
 }
 
@@ -2110,20 +2457,16 @@ __properties_parse(mqtt_properties_t *properties, mqtt_str_t *b) {
 
     properties->length = length;
     while (length > 0) {
-        mqtt_property_t *property;
+        mqtt_property_t property;
         ssize_t len;
 
-        property = (mqtt_property_t *)malloc(sizeof *property);
-        memset(property, 0, sizeof *property);
-        len = __property_parse(property, b);
-        if (-1 == len) {
-            free(property);
+        memset(&property, 0, sizeof property);
+        len = __property_parse(&property, b);
+        if (-1 == len || (uint32_t)len > length)
             return -1;
-        }
         length -= len;
 
-        property->next = properties->head;
-        properties->head = property;
+        *__properties_push(properties, property.code) = property;
     }
     return 0;
 }
@@ -2163,9 +2506,10 @@ __parse_connect(mqtt_str_t *remaining, mqtt_packet_t *pkt) {
     mqtt_str_read_utf(remaining, &p->client_id);
     if (v->connect_flags.bits.will_flag) {
         if (pkt->ver == MQTT_VERSION_5) {
-            if (__properties_parse(&p->v5.will_properties, remaining))
+            mqtt_will_properties_generate(pkt);
+            if (__properties_parse(p->v5.will_properties, remaining))
                 return -1;
-            if (!mqtt_properties_valid(&p->v5.will_properties, MQTT_RESERVED, 1))
+            if (!mqtt_properties_valid(p->v5.will_properties, MQTT_RESERVED, 1))
                 return -1;
         }
         if (remaining->n <= 2)
@@ -2254,7 +2598,8 @@ __parse_publish(mqtt_str_t *remaining, mqtt_packet_t *pkt) {
         return -1;
     }
     mqtt_str_read_utf(remaining, &v->topic_name);
-    if (mqtt_str_empty(&v->topic_name))
+    /* mqttv5.0 may send a zero length topic name together with a topic alias. */
+    if (mqtt_str_empty(&v->topic_name) && pkt->ver != MQTT_VERSION_5)
         return -1;
     if (pkt->f.bits.qos > MQTT_QOS_0) {
         if (remaining->n < 2)
@@ -2702,14 +3047,176 @@ __parse_auth(mqtt_str_t *remaining, mqtt_packet_t *pkt) {
     return 0;
 }
 
+int
+mqtt_utf8_valid(const char *s, size_t n) {
+    const uint8_t *p, *e;
+
+    p = (const uint8_t *)s;
+    e = p + n;
+    while (p < e) {
+        uint8_t c, lo, hi;
+        int k, i;
+
+        /* skip ascii without nul a block at a time, topics rarely hold anything else. */
+#ifdef __SSE2__
+        while (e - p >= 16) {
+            __m128i v;
+
+            v = _mm_loadu_si128((const __m128i *)p);
+            if (_mm_movemask_epi8(_mm_or_si128(v, _mm_cmpeq_epi8(v, _mm_setzero_si128()))))
+                break;
+            p += 16;
+        }
+#endif
+        while (e - p >= 8) {
+            uint64_t w;
+
+            memcpy(&w, p, 8);
+            if ((w | ((w - 0x0101010101010101ULL) & ~w)) & 0x8080808080808080ULL)
+                break;
+            p += 8;
+        }
+        if (p == e)
+            break;
+
+        c = *p;
+        if (c < 0x80) {
+            if (!c)
+                return 0;
+            p++;
+            continue;
+        }
+        /* the second byte range excludes overlongs, surrogates and code points past U+10FFFF. */
+        if (c < 0xC2) {
+            return 0;
+        } else if (c < 0xE0) {
+            k = 1;
+            lo = 0x80;
+            hi = 0xBF;
+        } else if (c < 0xF0) {
+            k = 2;
+            lo = c == 0xE0 ? 0xA0 : 0x80;
+            hi = c == 0xED ? 0x9F : 0xBF;
+        } else if (c < 0xF5) {
+            k = 3;
+            lo = c == 0xF0 ? 0x90 : 0x80;
+            hi = c == 0xF4 ? 0x8F : 0xBF;
+        } else {
+            return 0;
+        }
+        if (e - p <= k || p[1] < lo || p[1] > hi)
+            return 0;
+        for (i = 2; i <= k; i++) {
+            if ((p[i] & 0xC0) != 0x80)
+                return 0;
+        }
+        p += k + 1;
+    }
+    return 1;
+}
+
+static int
+__properties_utf8_valid(const mqtt_properties_t *properties) {
+    int i;
+
+    for (i = 0; i < properties->n; i++) {
+        const mqtt_property_t *property;
+
+        property = mqtt_properties_at(properties, i);
+        switch (MQTT_PROPERTY_DEFS[property->code].type) {
+        case MQTT_PROPERTY_TYPE_UTF_8_ENCODED_STRING:
+            if (!mqtt_utf8_valid(property->str.s, property->str.n))
+                return 0;
+            break;
+        case MQTT_PROPERTY_TYPE_UTF_8_STRING_PAIR:
+            if (!mqtt_utf8_valid(property->pair.name.s, property->pair.name.n) ||
+                !mqtt_utf8_valid(property->pair.value.s, property->pair.value.n))
+                return 0;
+            break;
+        default:
+            break;
+        }
+    }
+    return 1;
+}
+
+static int
+__packet_utf8_valid(const mqtt_packet_t *pkt) {
+    const mqtt_properties_t *properties;
+    int i;
+
+    properties = 0;
+    switch (pkt->f.bits.type) {
+    case MQTT_CONNECT:
+        if (!mqtt_utf8_valid(pkt->p.connect.client_id.s, pkt->p.connect.client_id.n) ||
+            !mqtt_utf8_valid(pkt->p.connect.will_topic.s, pkt->p.connect.will_topic.n) ||
+            !mqtt_utf8_valid(pkt->p.connect.username.s, pkt->p.connect.username.n))
+            return 0;
+        if (pkt->ver == MQTT_VERSION_5 && pkt->p.connect.v5.will_properties &&
+            !__properties_utf8_valid(pkt->p.connect.v5.will_properties))
+            return 0;
+        properties = &pkt->v.connect.v5.properties;
+        break;
+    case MQTT_CONNACK:
+        properties = &pkt->v.connack.v5.properties;
+        break;
+    case MQTT_PUBLISH:
+        if (!mqtt_utf8_valid(pkt->v.publish.topic_name.s, pkt->v.publish.topic_name.n))
+            return 0;
+        properties = &pkt->v.publish.v5.properties;
+        break;
+    case MQTT_PUBACK:
+        properties = &pkt->v.puback.v5.properties;
+        break;
+    case MQTT_PUBREC:
+        properties = &pkt->v.pubrec.v5.properties;
+        break;
+    case MQTT_PUBREL:
+        properties = &pkt->v.pubrel.v5.properties;
+        break;
+    case MQTT_PUBCOMP:
+        properties = &pkt->v.pubcomp.v5.properties;
+        break;
+    case MQTT_SUBSCRIBE:
+        for (i = 0; i < pkt->p.subscribe.n; i++) {
+            if (!mqtt_utf8_valid(pkt->p.subscribe.topic_filters[i].s, pkt->p.subscribe.topic_filters[i].n))
+                return 0;
+        }
+        properties = &pkt->v.subscribe.v5.properties;
+        break;
+    case MQTT_SUBACK:
+        properties = &pkt->v.suback.v5.properties;
+        break;
+    case MQTT_UNSUBSCRIBE:
+        for (i = 0; i < pkt->p.unsubscribe.n; i++) {
+            if (!mqtt_utf8_valid(pkt->p.unsubscribe.topic_filters[i].s, pkt->p.unsubscribe.topic_filters[i].n))
+                return 0;
+        }
+        properties = &pkt->v.unsubscribe.v5.properties;
+        break;
+    case MQTT_UNSUBACK:
+        properties = &pkt->v.unsuback.v5.properties;
+        break;
+    case MQTT_DISCONNECT:
+        properties = &pkt->v.disconnect.v5.properties;
+        break;
+    case MQTT_AUTH:
+        properties = &pkt->v.auth.v5.properties;
+        break;
+    default:
+        break;
+    }
+    if (pkt->ver == MQTT_VERSION_5 && properties && !__properties_utf8_valid(properties))
+        return 0;
+    return 1;
+}
+
 static int
-__process(mqtt_parser_t *parser) {
+__process(mqtt_parser_t *parser, mqtt_packet_t *pkt) {
     mqtt_packet_type_t type;
     mqtt_str_t b;
-    mqtt_packet_t *pkt;
     int rc;
 
-    pkt = &parser->pkt;
     pkt->ver = parser->version;
     type = (mqtt_packet_type_t)pkt->f.bits.type;
     mqtt_str_set(&b, &pkt->b);
@@ -2769,6 +3276,9 @@ __process(mqtt_parser_t *parser) {
     if (b.n) {
         return -1;
     }
+    if (parser->strict && !__packet_utf8_valid(pkt)) {
+        return -1;
+    }
     return 1;
 }
 
@@ -2785,7 +3295,20 @@ mqtt_parser_version(mqtt_parser_t *parser, mqtt_version_t version) {
 
 void
 mqtt_parser_unit(mqtt_parser_t *parser) {
-    (void)parser;
+    /* a packet cut off halfway still holds its reassembly buffer. */
+    if (parser->state == MQTT_ST_REMAIN)
+        mqtt_str_free(&parser->pkt.b);
+    parser->state = MQTT_ST_FIXED;
+}
+
+void
+mqtt_parser_zero_copy(mqtt_parser_t *parser, int zero_copy) {
+    parser->zero_copy = zero_copy;
+}
+
+void
+mqtt_parser_strict(mqtt_parser_t *parser, int strict) {
+    parser->strict = strict;
 }
 
 int
@@ -2801,7 +3324,7 @@ mqtt_parse(mqtt_parser_t *parser, mqtt_str_t *b, mqtt_packet_t *pkt) {
         uint8_t k = (uint8_t)(*c);
         switch (parser->state) {
         case MQTT_ST_FIXED:
-            memset(&parser->pkt, 0, sizeof parser->pkt);
+            __packet_reset(&parser->pkt, (mqtt_packet_type_t)(k >> 4));
             parser->pkt.f.flags = k;
             if (!MQTT_IS_PACKET_TYPE(parser->pkt.f.bits.type)) {
                 rc = -1;
@@ -2821,12 +3344,22 @@ mqtt_parse(mqtt_parser_t *parser, mqtt_str_t *b, mqtt_packet_t *pkt) {
             parser->multiplier *= 0x80;
             if ((k & 0x80) == 0) {
                 parser->require = parser->pkt.b.n;
-                if (parser->require > 0) {
+                if (parser->require > 0 && parser->zero_copy && (size_t)(e - c - 1) >= parser->require) {
+                    c++;
+                    parser->pkt.b.s = c;
+                    c += parser->require;
+                    parser->state = MQTT_ST_FIXED;
+                    rc = __process(parser, &parser->pkt);
+                    mqtt_str_init(&parser->pkt.b, 0, 0);
+                    b->n = e - c;
+                    b->s = c;
+                    goto e;
+                } else if (parser->require > 0) {
                     parser->state = MQTT_ST_REMAIN;
                     parser->pkt.b.s = (char *)malloc(parser->pkt.b.n);
                 } else {
                     parser->state = MQTT_ST_FIXED;
-                    rc = __process(parser);
+                    rc = __process(parser, &parser->pkt);
                     c++;
                     b->n = e - c;
                     b->s = c;
@@ -2841,7 +3374,7 @@ mqtt_parse(mqtt_parser_t *parser, mqtt_str_t *b, mqtt_packet_t *pkt) {
                 memcpy(parser->pkt.b.s + offset, c, parser->require);
                 c += parser->require;
                 parser->state = MQTT_ST_FIXED;
-                rc = __process(parser);
+                rc = __process(parser, &parser->pkt);
                 b->n = e - c;
                 b->s = c;
                 goto e;
@@ -2857,16 +3390,109 @@ mqtt_parse(mqtt_parser_t *parser, mqtt_str_t *b, mqtt_packet_t *pkt) {
 e:
     if (rc == 1) {
         *pkt = parser->pkt;
+    } else if (rc < 0) {
+        mqtt_packet_unit(&parser->pkt);
     }
     return rc;
 }
 
-void
-mqtt_reader_init(mqtt_reader_t *reader, void *io, ssize_t (*read)(void *io, void *, size_t)) {
-    reader->io = io;
-    reader->read = read;
-    mqtt_parser_init(&reader->parser);
-}
+/* length of the complete packet at s with its header in *header, 0 if it is cut short, -1 if malformed. */
+static ssize_t
+__frame_length(const char *s, size_t n, size_t *header) {
+    size_t i, length;
+
+    if (!MQTT_IS_PACKET_TYPE((uint8_t)s[0] >> 4))
+        return -1;
+    length = 0;
+    for (i = 1;; i++) {
+        if (i >= n)
+            return 0;
+        if (i > 4)
+            return -1;
+        length |= (size_t)((uint8_t)s[i] & 0x7F) << (7 * (i - 1));
+        if (!((uint8_t)s[i] & 0x80))
+            break;
+    }
+    *header = i + 1;
+    if (n - *header < length)
+        return 0;
+    return (ssize_t)(*header + length);
+}
+
+int
+mqtt_parse_batch(mqtt_parser_t *parser, mqtt_str_t *b, mqtt_packet_t *pkts, int max) {
+    int n, rc;
+
+    n = 0;
+    /* finish the packet the last input cut off first. */
+    if (parser->state != MQTT_ST_FIXED && max > 0) {
+        rc = mqtt_parse(parser, b, &pkts[0]);
+        if (rc <= 0)
+            return rc;
+        n = 1;
+    }
+    while (n < max && b->n > 0) {
+        mqtt_packet_t *pkt;
+        ssize_t length;
+        size_t header;
+
+        length = __frame_length(b->s, b->n, &header);
+        if (length < 0)
+            return n ? n : -1;
+        if (length == 0) {
+            /* hand the tail to the parser to reassemble. */
+            rc = mqtt_parse(parser, b, &pkts[n]);
+            if (rc < 0)
+                return n ? n : -1;
+            b->s += b->n;
+            b->n = 0;
+            break;
+        }
+
+        pkt = &pkts[n];
+        __packet_reset(pkt, (mqtt_packet_type_t)((uint8_t)b->s[0] >> 4));
+        pkt->f.flags = (uint8_t)b->s[0];
+        if ((size_t)length > header) {
+            if (parser->zero_copy) {
+                mqtt_str_init(&pkt->b, b->s + header, length - header);
+            } else {
+                pkt->b.s = (char *)malloc(length - header);
+                pkt->b.n = length - header;
+                memcpy(pkt->b.s, b->s + header, pkt->b.n);
+            }
+        }
+        rc = __process(parser, pkt);
+        if (parser->zero_copy)
+            mqtt_str_init(&pkt->b, 0, 0);
+        if (rc != 1) {
+            mqtt_packet_unit(pkt);
+            return n ? n : -1;
+        }
+        b->s += length;
+        b->n -= length;
+        n++;
+    }
+    return n;
+}
+
+void
+mqtt_reader_init(mqtt_reader_t *reader, void *io, ssize_t (*read)(void *io, void *, size_t)) {
+    reader->io = io;
+    reader->read = read;
+    reader->buff = 0;
+    reader->off = 0;
+    reader->n = 0;
+    mqtt_parser_init(&reader->parser);
+}
+
+int
+mqtt_reader_init_buffered(mqtt_reader_t *reader, void *io, ssize_t (*read)(void *io, void *, size_t)) {
+    mqtt_reader_init(reader, io, read);
+    reader->buff = (char *)malloc(MQTT_READER_BUFF_SIZE);
+    if (!reader->buff)
+        return -1;
+    return 0;
+}
 
 void
 mqtt_reader_version(mqtt_reader_t *reader, mqtt_version_t version) {
@@ -2876,73 +3502,72 @@ mqtt_reader_version(mqtt_reader_t *reader, mqtt_version_t version) {
 void
 mqtt_reader_unit(mqtt_reader_t *reader) {
     mqtt_parser_unit(&reader->parser);
+    free(reader->buff);
+    reader->buff = 0;
 }
 
-int
-mqtt_read(mqtt_reader_t *reader, mqtt_packet_t *pkt) {
+/* the header a byte at a time, then the remainder straight into the packet buffer. */
+static int
+__read_exact(mqtt_reader_t *reader, mqtt_packet_t *pkt) {
     mqtt_parser_t *parser;
+    mqtt_str_t b;
+    char k;
     int rc;
 
     parser = &reader->parser;
-    parser->require = 1;
     parser->state = MQTT_ST_FIXED;
-    rc = 0;
+    while (parser->state != MQTT_ST_REMAIN) {
+        if (reader->read(reader->io, &k, 1) != 1)
+            return -1;
+        mqtt_str_init(&b, &k, 1);
+        rc = mqtt_parse(parser, &b, pkt);
+        if (rc != 0)
+            return rc;
+    }
+    parser->state = MQTT_ST_FIXED;
+    if ((size_t)reader->read(reader->io, parser->pkt.b.s, parser->require) != parser->require) {
+        mqtt_packet_unit(&parser->pkt);
+        return -1;
+    }
+    rc = __process(parser, &parser->pkt);
+    if (rc == 1) {
+        *pkt = parser->pkt;
+    } else {
+        mqtt_packet_unit(&parser->pkt);
+    }
+    return rc;
+}
 
+int
+mqtt_read(mqtt_reader_t *reader, mqtt_packet_t *pkt) {
+    if (!reader->buff)
+        return __read_exact(reader, pkt);
     while (1) {
         ssize_t nread;
-        uint8_t k;
-        char *buff;
-        if (parser->state == MQTT_ST_REMAIN) {
-            buff = (char *)malloc(parser->require);
-        } else {
-            buff = (char *)&k;
-        }
-        nread = reader->read(reader->io, buff, parser->require);
-        if ((size_t)nread != parser->require) {
-            rc = -1;
-            goto e;
-        }
-        switch (parser->state) {
-        case MQTT_ST_FIXED:
-            memset(&parser->pkt, 0, sizeof parser->pkt);
-            parser->pkt.f.flags = k;
-            if (!MQTT_IS_PACKET_TYPE(parser->pkt.f.bits.type)) {
-                rc = -1;
-                goto e;
-            }
-            parser->state = MQTT_ST_LENGTH;
-            parser->multiplier = 1;
-            parser->require = 1;
-            break;
-        case MQTT_ST_LENGTH:
-            parser->pkt.b.n += (k & 0x7F) * parser->multiplier;
-            if (parser->multiplier > 0x80 * 0x80 * 0x80) {
-                rc = -1;
-                goto e;
-            }
-            parser->multiplier *= 0x80;
-            if ((k & 0x80) == 0) {
-                parser->require = parser->pkt.b.n;
-                if (parser->require > 0) {
-                    parser->state = MQTT_ST_REMAIN;
-                } else {
-                    rc = __process(parser);
-                    goto e;
+
+        if (reader->n > 0) {
+            mqtt_str_t b;
+            int rc;
+
+            mqtt_str_init(&b, reader->buff + reader->off, reader->n);
+            rc = mqtt_parse(&reader->parser, &b, pkt);
+            reader->off = b.s - reader->buff;
+            reader->n = b.n;
+            if (rc != 0) {
+                if (rc < 0) {
+                    reader->parser.state = MQTT_ST_FIXED;
+                    reader->n = 0;
                 }
+                return rc;
             }
-            break;
-        case MQTT_ST_REMAIN:
-            parser->pkt.b.s = buff;
-            rc = __process(parser);
-            goto e;
         }
+        /* the parser keeps any partial packet, the buffer is free again. */
+        reader->off = 0;
+        nread = reader->read(reader->io, reader->buff, MQTT_READER_BUFF_SIZE);
+        if (nread <= 0)
+            return -1;
+        reader->n = (size_t)nread;
     }
-
-e:
-    if (rc == 1) {
-        *pkt = parser->pkt;
-    }
-    return rc;
 }
 
 static void
@@ -2980,18 +3605,16 @@ __property_serialize(const mqtt_property_t *property, mqtt_str_t *b) {
 
 static void
 __properties_serialize(const mqtt_properties_t *properties, mqtt_str_t *b) {
-    mqtt_property_t *property;
+    int i;
 
     mqtt_str_write_vbi(b, properties->length);
-    property = properties->head;
-    while (property) {
-        __property_serialize(property, b);
-        property = property->next;
+    for (i = 0; i < properties->n; i++) {
+        __property_serialize(mqtt_properties_at(properties, i), b);
     }
 }
 
-static int
-__serialize_connect(const mqtt_packet_t *pkt, mqtt_str_t *b) {
+static ssize_t
+__remaining_connect(const mqtt_packet_t *pkt) {
     size_t length;
     const mqtt_v_connect_t *v;
     const mqtt_p_connect_t *p;
@@ -3002,7 +3625,7 @@ __serialize_connect(const mqtt_packet_t *pkt, mqtt_str_t *b) {
     if (pkt->ver == MQTT_VERSION_5) {
         if (!mqtt_properties_valid(&v->v5.properties, MQTT_CONNECT, 0))
             return -1;
-        if (!mqtt_properties_valid(&p->v5.will_properties, MQTT_RESERVED, 1))
+        if (p->v5.will_properties && !mqtt_properties_valid(p->v5.will_properties, MQTT_RESERVED, 1))
             return -1;
     }
 
@@ -3020,12 +3643,19 @@ __serialize_connect(const mqtt_packet_t *pkt, mqtt_str_t *b) {
     if (pkt->ver == MQTT_VERSION_5) {
         length += __properties_len(&v->v5.properties);
         if (v->connect_flags.bits.will_flag)
-            length += __properties_len(&p->v5.will_properties);
+            length += p->v5.will_properties ? __properties_len(p->v5.will_properties) : 1;
     }
+    return length;
+}
+
+static void
+__serialize_connect(const mqtt_packet_t *pkt, size_t length, mqtt_str_t *b) {
+    const mqtt_v_connect_t *v;
+    const mqtt_p_connect_t *p;
+
+    v = &pkt->v.connect;
+    p = &pkt->p.connect;
 
-    b->n = length + 1 + mqtt_vbi_length(length);
-    b->s = (char *)malloc(b->n);
-    b->n = 0;
     mqtt_str_write_u8(b, 0x10);
     mqtt_str_write_vbi(b, length);
     mqtt_str_write_utf(b, &v->protocol_name);
@@ -3036,8 +3666,12 @@ __serialize_connect(const mqtt_packet_t *pkt, mqtt_str_t *b) {
         __properties_serialize(&v->v5.properties, b);
     mqtt_str_write_utf(b, &p->client_id);
     if (v->connect_flags.bits.will_flag) {
-        if (pkt->ver == MQTT_VERSION_5)
-            __properties_serialize(&p->v5.will_properties, b);
+        if (pkt->ver == MQTT_VERSION_5) {
+            if (p->v5.will_properties)
+                __properties_serialize(p->v5.will_properties, b);
+            else
+                mqtt_str_write_u8(b, 0);
+        }
         mqtt_str_write_utf(b, &p->will_topic);
         mqtt_str_write_utf(b, &p->will_message);
     }
@@ -3045,212 +3679,185 @@ __serialize_connect(const mqtt_packet_t *pkt, mqtt_str_t *b) {
         mqtt_str_write_utf(b, &p->username);
     if (v->connect_flags.bits.password_flag)
         mqtt_str_write_utf(b, &p->password);
-
-    return 0;
 }
 
-static int
-__serialize_connack(const mqtt_packet_t *pkt, mqtt_str_t *b) {
+static ssize_t
+__remaining_connack(const mqtt_packet_t *pkt) {
     const mqtt_v_connack_t *v;
 
     v = &pkt->v.connack;
 
-    if (pkt->ver == MQTT_VERSION_3 || pkt->ver == MQTT_VERSION_4) {
-        b->s = (char *)malloc(4);
-        b->n = 0;
-        mqtt_str_write_u8(b, 0x20);
-        mqtt_str_write_u8(b, 0x02);
-        if (pkt->ver == MQTT_VERSION_3) {
-            mqtt_str_write_u8(b, 0x00);
-            mqtt_str_write_u8(b, (uint8_t)v->v3.return_code);
-        } else {
-            mqtt_str_write_u8(b, v->v4.acknowledge_flags.flags);
-            mqtt_str_write_u8(b, (uint8_t)v->v4.return_code);
-        }
-    } else if (pkt->ver == MQTT_VERSION_5) {
-        size_t length;
-
+    if (pkt->ver == MQTT_VERSION_5) {
         if (!mqtt_properties_valid(&v->v5.properties, MQTT_CONNACK, 0))
             return -1;
+        return 2 + __properties_len(&v->v5.properties);
+    }
+    return 2;
+}
 
-        length = 2 + __properties_len(&v->v5.properties);
-        b->n = length + 1 + mqtt_vbi_length(length);
-        b->s = (char *)malloc(b->n);
-        b->n = 0;
-        mqtt_str_write_u8(b, 0x20);
-        mqtt_str_write_vbi(b, length);
+static void
+__serialize_connack(const mqtt_packet_t *pkt, size_t length, mqtt_str_t *b) {
+    const mqtt_v_connack_t *v;
+
+    v = &pkt->v.connack;
+
+    mqtt_str_write_u8(b, 0x20);
+    mqtt_str_write_vbi(b, length);
+    if (pkt->ver == MQTT_VERSION_3) {
+        mqtt_str_write_u8(b, 0x00);
+        mqtt_str_write_u8(b, (uint8_t)v->v3.return_code);
+    } else if (pkt->ver == MQTT_VERSION_4) {
+        mqtt_str_write_u8(b, v->v4.acknowledge_flags.flags);
+        mqtt_str_write_u8(b, (uint8_t)v->v4.return_code);
+    } else {
         mqtt_str_write_u8(b, v->v5.acknowledge_flags.flags);
         mqtt_str_write_u8(b, (uint8_t)v->v5.reason_code);
         __properties_serialize(&v->v5.properties, b);
     }
+}
 
-    return 0;
+static size_t
+__publish_remaining(mqtt_version_t ver, mqtt_qos_t qos, const mqtt_str_t *topic, const mqtt_properties_t *properties,
+                    size_t message_n) {
+    size_t length;
+
+    length = 2 + topic->n + message_n;
+    if (qos > MQTT_QOS_0)
+        length += 2;
+    if (ver == MQTT_VERSION_5)
+        length += properties ? __properties_len(properties) : 1;
+    return length;
 }
 
-static int
-__serialize_publish(const mqtt_packet_t *pkt, mqtt_str_t *b) {
+size_t
+mqtt_publish_length(mqtt_version_t ver, mqtt_qos_t qos, const mqtt_str_t *topic, const mqtt_properties_t *properties,
+                    size_t message_n) {
     size_t length;
-    const mqtt_v_publish_t *v;
-    const mqtt_p_publish_t *p;
 
-    v = &pkt->v.publish;
-    p = &pkt->p.publish;
+    length = __publish_remaining(ver, qos, topic, properties, message_n);
+    return length + 1 + mqtt_vbi_length(length);
+}
 
-    if (pkt->ver == MQTT_VERSION_5) {
-        if (!mqtt_properties_valid(&v->v5.properties, MQTT_PUBLISH, 0))
-            return -1;
+void
+mqtt_publish_write(mqtt_str_t *b, mqtt_version_t ver, mqtt_fixed_header_t f, const mqtt_str_t *topic,
+                   uint16_t packet_id, const mqtt_properties_t *properties, const mqtt_str_t *message) {
+    f.bits.type = MQTT_PUBLISH;
+    mqtt_str_write_u8(b, f.flags);
+    mqtt_str_write_vbi(b, __publish_remaining(ver, (mqtt_qos_t)f.bits.qos, topic, properties, message->n));
+    mqtt_str_write_utf(b, topic);
+    if (f.bits.qos > MQTT_QOS_0)
+        mqtt_str_write_u16(b, packet_id);
+    if (ver == MQTT_VERSION_5) {
+        if (properties)
+            __properties_serialize(properties, b);
+        else
+            mqtt_str_write_u8(b, 0);
     }
+    mqtt_str_concat(b, message);
+}
 
-    length = 2 + v->topic_name.n + p->message.n;
-    if (pkt->f.bits.qos > MQTT_QOS_0)
-        length += 2;
-    if (pkt->ver == MQTT_VERSION_5)
-        length += __properties_len(&v->v5.properties);
-    b->n = length + 1 + mqtt_vbi_length(length);
-    b->s = (char *)malloc(b->n);
-    b->n = 0;
-    mqtt_str_write_u8(b, pkt->f.flags);
-    mqtt_str_write_vbi(b, length);
-    mqtt_str_write_utf(b, &v->topic_name);
-    if (pkt->f.bits.qos > MQTT_QOS_0)
-        mqtt_str_write_u16(b, v->packet_id);
-    if (pkt->ver == MQTT_VERSION_5)
-        __properties_serialize(&v->v5.properties, b);
-    mqtt_str_concat(b, &p->message);
+int
+mqtt_publish_template_init(mqtt_publish_template_t *tpl, mqtt_version_t ver, const char *topic, mqtt_qos_t qos,
+                           int retain) {
+    size_t n;
 
+    n = strlen(topic);
+    if (!MQTT_IS_VERSION(ver) || !MQTT_IS_QOS(qos) || n == 0 || n > UINT16_MAX || strpbrk(topic, "+#"))
+        return -1;
+    tpl->flags = (uint8_t)(MQTT_PUBLISH << 4 | qos << 1 | (retain ? 1 : 0));
+    tpl->topic_length[0] = (uint8_t)(n >> 8);
+    tpl->topic_length[1] = (uint8_t)n;
+    tpl->ver = ver;
+    mqtt_str_init(&tpl->topic, (char *)topic, n);
+    tpl->remaining = 2 + n + (qos > MQTT_QOS_0 ? 2 : 0) + (ver == MQTT_VERSION_5 ? 1 : 0);
     return 0;
 }
 
-static int
-__serialize_puback(const mqtt_packet_t *pkt, mqtt_str_t *b) {
-    const mqtt_v_puback_t *v;
-
-    v = &pkt->v.puback;
-
-    if (pkt->ver == MQTT_VERSION_3 || pkt->ver == MQTT_VERSION_4) {
-        b->s = (char *)malloc(4);
-        b->n = 0;
-        mqtt_str_write_u8(b, 0x40);
-        mqtt_str_write_u8(b, 0x02);
-        mqtt_str_write_u16(b, v->packet_id);
-    } else if (pkt->ver == MQTT_VERSION_5) {
-        size_t length;
+size_t
+mqtt_publish_template_length(const mqtt_publish_template_t *tpl, size_t message_n) {
+    size_t length;
 
-        if (!mqtt_properties_valid(&v->v5.properties, MQTT_PUBACK, 0))
-            return -1;
+    length = tpl->remaining + message_n;
+    return length + 1 + mqtt_vbi_length(length);
+}
 
-        length = 3 + __properties_len(&v->v5.properties);
-        b->n = length + 1 + mqtt_vbi_length(length);
-        b->s = (char *)malloc(b->n);
-        b->n = 0;
-        mqtt_str_write_u8(b, 0x40);
-        mqtt_str_write_vbi(b, length);
-        mqtt_str_write_u16(b, v->packet_id);
-        mqtt_str_write_u8(b, (uint8_t)v->v5.reason_code);
-        __properties_serialize(&v->v5.properties, b);
+void
+mqtt_publish_template_write(mqtt_str_t *b, const mqtt_publish_template_t *tpl, uint16_t packet_id,
+                            const mqtt_str_t *message) {
+    char *c;
+
+    mqtt_str_write_u8(b, tpl->flags);
+    mqtt_str_write_vbi(b, (uint32_t)(tpl->remaining + message->n));
+    c = b->s + b->n;
+    memcpy(c, tpl->topic_length, 2);
+    c += 2;
+    memcpy(c, tpl->topic.s, tpl->topic.n);
+    c += tpl->topic.n;
+    if (tpl->flags & 0x06) {
+        *c++ = (char)(packet_id >> 8);
+        *c++ = (char)packet_id;
     }
-
-    return 0;
+    if (tpl->ver == MQTT_VERSION_5)
+        *c++ = 0;
+    b->n = c - b->s;
+    mqtt_str_concat(b, message);
 }
 
-static int
-__serialize_pubrec(const mqtt_packet_t *pkt, mqtt_str_t *b) {
-    const mqtt_v_pubrec_t *v;
-
-    v = &pkt->v.pubrec;
+static ssize_t
+__remaining_publish(const mqtt_packet_t *pkt) {
+    const mqtt_v_publish_t *v;
 
-    if (pkt->ver == MQTT_VERSION_3 || pkt->ver == MQTT_VERSION_4) {
-        b->s = (char *)malloc(4);
-        b->n = 0;
-        mqtt_str_write_u8(b, 0x50);
-        mqtt_str_write_u8(b, 0x02);
-        mqtt_str_write_u16(b, v->packet_id);
-    } else if (pkt->ver == MQTT_VERSION_5) {
-        size_t length;
+    v = &pkt->v.publish;
 
-        if (!mqtt_properties_valid(&v->v5.properties, MQTT_PUBREC, 0))
+    if (pkt->ver == MQTT_VERSION_5) {
+        if (!mqtt_properties_valid(&v->v5.properties, MQTT_PUBLISH, 0))
             return -1;
-
-        length = 3 + __properties_len(&v->v5.properties);
-        b->n = length + 1 + mqtt_vbi_length(length);
-        b->s = (char *)malloc(b->n);
-        b->n = 0;
-        mqtt_str_write_u8(b, 0x50);
-        mqtt_str_write_vbi(b, length);
-        mqtt_str_write_u16(b, v->packet_id);
-        mqtt_str_write_u8(b, (uint8_t)v->v5.reason_code);
-        __properties_serialize(&v->v5.properties, b);
     }
-
-    return 0;
+    return __publish_remaining(pkt->ver, (mqtt_qos_t)pkt->f.bits.qos, &v->topic_name, &v->v5.properties,
+                               pkt->p.publish.message.n);
 }
 
-static int
-__serialize_pubrel(const mqtt_packet_t *pkt, mqtt_str_t *b) {
-    const mqtt_v_pubrel_t *v;
+static void
+__serialize_publish(const mqtt_packet_t *pkt, size_t length, mqtt_str_t *b) {
+    const mqtt_v_publish_t *v;
 
-    v = &pkt->v.pubrel;
+    (void)length;
+    v = &pkt->v.publish;
+    mqtt_publish_write(b, pkt->ver, pkt->f, &v->topic_name, v->packet_id, &v->v5.properties, &pkt->p.publish.message);
+}
 
-    if (pkt->ver == MQTT_VERSION_3 || pkt->ver == MQTT_VERSION_4) {
-        b->s = (char *)malloc(4);
-        b->n = 0;
-        mqtt_str_write_u8(b, 0x62);
-        mqtt_str_write_u8(b, 0x02);
-        mqtt_str_write_u16(b, v->packet_id);
-    } else if (pkt->ver == MQTT_VERSION_5) {
-        size_t length;
+/* puback, pubrec, pubrel and pubcomp share their layout. */
+static ssize_t
+__remaining_ack(const mqtt_packet_t *pkt) {
+    const mqtt_v_puback_t *v;
 
-        if (!mqtt_properties_valid(&v->v5.properties, MQTT_PUBREL, 0))
-            return -1;
+    v = &pkt->v.puback;
 
-        length = 3 + __properties_len(&v->v5.properties);
-        b->n = length + 1 + mqtt_vbi_length(length);
-        b->s = (char *)malloc(b->n);
-        b->n = 0;
-        mqtt_str_write_u8(b, 0x62);
-        mqtt_str_write_vbi(b, length);
-        mqtt_str_write_u16(b, v->packet_id);
-        mqtt_str_write_u8(b, (uint8_t)v->v5.reason_code);
-        __properties_serialize(&v->v5.properties, b);
+    if (pkt->ver == MQTT_VERSION_5) {
+        if (!mqtt_properties_valid(&v->v5.properties, (mqtt_packet_type_t)pkt->f.bits.type, 0))
+            return -1;
+        return 3 + __properties_len(&v->v5.properties);
     }
-
-    return 0;
+    return 2;
 }
 
-static int
-__serialize_pubcomp(const mqtt_packet_t *pkt, mqtt_str_t *b) {
-    const mqtt_v_pubcomp_t *v;
-
-    v = &pkt->v.pubcomp;
-
-    if (pkt->ver == MQTT_VERSION_3 || pkt->ver == MQTT_VERSION_4) {
-        b->s = (char *)malloc(4);
-        b->n = 0;
-        mqtt_str_write_u8(b, 0x70);
-        mqtt_str_write_u8(b, 0x02);
-        mqtt_str_write_u16(b, v->packet_id);
-    } else if (pkt->ver == MQTT_VERSION_5) {
-        size_t length;
+static void
+__serialize_ack(const mqtt_packet_t *pkt, uint8_t header, size_t length, mqtt_str_t *b) {
+    const mqtt_v_puback_t *v;
 
-        if (!mqtt_properties_valid(&v->v5.properties, MQTT_PUBCOMP, 0))
-            return -1;
+    v = &pkt->v.puback;
 
-        length = 3 + __properties_len(&v->v5.properties);
-        b->n = length + 1 + mqtt_vbi_length(length);
-        b->s = (char *)malloc(b->n);
-        b->n = 0;
-        mqtt_str_write_u8(b, 0x70);
-        mqtt_str_write_vbi(b, length);
-        mqtt_str_write_u16(b, v->packet_id);
+    mqtt_str_write_u8(b, header);
+    mqtt_str_write_vbi(b, length);
+    mqtt_str_write_u16(b, v->packet_id);
+    if (pkt->ver == MQTT_VERSION_5) {
         mqtt_str_write_u8(b, (uint8_t)v->v5.reason_code);
         __properties_serialize(&v->v5.properties, b);
     }
-
-    return 0;
 }
 
-static int
-__serialize_subscribe(const mqtt_packet_t *pkt, mqtt_str_t *b) {
+static ssize_t
+__remaining_subscribe(const mqtt_packet_t *pkt) {
     size_t length;
     const mqtt_v_subscribe_t *v;
     const mqtt_p_subscribe_t *p;
@@ -3263,7 +3870,7 @@ __serialize_subscribe(const mqtt_packet_t *pkt, mqtt_str_t *b) {
         if (!mqtt_properties_valid(&v->v5.properties, MQTT_SUBSCRIBE, 0))
             return -1;
     }
-    
+
     if (p->n == 0)
         return -1;
 
@@ -3275,9 +3882,18 @@ __serialize_subscribe(const mqtt_packet_t *pkt, mqtt_str_t *b) {
     }
     if (pkt->ver == MQTT_VERSION_5)
         length += __properties_len(&v->v5.properties);
-    b->n = length + 1 + mqtt_vbi_length(length);
-    b->s = (char *)malloc(b->n);
-    b->n = 0;
+    return length;
+}
+
+static void
+__serialize_subscribe(const mqtt_packet_t *pkt, size_t length, mqtt_str_t *b) {
+    const mqtt_v_subscribe_t *v;
+    const mqtt_p_subscribe_t *p;
+    int i;
+
+    v = &pkt->v.subscribe;
+    p = &pkt->p.subscribe;
+
     mqtt_str_write_u8(b, 0x82);
     mqtt_str_write_vbi(b, length);
     mqtt_str_write_u16(b, v->packet_id);
@@ -3287,16 +3903,13 @@ __serialize_subscribe(const mqtt_packet_t *pkt, mqtt_str_t *b) {
         mqtt_str_write_utf(b, &p->topic_filters[i]);
         mqtt_str_write_u8(b, p->options[i].flags);
     }
-
-    return 0;
 }
 
-static int
-__serialize_suback(const mqtt_packet_t *pkt, mqtt_str_t *b) {
+static ssize_t
+__remaining_suback(const mqtt_packet_t *pkt) {
     size_t length;
     const mqtt_v_suback_t *v;
     const mqtt_p_suback_t *p;
-    int i;
 
     v = &pkt->v.suback;
     p = &pkt->p.suback;
@@ -3312,9 +3925,18 @@ __serialize_suback(const mqtt_packet_t *pkt, mqtt_str_t *b) {
     length = p->n + 2;
     if (pkt->ver == MQTT_VERSION_5)
         length += __properties_len(&v->v5.properties);
-    b->n = length + 1 + mqtt_vbi_length(length);
-    b->s = (char *)malloc(b->n);
-    b->n = 0;
+    return length;
+}
+
+static void
+__serialize_suback(const mqtt_packet_t *pkt, size_t length, mqtt_str_t *b) {
+    const mqtt_v_suback_t *v;
+    const mqtt_p_suback_t *p;
+    int i;
+
+    v = &pkt->v.suback;
+    p = &pkt->p.suback;
+
     mqtt_str_write_u8(b, 0x90);
     mqtt_str_write_vbi(b, length);
     mqtt_str_write_u16(b, v->packet_id);
@@ -3328,12 +3950,10 @@ __serialize_suback(const mqtt_packet_t *pkt, mqtt_str_t *b) {
         else if (pkt->ver == MQTT_VERSION_5)
             mqtt_str_write_u8(b, (uint8_t)p->v5.reason_codes[i]);
     }
-
-    return 0;
 }
 
-static int
-__serialize_unsubscribe(const mqtt_packet_t *pkt, mqtt_str_t *b) {
+static ssize_t
+__remaining_unsubscribe(const mqtt_packet_t *pkt) {
     size_t length;
     const mqtt_v_unsubscribe_t *v;
     const mqtt_p_unsubscribe_t *p;
@@ -3358,191 +3978,231 @@ __serialize_unsubscribe(const mqtt_packet_t *pkt, mqtt_str_t *b) {
     }
     if (pkt->ver == MQTT_VERSION_5)
         length += __properties_len(&v->v5.properties);
-    b->n = length + 1 + mqtt_vbi_length(length);
-    b->s = (char *)malloc(b->n);
-    b->n = 0;
+    return length;
+}
+
+static void
+__serialize_unsubscribe(const mqtt_packet_t *pkt, size_t length, mqtt_str_t *b) {
+    const mqtt_v_unsubscribe_t *v;
+    const mqtt_p_unsubscribe_t *p;
+    int i;
+
+    v = &pkt->v.unsubscribe;
+    p = &pkt->p.unsubscribe;
+
     mqtt_str_write_u8(b, 0xa2);
     mqtt_str_write_vbi(b, length);
     mqtt_str_write_u16(b, v->packet_id);
     if (pkt->ver == MQTT_VERSION_5)
         __properties_serialize(&v->v5.properties, b);
     for (i = 0; i < p->n; i++) mqtt_str_write_utf(b, &p->topic_filters[i]);
-
-    return 0;
 }
 
-static int
-__serialize_unsuback(const mqtt_packet_t *pkt, mqtt_str_t *b) {
+static ssize_t
+__remaining_unsuback(const mqtt_packet_t *pkt) {
     const mqtt_v_unsuback_t *v;
-    const mqtt_p_unsuback_t *p;
 
     v = &pkt->v.unsuback;
-    p = &pkt->p.unsuback;
-
-    if (pkt->ver == MQTT_VERSION_3 || pkt->ver == MQTT_VERSION_4) {
-        b->s = (char *)malloc(4);
-        b->n = 0;
-        mqtt_str_write_u8(b, 0xb0);
-        mqtt_str_write_u8(b, 0x02);
-        mqtt_str_write_u16(b, v->packet_id);
-    } else if (pkt->ver == MQTT_VERSION_5) {
-        size_t length;
-        int i;
 
+    if (pkt->ver == MQTT_VERSION_5) {
         if (!mqtt_properties_valid(&v->v5.properties, MQTT_UNSUBACK, 0))
             return -1;
-
-        length = 2 + __properties_len(&v->v5.properties) + p->v5.n;
-        b->n = length + 1 + mqtt_vbi_length(length);
-        b->s = (char *)malloc(b->n);
-        b->n = 0;
-        mqtt_str_write_u8(b, 0xb0);
-        mqtt_str_write_vbi(b, length);
-        mqtt_str_write_u16(b, v->packet_id);
-        __properties_serialize(&v->v5.properties, b);
-        for (i = 0; i < p->v5.n; i++) mqtt_str_write_u8(b, (uint8_t)p->v5.reason_codes[i]);
+        return 2 + __properties_len(&v->v5.properties) + pkt->p.unsuback.v5.n;
     }
-
-    return 0;
+    return 2;
 }
 
-static int
-__serialize_pingreq(const mqtt_packet_t *pkt, mqtt_str_t *b) {
-    (void)pkt;
+static void
+__serialize_unsuback(const mqtt_packet_t *pkt, size_t length, mqtt_str_t *b) {
+    const mqtt_v_unsuback_t *v;
+    const mqtt_p_unsuback_t *p;
+    int i;
 
-    b->s = (char *)malloc(2);
-    b->n = 0;
-    mqtt_str_write_u8(b, 0xc0);
-    mqtt_str_write_u8(b, 0x00);
+    v = &pkt->v.unsuback;
+    p = &pkt->p.unsuback;
 
-    return 0;
+    mqtt_str_write_u8(b, 0xb0);
+    mqtt_str_write_vbi(b, length);
+    mqtt_str_write_u16(b, v->packet_id);
+    if (pkt->ver == MQTT_VERSION_5) {
+        __properties_serialize(&v->v5.properties, b);
+        for (i = 0; i < p->v5.n; i++) mqtt_str_write_u8(b, (uint8_t)p->v5.reason_codes[i]);
+    }
 }
 
-static int
-__serialize_pingresp(const mqtt_packet_t *pkt, mqtt_str_t *b) {
-    (void)pkt;
+/* disconnect and auth carry a reason code and properties in v5, nothing before. */
+static ssize_t
+__remaining_reason(const mqtt_packet_t *pkt) {
+    const mqtt_properties_t *properties;
+    mqtt_packet_type_t type;
 
-    b->s = (char *)malloc(2);
-    b->n = 0;
-    mqtt_str_write_u8(b, 0xd0);
-    mqtt_str_write_u8(b, 0x00);
+    type = (mqtt_packet_type_t)pkt->f.bits.type;
+    if (pkt->ver != MQTT_VERSION_5)
+        return type == MQTT_AUTH ? -1 : 0;
 
-    return 0;
+    properties = type == MQTT_AUTH ? &pkt->v.auth.v5.properties : &pkt->v.disconnect.v5.properties;
+    if (!mqtt_properties_valid(properties, type, 0))
+        return -1;
+    return 1 + __properties_len(properties);
 }
 
-static int
-__serialize_disconnect(const mqtt_packet_t *pkt, mqtt_str_t *b) {
-    if (pkt->ver == MQTT_VERSION_3 || pkt->ver == MQTT_VERSION_4) {
-        b->s = (char *)malloc(2);
-        b->n = 0;
-        mqtt_str_write_u8(b, 0xe0);
-        mqtt_str_write_u8(b, 0x00);
-    } else if (pkt->ver == MQTT_VERSION_5) {
-        size_t length;
-        const mqtt_v_disconnect_t *v;
-
-        v = &pkt->v.disconnect;
-
-        if (!mqtt_properties_valid(&v->v5.properties, MQTT_DISCONNECT, 0))
-            return -1;
+static void
+__serialize_reason(const mqtt_packet_t *pkt, size_t length, mqtt_str_t *b) {
+    mqtt_packet_type_t type;
 
-        length = 1 + __properties_len(&v->v5.properties);
-        b->n = length + 1 + mqtt_vbi_length(length);
-        b->s = (char *)malloc(b->n);
-        b->n = 0;
-        mqtt_str_write_u8(b, 0xe0);
-        mqtt_str_write_vbi(b, length);
-        mqtt_str_write_u8(b, (uint8_t)v->v5.reason_code);
-        __properties_serialize(&v->v5.properties, b);
+    type = (mqtt_packet_type_t)pkt->f.bits.type;
+    mqtt_str_write_u8(b, (uint8_t)(type << 4));
+    mqtt_str_write_vbi(b, length);
+    if (pkt->ver != MQTT_VERSION_5)
+        return;
+    if (type == MQTT_AUTH) {
+        mqtt_str_write_u8(b, (uint8_t)pkt->v.auth.v5.reason_code);
+        __properties_serialize(&pkt->v.auth.v5.properties, b);
+    } else {
+        mqtt_str_write_u8(b, (uint8_t)pkt->v.disconnect.v5.reason_code);
+        __properties_serialize(&pkt->v.disconnect.v5.properties, b);
     }
-
-    return 0;
 }
 
-static int
-__serialize_auth(const mqtt_packet_t *pkt, mqtt_str_t *b) {
-    if (pkt->ver == MQTT_VERSION_5) {
-        size_t length;
-        const mqtt_v_auth_t *v;
-
-        v = &pkt->v.auth;
-
-        if (!mqtt_properties_valid(&v->v5.properties, MQTT_AUTH, 0))
-            return -1;
+static ssize_t
+__remaining_length(const mqtt_packet_t *pkt) {
+    ssize_t length;
 
-        length = 1 + __properties_len(&v->v5.properties);
-        b->n = length + 1 + mqtt_vbi_length(length);
-        b->s = (char *)malloc(b->n);
-        b->n = 0;
-        mqtt_str_write_u8(b, 0xf0);
-        mqtt_str_write_vbi(b, length);
-        mqtt_str_write_u8(b, (uint8_t)v->v5.reason_code);
-        __properties_serialize(&v->v5.properties, b);
+    if (!MQTT_IS_VERSION(pkt->ver))
+        return -1;
+    switch (pkt->f.bits.type) {
+    case MQTT_CONNECT:
+        length = __remaining_connect(pkt);
+        break;
+    case MQTT_CONNACK:
+        length = __remaining_connack(pkt);
+        break;
+    case MQTT_PUBLISH:
+        length = __remaining_publish(pkt);
+        break;
+    case MQTT_PUBACK:
+    case MQTT_PUBREC:
+    case MQTT_PUBREL:
+    case MQTT_PUBCOMP:
+        length = __remaining_ack(pkt);
+        break;
+    case MQTT_SUBSCRIBE:
+        length = __remaining_subscribe(pkt);
+        break;
+    case MQTT_SUBACK:
+        length = __remaining_suback(pkt);
+        break;
+    case MQTT_UNSUBSCRIBE:
+        length = __remaining_unsubscribe(pkt);
+        break;
+    case MQTT_UNSUBACK:
+        length = __remaining_unsuback(pkt);
+        break;
+    case MQTT_PINGREQ:
+    case MQTT_PINGRESP:
+        length = 0;
+        break;
+    case MQTT_DISCONNECT:
+    case MQTT_AUTH:
+        length = __remaining_reason(pkt);
+        break;
+    case MQTT_RESERVED:
+    default:
+        length = -1;
+        break;
     }
-
-    return 0;
+    if (length > MQTT_MAX_REMAINING_LENGTH)
+        return -1;
+    return length;
 }
 
-int
-mqtt_serialize(mqtt_packet_t *pkt, mqtt_str_t *b) {
-    int rc;
-
-    mqtt_str_init(b, 0, 0);
-    if (!MQTT_IS_VERSION(pkt->ver)) {
-        return -1;
-    }
+static void
+__serialize(const mqtt_packet_t *pkt, size_t length, mqtt_str_t *b) {
     switch (pkt->f.bits.type) {
     case MQTT_CONNECT:
-        rc = __serialize_connect(pkt, b);
+        __serialize_connect(pkt, length, b);
         break;
     case MQTT_CONNACK:
-        rc = __serialize_connack(pkt, b);
+        __serialize_connack(pkt, length, b);
         break;
     case MQTT_PUBLISH:
-        rc = __serialize_publish(pkt, b);
+        __serialize_publish(pkt, length, b);
         break;
     case MQTT_PUBACK:
-        rc = __serialize_puback(pkt, b);
+        __serialize_ack(pkt, 0x40, length, b);
         break;
     case MQTT_PUBREC:
-        rc = __serialize_pubrec(pkt, b);
+        __serialize_ack(pkt, 0x50, length, b);
         break;
     case MQTT_PUBREL:
-        rc = __serialize_pubrel(pkt, b);
+        __serialize_ack(pkt, 0x62, length, b);
         break;
     case MQTT_PUBCOMP:
-        rc = __serialize_pubcomp(pkt, b);
+        __serialize_ack(pkt, 0x70, length, b);
         break;
     case MQTT_SUBSCRIBE:
-        rc = __serialize_subscribe(pkt, b);
+        __serialize_subscribe(pkt, length, b);
         break;
     case MQTT_SUBACK:
-        rc = __serialize_suback(pkt, b);
+        __serialize_suback(pkt, length, b);
         break;
     case MQTT_UNSUBSCRIBE:
-        rc = __serialize_unsubscribe(pkt, b);
+        __serialize_unsubscribe(pkt, length, b);
         break;
     case MQTT_UNSUBACK:
-        rc = __serialize_unsuback(pkt, b);
+        __serialize_unsuback(pkt, length, b);
         break;
     case MQTT_PINGREQ:
-        rc = __serialize_pingreq(pkt, b);
+        mqtt_str_write_u8(b, 0xc0);
+        mqtt_str_write_u8(b, 0x00);
         break;
     case MQTT_PINGRESP:
-        rc = __serialize_pingresp(pkt, b);
+        mqtt_str_write_u8(b, 0xd0);
+        mqtt_str_write_u8(b, 0x00);
         break;
     case MQTT_DISCONNECT:
-        rc = __serialize_disconnect(pkt, b);
-        break;
     case MQTT_AUTH:
-        rc = __serialize_auth(pkt, b);
+        __serialize_reason(pkt, length, b);
         break;
-    case MQTT_RESERVED:
     default:
-        rc = -1;
         break;
     }
-    return rc;
+}
+
+ssize_t
+mqtt_serialized_size(const mqtt_packet_t *pkt) {
+    ssize_t length;
+
+    length = __remaining_length(pkt);
+    if (length < 0)
+        return -1;
+    return length + 1 + mqtt_vbi_length(length);
+}
+
+ssize_t
+mqtt_serialize_into(const mqtt_packet_t *pkt, char *buf, size_t cap) {
+    mqtt_str_t b;
+    ssize_t length;
+
+    length = __remaining_length(pkt);
+    if (length < 0 || (size_t)length + 1 + mqtt_vbi_length(length) > cap)
+        return -1;
+    mqtt_str_init(&b, buf, 0);
+    __serialize(pkt, length, &b);
+    return b.n;
+}
+
+int
+mqtt_serialize(mqtt_packet_t *pkt, mqtt_str_t *b) {
+    ssize_t length;
+
+    mqtt_str_init(b, 0, 0);
+    length = __remaining_length(pkt);
+    if (length < 0)
+        return -1;
+    b->s = (char *)malloc(length + 1 + mqtt_vbi_length(length));
+    __serialize(pkt, length, b);
+    return 0;
 }
 
 void
@@ -3553,12 +4213,7 @@ mqtt_properties_add(mqtt_properties_t *properties, mqtt_property_code_t code, co
 
     len = 0;
     type = MQTT_PROPERTY_DEFS[code].type;
-    property = (mqtt_property_t *)malloc(sizeof *property);
-    memset(property, 0, sizeof *property);
-    property->code = code;
-
-    property->next = properties->head;
-    properties->head = property;
+    property = __properties_push(properties, code);
 
     switch (type) {
     case MQTT_PROPERTY_TYPE_BYTE:
@@ -3591,70 +4246,454 @@ mqtt_properties_add(mqtt_properties_t *properties, mqtt_property_code_t code, co
         len = 4 + property->pair.name.n + property->pair.value.n;
         break;
     }
-    properties->length += len + 1;
+    property->length = (uint32_t)(len + 1);
+    properties->length += property->length;
 }
 
 mqtt_property_t *
 mqtt_properties_find(mqtt_properties_t *properties, mqtt_property_code_t code) {
-    mqtt_property_t *property;
+    int i;
 
-    property = properties->head;
-    while (property) {
-        if (property->code == code)
-            return property;
-        property = property->next;
+    if (!MQTT_IS_PROPERTY(code))
+        return 0;
+    for (i = 0; i < properties->n; i++) {
+        if (mqtt_properties_at(properties, i)->code == code)
+            return mqtt_properties_at(properties, i);
     }
     return 0;
 }
 
-mqtt_property_t *
+int
 mqtt_properties_remove(mqtt_properties_t *properties, mqtt_property_code_t code) {
-    mqtt_property_t **pp;
+    mqtt_property_t *property;
+    int i;
+
+    property = mqtt_properties_find(properties, code);
+    if (!property)
+        return -1;
+    properties->length -= property->length;
+
+    for (i = 0; mqtt_properties_at(properties, i) != property; i++)
+        ;
+    for (; i < properties->n - 1; i++) {
+        *mqtt_properties_at(properties, i) = *mqtt_properties_at(properties, i + 1);
+    }
+    properties->n--;
+    return 0;
+}
 
-    pp = &properties->head;
-    while (*pp) {
-        mqtt_property_t *property;
+void
+mqtt_topic_tree_init(mqtt_topic_tree_t *tree) {
+    memset(tree, 0, sizeof *tree);
+}
 
-        property = *pp;
-        if (property->code == code) {
-            mqtt_property_type_t type;
-            size_t len;
+static void
+__topic_node_free(mqtt_topic_node_t *node, void (*free_value)(void *value)) {
+    int i;
 
-            len = 0;
-            type = MQTT_PROPERTY_DEFS[property->code].type;
+    for (i = 0; i < node->n; i++) {
+        __topic_node_free(node->children[i], free_value);
+        free(node->children[i]);
+    }
+    if (node->plus) {
+        __topic_node_free(node->plus, free_value);
+        free(node->plus);
+    }
+    if (node->hash) {
+        __topic_node_free(node->hash, free_value);
+        free(node->hash);
+    }
+    if (free_value) {
+        for (i = 0; i < node->nvalues; i++) {
+            free_value(node->values[i]);
+        }
+    }
+    if (node->children)
+        free(node->children);
+    if (node->values)
+        free(node->values);
+    mqtt_str_free(&node->level);
+}
 
-            switch (type) {
-            case MQTT_PROPERTY_TYPE_BYTE:
-                len = 1;
-                break;
-            case MQTT_PROPERTY_TYPE_TWO_BYTE_INTEGER:
-                len = 2;
-                break;
-            case MQTT_PROPERTY_TYPE_FOUR_BYTE_INTEGER:
-                len = 4;
-                break;
-            case MQTT_PROPERTY_TYPE_VARIABLE_BYTE_INTEGER:
-                len = mqtt_vbi_length(property->bv);
-                break;
-            case MQTT_PROPERTY_TYPE_BINARY_DATA:
-                len = 2 + property->data.n;
-                break;
-            case MQTT_PROPERTY_TYPE_UTF_8_ENCODED_STRING:
-                len = 2 + property->str.n;
-                break;
-            case MQTT_PROPERTY_TYPE_UTF_8_STRING_PAIR:
-                len = 4 + property->pair.name.n + property->pair.value.n;
+void
+mqtt_topic_tree_unit(mqtt_topic_tree_t *tree, void (*free_value)(void *value)) {
+    __topic_node_free(&tree->root, free_value);
+    memset(tree, 0, sizeof *tree);
+}
+
+/* split the next level off [*s, end), 1 if it was the last one. */
+static int
+__topic_level(const char **s, const char *end, mqtt_str_t *level) {
+    const char *slash;
+
+    slash = (const char *)memchr(*s, '/', end - *s);
+    level->s = (char *)*s;
+    if (!slash) {
+        level->n = end - *s;
+        *s = end;
+        return 1;
+    }
+    level->n = slash - *s;
+    *s = slash + 1;
+    return 0;
+}
+
+static int
+__topic_level_cmp(const mqtt_str_t *a, const mqtt_str_t *b) {
+    size_t n;
+    int rc;
+
+    n = a->n < b->n ? a->n : b->n;
+    rc = n ? memcmp(a->s, b->s, n) : 0;
+    if (rc)
+        return rc;
+    return a->n < b->n ? -1 : a->n > b->n;
+}
+
+/* children are sorted by level, the index of level or where it belongs. */
+static int
+__topic_child_find(mqtt_topic_node_t *node, const mqtt_str_t *level, int *found) {
+    int lo, hi;
+
+    lo = 0;
+    hi = node->n;
+    while (lo < hi) {
+        int mid, rc;
+
+        mid = (lo + hi) / 2;
+        rc = __topic_level_cmp(&node->children[mid]->level, level);
+        if (rc == 0) {
+            *found = 1;
+            return mid;
+        }
+        if (rc < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *found = 0;
+    return lo;
+}
+
+static mqtt_topic_node_t *
+__topic_child(mqtt_topic_node_t *node, const mqtt_str_t *level, int create) {
+    mqtt_topic_node_t *child, **slot;
+    int i, found;
+
+    slot = 0;
+    if (level->n == 1 && level->s[0] == '+')
+        slot = &node->plus;
+    else if (level->n == 1 && level->s[0] == '#')
+        slot = &node->hash;
+    if (slot) {
+        if (!*slot && create) {
+            *slot = (mqtt_topic_node_t *)malloc(sizeof(mqtt_topic_node_t));
+            memset(*slot, 0, sizeof(mqtt_topic_node_t));
+            mqtt_str_copy(&(*slot)->level, (mqtt_str_t *)level);
+        }
+        return *slot;
+    }
+
+    i = __topic_child_find(node, level, &found);
+    if (found)
+        return node->children[i];
+    if (!create)
+        return 0;
+    if (node->n == node->size) {
+        node->size = node->size ? node->size * 2 : 4;
+        node->children = (mqtt_topic_node_t **)realloc(node->children, node->size * sizeof(mqtt_topic_node_t *));
+    }
+    child = (mqtt_topic_node_t *)malloc(sizeof *child);
+    memset(child, 0, sizeof *child);
+    mqtt_str_copy(&child->level, (mqtt_str_t *)level);
+    memmove(node->children + i + 1, node->children + i, (node->n - i) * sizeof(mqtt_topic_node_t *));
+    node->children[i] = child;
+    node->n++;
+    return child;
+}
+
+int
+mqtt_topic_tree_insert(mqtt_topic_tree_t *tree, const mqtt_str_t *filter, void *value) {
+    mqtt_topic_node_t *node;
+    const char *s, *end;
+    mqtt_str_t level;
+    int last;
+
+    if (!mqtt_topic_filter_valid(filter))
+        return -1;
+    node = &tree->root;
+    s = filter->s;
+    end = filter->s + filter->n;
+    do {
+        last = __topic_level(&s, end, &level);
+        node = __topic_child(node, &level, 1);
+    } while (!last);
+    node->values = (void **)realloc(node->values, (node->nvalues + 1) * sizeof(void *));
+    node->values[node->nvalues++] = value;
+    tree->count++;
+    return 0;
+}
+
+static int
+__topic_node_empty(mqtt_topic_node_t *node) {
+    return node->n == 0 && !node->plus && !node->hash && node->nvalues == 0;
+}
+
+/* remove value below node, pruning the levels it leaves empty. */
+static int
+__topic_remove(mqtt_topic_node_t *node, const char *s, const char *end, void *value) {
+    mqtt_topic_node_t *child;
+    mqtt_str_t level;
+    int last, i, rc;
+
+    last = __topic_level(&s, end, &level);
+    child = __topic_child(node, &level, 0);
+    if (!child)
+        return -1;
+    if (last) {
+        for (i = 0; i < child->nvalues; i++) {
+            if (child->values[i] == value)
                 break;
+        }
+        if (i == child->nvalues)
+            return -1;
+        child->values[i] = child->values[--child->nvalues];
+        rc = 0;
+    } else {
+        rc = __topic_remove(child, s, end, value);
+    }
+    if (rc || !__topic_node_empty(child))
+        return rc;
+
+    if (child == node->plus) {
+        node->plus = 0;
+    } else if (child == node->hash) {
+        node->hash = 0;
+    } else {
+        int found;
+
+        i = __topic_child_find(node, &child->level, &found);
+        memmove(node->children + i, node->children + i + 1, (node->n - i - 1) * sizeof(mqtt_topic_node_t *));
+        node->n--;
+    }
+    __topic_node_free(child, 0);
+    free(child);
+    return 0;
+}
+
+int
+mqtt_topic_tree_remove(mqtt_topic_tree_t *tree, const mqtt_str_t *filter, void *value) {
+    if (!mqtt_topic_filter_valid(filter))
+        return -1;
+    if (__topic_remove(&tree->root, filter->s, filter->s + filter->n, value))
+        return -1;
+    tree->count--;
+    return 0;
+}
+
+void **
+mqtt_topic_tree_get(mqtt_topic_tree_t *tree, const mqtt_str_t *filter, int *n) {
+    mqtt_topic_node_t *node;
+    const char *s, *end;
+    mqtt_str_t level;
+    int last;
+
+    *n = 0;
+    if (!mqtt_topic_filter_valid(filter))
+        return 0;
+    node = &tree->root;
+    s = filter->s;
+    end = filter->s + filter->n;
+    do {
+        last = __topic_level(&s, end, &level);
+        node = __topic_child(node, &level, 0);
+    } while (node && !last);
+    if (!node)
+        return 0;
+    *n = node->nvalues;
+    return node->values;
+}
+
+static void
+__topic_emit(mqtt_topic_node_t *node, mqtt_topic_match_pt match, void *ud) {
+    int i;
+
+    for (i = 0; i < node->nvalues; i++) {
+        match(ud, node->values[i]);
+    }
+}
+
+static void
+__topic_match(mqtt_topic_node_t *node, const char *s, const char *end, int first, mqtt_topic_match_pt match,
+              void *ud) {
+    mqtt_topic_node_t *child;
+    mqtt_str_t level;
+    int last;
+
+    last = __topic_level(&s, end, &level);
+    /* wildcards at the first level never match topics starting with $. */
+    if (!first || level.n == 0 || level.s[0] != '$') {
+        if (node->hash)
+            __topic_emit(node->hash, match, ud);
+        if (node->plus) {
+            if (last) {
+                __topic_emit(node->plus, match, ud);
+                if (node->plus->hash)
+                    __topic_emit(node->plus->hash, match, ud);
+            } else {
+                __topic_match(node->plus, s, end, 0, match, ud);
             }
-            properties->length -= len + 1;
-            *pp = property->next;
-            return property;
         }
-        pp = &property->next;
     }
+    child = __topic_child(node, &level, 0);
+    if (!child || child == node->plus || child == node->hash)
+        return;
+    if (last) {
+        __topic_emit(child, match, ud);
+        /* a/# matches a as well. */
+        if (child->hash)
+            __topic_emit(child->hash, match, ud);
+    } else {
+        __topic_match(child, s, end, 0, match, ud);
+    }
+}
+
+void
+mqtt_topic_tree_match(mqtt_topic_tree_t *tree, const mqtt_str_t *topic, mqtt_topic_match_pt match, void *ud) {
+    if (topic->n == 0 || tree->count == 0)
+        return;
+    __topic_match(&tree->root, topic->s, topic->s + topic->n, 1, match, ud);
+}
+
+int
+mqtt_topic_match(const mqtt_str_t *filter, const mqtt_str_t *topic) {
+    const char *f, *fe, *t, *te;
+    mqtt_str_t fl, tl;
+    int flast, tlast;
+
+    if (filter->n == 0 || topic->n == 0)
+        return 0;
+    f = filter->s;
+    fe = f + filter->n;
+    t = topic->s;
+    te = t + topic->n;
+    if (*t == '$' && (*f == '+' || *f == '#'))
+        return 0;
+    tlast = 0;
+    do {
+        flast = __topic_level(&f, fe, &fl);
+        if (fl.n == 1 && fl.s[0] == '#')
+            return 1;
+        /* the topic ran out, only a trailing # could still match. */
+        if (tlast)
+            return 0;
+        tlast = __topic_level(&t, te, &tl);
+        if (!(fl.n == 1 && fl.s[0] == '+') && __topic_level_cmp(&fl, &tl))
+            return 0;
+    } while (!flast);
+    return tlast;
+}
+
+int
+mqtt_topic_filter_compile(mqtt_topic_filter_t *compiled, const mqtt_str_t *filter) {
+    const char *s, *end;
+    mqtt_str_t level;
+    size_t i;
+    int n;
+
+    memset(compiled, 0, sizeof *compiled);
+    if (!mqtt_topic_filter_valid(filter))
+        return -1;
+
+    /* a wildcard always fills a level, so the first one starts the tokens. */
+    for (i = 0; i < filter->n; i++) {
+        if (filter->s[i] == '+' || filter->s[i] == '#')
+            break;
+    }
+    compiled->prefix = i;
+    n = 0;
+    if (i < filter->n) {
+        n = 1;
+        for (; i < filter->n; i++) {
+            if (filter->s[i] == '/')
+                n++;
+        }
+    }
+
+    /* the tokens and the copy of the filter share one allocation. */
+    compiled->tokens = (mqtt_topic_token_t *)malloc(n * sizeof(mqtt_topic_token_t) + filter->n);
+    compiled->s = (char *)(compiled->tokens + n);
+    compiled->n = filter->n;
+    memcpy(compiled->s, filter->s, filter->n);
+
+    s = compiled->s + compiled->prefix;
+    end = compiled->s + compiled->n;
+    for (i = 0; (int)i < n; i++) {
+        mqtt_topic_token_t *token;
+
+        __topic_level(&s, end, &level);
+        token = &compiled->tokens[i];
+        token->off = (uint16_t)(level.s - compiled->s);
+        token->n = (uint16_t)level.n;
+        if (level.n == 1 && level.s[0] == '+')
+            token->op = MQTT_TOPIC_TOKEN_PLUS;
+        else if (level.n == 1 && level.s[0] == '#')
+            token->op = MQTT_TOPIC_TOKEN_HASH;
+        else
+            token->op = MQTT_TOPIC_TOKEN_LEVEL;
+    }
+    compiled->ntokens = n;
     return 0;
 }
 
+void
+mqtt_topic_filter_unit(mqtt_topic_filter_t *compiled) {
+    if (compiled->tokens)
+        free(compiled->tokens);
+    memset(compiled, 0, sizeof *compiled);
+}
+
+int
+mqtt_topic_filter_match(const mqtt_topic_filter_t *compiled, const mqtt_str_t *topic) {
+    const char *t, *te;
+    int i, tlast;
+
+    if (topic->n == 0 || compiled->n == 0)
+        return 0;
+    /* wildcards at the first level never match topics starting with $. */
+    if (compiled->prefix == 0 && topic->s[0] == '$')
+        return 0;
+    if (compiled->ntokens == 0)
+        return topic->n == compiled->n && !memcmp(topic->s, compiled->s, compiled->n);
+    if (topic->n < compiled->prefix) {
+        /* a/# matches a as well. */
+        return compiled->tokens[0].op == MQTT_TOPIC_TOKEN_HASH && topic->n + 1 == compiled->prefix &&
+               !memcmp(topic->s, compiled->s, topic->n);
+    }
+    if (memcmp(topic->s, compiled->s, compiled->prefix))
+        return 0;
+
+    t = topic->s + compiled->prefix;
+    te = topic->s + topic->n;
+    tlast = 0;
+    for (i = 0; i < compiled->ntokens; i++) {
+        const mqtt_topic_token_t *token;
+        mqtt_str_t level;
+
+        token = &compiled->tokens[i];
+        if (token->op == MQTT_TOPIC_TOKEN_HASH)
+            return 1;
+        /* the topic ran out, only a trailing # could still match. */
+        if (tlast)
+            return 0;
+        tlast = __topic_level(&t, te, &level);
+        if (token->op == MQTT_TOPIC_TOKEN_LEVEL &&
+            (level.n != token->n || memcmp(level.s, compiled->s + token->off, token->n)))
+            return 0;
+    }
+    return tlast;
+}
+
 void
 mqtt_sn_packet_init(mqtt_sn_packet_t *pkt, mqtt_sn_packet_type_t type) {
     memset(pkt, 0, sizeof *pkt);
@@ -0,0 +1,374 @@
+#define MQTT_CLI_LINUX_PLATFORM
+#define MQTT_CLI_LINUX_LOOP
+#define MQTT_CLI_IMPL
+#include "mqtt_cli.h"
+
+#include <getopt.h>
+#include <inttypes.h>
+
+/*
+ * log-linear latency histogram in microseconds, values below 128 are exact,
+ * above that every power of two is split into 64 buckets, under 1.6% error.
+ */
+#define HIST_SUB_BITS 6
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_SIZE (HIST_SUB * 66)
+
+typedef struct {
+    uint64_t counts[HIST_SIZE];
+    uint64_t n;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+} hist_t;
+
+static int
+hist_index(uint64_t v) {
+    int shift;
+
+    if (v < 2 * HIST_SUB)
+        return (int)v;
+    shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int)(v >> shift) - HIST_SUB;
+}
+
+static uint64_t
+hist_value(int i) {
+    int shift;
+
+    if (i < 2 * HIST_SUB)
+        return (uint64_t)i;
+    shift = i / HIST_SUB - 1;
+    return (uint64_t)(i % HIST_SUB + HIST_SUB) << shift;
+}
+
+static void
+hist_record(hist_t *h, uint64_t v) {
+    h->counts[hist_index(v)]++;
+    if (h->n == 0 || v < h->min)
+        h->min = v;
+    if (v > h->max)
+        h->max = v;
+    h->sum += (double)v;
+    h->n++;
+}
+
+static uint64_t
+hist_percentile(hist_t *h, double p) {
+    uint64_t rank, seen;
+    int i;
+
+    rank = (uint64_t)(p / 100.0 * (double)h->n + 0.5);
+    if (rank == 0)
+        rank = 1;
+    seen = 0;
+    for (i = 0; i < HIST_SIZE; i++) {
+        seen += h->counts[i];
+        if (seen >= rank)
+            return hist_value(i) > h->max ? h->max : hist_value(i);
+    }
+    return h->max;
+}
+
+static uint64_t
+bench_now_us() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+typedef struct {
+    mqtt_cli_t *m;
+    char topic[32];
+    mqtt_publish_template_t tpl;
+    int ready;
+    int closed;
+    uint64_t sent;
+    uint64_t received;
+} bench_conn_t;
+
+static struct {
+    int conns;
+    mqtt_qos_t qos;
+    uint64_t rate;
+    size_t size;
+    int seconds;
+    int window;
+    mqtt_version_t version;
+    int uring;
+    int tpl;
+    hist_t hist;
+} B = {
+    .conns = 10,
+    .qos = MQTT_QOS_0,
+    .rate = 0,
+    .size = 64,
+    .seconds = 10,
+    .window = 100,
+    .version = MQTT_VERSION_4,
+    .uring = 1,
+};
+
+static void
+_connack(mqtt_cli_t *m, void *ud, const mqtt_packet_t *pkt) {
+    bench_conn_t *c;
+    mqtt_qos_t qos;
+    const char *topic;
+
+    (void)pkt;
+    c = (bench_conn_t *)ud;
+    topic = c->topic;
+    qos = B.qos;
+    mqtt_cli_subscribe(m, 1, &topic, &qos, 0);
+}
+
+static void
+_suback(mqtt_cli_t *m, void *ud, const mqtt_packet_t *pkt) {
+    (void)m;
+    (void)pkt;
+
+    ((bench_conn_t *)ud)->ready = 1;
+}
+
+static void
+_publish(mqtt_cli_t *m, void *ud, const mqtt_packet_t *pkt) {
+    bench_conn_t *c;
+    uint64_t t;
+
+    (void)m;
+    c = (bench_conn_t *)ud;
+    c->received++;
+    if (pkt->p.publish.message.n < sizeof t)
+        return;
+    memcpy(&t, pkt->p.publish.message.s, sizeof t);
+    hist_record(&B.hist, bench_now_us() - t);
+}
+
+static void
+_close(linux_loop_t *l, mqtt_cli_t *m, void *ud) {
+    (void)l;
+    (void)m;
+
+    ((bench_conn_t *)ud)->closed = 1;
+}
+
+static int
+_publish_one(bench_conn_t *c, char *payload) {
+    mqtt_str_t message;
+    uint64_t t;
+
+    if (!c->ready || c->closed || c->sent - c->received >= (uint64_t)B.window)
+        return 0;
+    t = bench_now_us();
+    memcpy(payload, &t, sizeof t);
+    mqtt_str_init(&message, payload, B.size);
+    if (B.tpl ? mqtt_cli_publish_template(c->m, &c->tpl, &message, 0)
+              : mqtt_cli_publish(c->m, 0, c->topic, B.qos, &message, 0))
+        return 0;
+    c->sent++;
+    return 1;
+}
+
+static void
+_usage(const char *name) {
+    printf("usage: %s [-c conns] [-q qos] [-r rate] [-s size] [-d seconds] [-w window] [-V version] [-e] [-t] "
+           "host[:port]|unix://path\n",
+           name);
+    printf("  -r messages per second over all connections, 0 publishes as fast as the window allows\n");
+    printf("  -w messages a connection may have published but not yet received back\n");
+    printf("  -e use epoll instead of io_uring\n");
+    printf("  -t publish through a prepared topic template\n");
+}
+
+int
+main(int argc, char *argv[]) {
+    bench_conn_t *conns;
+    linux_loop_t *l;
+    char *payload;
+    uint64_t start, end, last, sent, received, budget, credit;
+    int opt, i, next;
+
+    while ((opt = getopt(argc, argv, "c:q:r:s:d:w:V:et")) != -1) {
+        switch (opt) {
+        case 'c':
+            B.conns = atoi(optarg);
+            break;
+        case 'q':
+            B.qos = (mqtt_qos_t)atoi(optarg);
+            break;
+        case 'r':
+            B.rate = strtoull(optarg, 0, 10);
+            break;
+        case 's':
+            B.size = strtoul(optarg, 0, 10);
+            break;
+        case 'd':
+            B.seconds = atoi(optarg);
+            break;
+        case 'w':
+            B.window = atoi(optarg);
+            break;
+        case 'V':
+            B.version = (mqtt_version_t)atoi(optarg);
+            break;
+        case 'e':
+            B.uring = 0;
+            break;
+        case 't':
+            B.tpl = 1;
+            break;
+        default:
+            _usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc || B.conns <= 0 || B.qos > MQTT_QOS_2 || B.window <= 0 || B.version < MQTT_VERSION_3 ||
+        B.version > MQTT_VERSION_5) {
+        _usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (B.size < sizeof(uint64_t))
+        B.size = sizeof(uint64_t);
+
+    l = linux_loop_create(B.uring, _close, 0);
+    if (!l) {
+        fprintf(stderr, "linux_loop_create(): %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    conns = (bench_conn_t *)calloc(B.conns, sizeof *conns);
+    for (i = 0; i < B.conns; i++) {
+        bench_conn_t *c = &conns[i];
+        char client_id[32];
+        void *net;
+
+        snprintf(client_id, sizeof(client_id), "mqtt_bench-%d-%d", (int)getpid(), i);
+        snprintf(c->topic, sizeof(c->topic), "bench/%d", i);
+        mqtt_publish_template_init(&c->tpl, B.version, c->topic, B.qos, 0);
+        mqtt_cli_conf_t config = {
+            .client_id = client_id,
+            .version = B.version,
+            .keep_alive = 60,
+            .clean_session = 1,
+            .cb =
+                {
+                    .connack = _connack,
+                    .suback = _suback,
+                    .publish = _publish,
+                },
+            .ud = c,
+        };
+
+        if (!strncmp(argv[optind], "unix://", 7)) {
+            net = linux_unix_connect(argv[optind] + 7);
+        } else {
+            char host[256], *colon;
+            int port;
+
+            snprintf(host, sizeof(host), "%s", argv[optind]);
+            colon = strrchr(host, ':');
+            port = MQTT_TCP_PORT;
+            if (colon && colon == strchr(host, ':')) {
+                *colon = 0;
+                port = atoi(colon + 1);
+            }
+            net = linux_tcp_connect(host, port);
+        }
+        if (!net) {
+            fprintf(stderr, "connect(): %s: %s\n", argv[optind], strerror(errno));
+            return EXIT_FAILURE;
+        }
+        c->m = mqtt_cli_create(&config);
+        mqtt_cli_connect(c->m);
+        if (linux_loop_add(l, net, c->m, c)) {
+            fprintf(stderr, "linux_loop_add(): failed\n");
+            return EXIT_FAILURE;
+        }
+    }
+    printf("%d connections, qos %d, %zu bytes, %s, backend %s\n", B.conns, B.qos, B.size,
+           B.rate ? "fixed rate" : "max rate", linux_loop_backend(l));
+
+    payload = (char *)calloc(1, B.size);
+    start = bench_now_us();
+    end = start + (uint64_t)B.seconds * 1000000;
+    last = start;
+    budget = 0;
+    credit = 0;
+    next = 0;
+    while (1) {
+        uint64_t now;
+        int n;
+
+        now = bench_now_us();
+        if (now >= end)
+            break;
+        /* token bucket over all connections, capped at one second of burst. */
+        if (B.rate) {
+            credit += (now - last) * B.rate;
+            budget += credit / 1000000;
+            credit %= 1000000;
+            if (budget > B.rate)
+                budget = B.rate;
+        }
+        last = now;
+        n = 0;
+        while (!B.rate || budget > 0) {
+            int k, published;
+
+            published = 0;
+            for (k = 0; k < B.conns && (!B.rate || budget > 0); k++) {
+                if (_publish_one(&conns[next], payload)) {
+                    published = 1;
+                    if (B.rate)
+                        budget--;
+                }
+                next = (next + 1) % B.conns;
+            }
+            if (!published || ++n >= B.window)
+                break;
+        }
+        linux_loop_run(l, 1);
+    }
+
+    /* let the last messages come back before counting. */
+    end = bench_now_us() + 1000000;
+    while (bench_now_us() < end) {
+        sent = received = 0;
+        for (i = 0; i < B.conns; i++) {
+            sent += conns[i].sent;
+            received += conns[i].received;
+        }
+        if (received >= sent)
+            break;
+        linux_loop_run(l, 10);
+    }
+
+    sent = received = 0;
+    for (i = 0; i < B.conns; i++) {
+        sent += conns[i].sent;
+        received += conns[i].received;
+    }
+    printf("sent %" PRIu64 ", received %" PRIu64 " in %d s, %.0f msg/s, %.2f MB/s\n", sent, received, B.seconds,
+           (double)received / B.seconds, (double)received * B.size / B.seconds / 1e6);
+    if (B.hist.n) {
+        printf("latency us: min %" PRIu64 ", mean %.1f, max %" PRIu64 "\n", B.hist.min, B.hist.sum / B.hist.n,
+               B.hist.max);
+        printf("  p50 %" PRIu64 ", p90 %" PRIu64 ", p99 %" PRIu64 ", p99.9 %" PRIu64 ", p99.99 %" PRIu64 "\n",
+               hist_percentile(&B.hist, 50), hist_percentile(&B.hist, 90), hist_percentile(&B.hist, 99),
+               hist_percentile(&B.hist, 99.9), hist_percentile(&B.hist, 99.99));
+    }
+
+    for (i = 0; i < B.conns; i++) {
+        if (!conns[i].closed)
+            mqtt_cli_disconnect(conns[i].m);
+    }
+    linux_loop_run(l, 10);
+    linux_loop_destroy(l);
+    for (i = 0; i < B.conns; i++) {
+        mqtt_cli_destroy(conns[i].m);
+    }
+    free(conns);
+    free(payload);
+
+    return 0;
+}
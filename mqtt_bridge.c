@@ -0,0 +1,645 @@
+#define MQTT_CLI_LINUX_PLATFORM
+#define MQTT_CLI_LINUX_LOOP
+#define MQTT_CLI_IMPL
+#include "mqtt_cli.h"
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <zlib.h>
+
+/*
+ * forwards what a local broker publishes on the given filters to an upstream
+ * broker, many small messages coalesced into one envelope PUBLISH:
+ *
+ *   byte 0   flags, bit 0 set when the rest is a zlib stream
+ *   records  topic as a 2 byte length and bytes, message length as a
+ *            variable byte integer, message bytes
+ *
+ * records keep arrival order so each device stays ordered. local qos 1/2
+ * messages are acknowledged only once upstream acknowledged their envelope.
+ */
+
+#define BRIDGE_FILTER_MAX 16
+#define BRIDGE_BACKOFF_MAX 30000
+/* how often a pending resolve or connect is looked at, the loop keeps running meanwhile. */
+#define BRIDGE_CONNECT_POLL 20
+
+typedef struct {
+    uint16_t packet_id;
+    mqtt_qos_t qos;
+    /* batch offset just past the record, to split the acks with the records. */
+    size_t end;
+} bridge_ack_t;
+
+/* an envelope upstream has not acknowledged yet, with the local acks it holds. */
+typedef struct bridge_envelope_s {
+    uint16_t packet_id;
+    bridge_ack_t *acks;
+    int n;
+    struct bridge_envelope_s *next;
+} bridge_envelope_t;
+
+/* one broker connection, reconnected by the mqtt_cli_conn state machine. */
+typedef struct {
+    const char *name;
+    const char *addr;
+    char host[256];
+    int port;
+    const char *path;
+    mqtt_cli_t *m;
+    mqtt_cli_conn_t conn;
+    linux_resolve_t *resolve;
+    linux_tcp_connector_t *connector;
+    /* the socket is in the loop, which advances m from then on. */
+    int up;
+} bridge_side_t;
+
+static struct {
+    const char *filters[BRIDGE_FILTER_MAX];
+    int nfilters;
+    const char *topic;
+    uint64_t age;
+    size_t size;
+    int deflate;
+    mqtt_qos_t qos;
+    mqtt_version_t version;
+    int verbose;
+    linux_loop_t *loop;
+    bridge_side_t local;
+    bridge_side_t upstream;
+
+    /* the envelope being filled. */
+    struct {
+        mqtt_str_t b;
+        size_t cap;
+        int count;
+        mqtt_qos_t qos;
+        uint64_t t_first;
+        bridge_ack_t *acks;
+        int n;
+        int size;
+    } batch;
+
+    bridge_envelope_t *inflight;
+    bridge_envelope_t **tail;
+    int ninflight;
+
+    struct {
+        uint64_t messages;
+        uint64_t envelopes;
+        uint64_t raw;
+        uint64_t sent;
+        uint64_t dropped;
+    } stats;
+} B = {
+    .topic = "bridge/envelope",
+    .age = 1000,
+    .size = 8192,
+    .qos = MQTT_QOS_1,
+    .version = MQTT_VERSION_4,
+};
+
+/* connected means CONNACK arrived, up that the socket is still in the loop. */
+static int
+_upstream_ready() {
+    return B.upstream.up && mqtt_cli_connected(B.upstream.m);
+}
+
+static void
+_batch_reserve(size_t n) {
+    if (B.batch.b.n + n > B.batch.cap) {
+        size_t cap;
+
+        cap = B.batch.cap ? B.batch.cap : 4096;
+        while (cap < B.batch.b.n + n) {
+            cap *= 2;
+        }
+        B.batch.b.s = (char *)realloc(B.batch.b.s, cap);
+        B.batch.cap = cap;
+    }
+}
+
+static void
+_batch_add(const mqtt_packet_t *pkt) {
+    const mqtt_str_t *topic, *message;
+    mqtt_qos_t qos;
+
+    topic = &pkt->v.publish.topic_name;
+    message = &pkt->p.publish.message;
+    qos = (mqtt_qos_t)pkt->f.bits.qos;
+    if (B.batch.count == 0) {
+        B.batch.b.n = 0;
+        _batch_reserve(1);
+        B.batch.b.s[B.batch.b.n++] = 0;
+        B.batch.qos = MQTT_QOS_0;
+        B.batch.t_first = linux_time_now();
+    }
+    _batch_reserve(2 + topic->n + mqtt_vbi_length(message->n) + message->n);
+    mqtt_str_write_utf(&B.batch.b, topic);
+    mqtt_str_write_vbi(&B.batch.b, (uint32_t)message->n);
+    if (message->n > 0) {
+        memcpy(B.batch.b.s + B.batch.b.n, message->s, message->n);
+        B.batch.b.n += message->n;
+    }
+    B.batch.count++;
+    if (qos > B.batch.qos)
+        B.batch.qos = qos;
+    if (qos > MQTT_QOS_0) {
+        if (B.batch.n == B.batch.size) {
+            B.batch.size = B.batch.size ? B.batch.size * 2 : 64;
+            B.batch.acks = (bridge_ack_t *)realloc(B.batch.acks, B.batch.size * sizeof *B.batch.acks);
+        }
+        B.batch.acks[B.batch.n].packet_id = pkt->v.publish.packet_id;
+        B.batch.acks[B.batch.n].qos = qos;
+        B.batch.acks[B.batch.n].end = B.batch.b.n;
+        B.batch.n++;
+    }
+}
+
+static void
+_ack_local(bridge_ack_t *acks, int n) {
+    int i;
+
+    /* acks of a dropped local connection are stale, the broker resends those messages. */
+    if (!B.local.up)
+        return;
+    for (i = 0; i < n; i++) {
+        mqtt_cli_puback(B.local.m, acks[i].qos, acks[i].packet_id);
+    }
+}
+
+/* raw batch bytes one envelope may carry under the upstream maximum packet size, 0 when unlimited. */
+static size_t
+_envelope_room(mqtt_qos_t qos) {
+    mqtt_str_t topic = MQTT_STR_INITIALIZER;
+    size_t max, header;
+
+    max = mqtt_cli_maximum_packet_size(B.upstream.m);
+    if (max == 0)
+        return 0;
+    mqtt_str_from(&topic, B.topic);
+    /* header as for the largest message, plus the topic alias property mqtt_cli_publish may add. */
+    header = mqtt_publish_length(B.version, qos, &topic, 0, max) - max + 3;
+    return max > header ? max - header : 1;
+}
+
+/* offset just past the record starting at off. */
+static size_t
+_record_end(size_t off) {
+    mqtt_str_t r;
+    size_t n;
+
+    mqtt_str_init(&r, B.batch.b.s + off, B.batch.b.n - off);
+    n = mqtt_str_read_u16(&r);
+    r.s += n;
+    r.n -= n;
+    n = mqtt_str_read_vbi(&r, 0);
+    return (size_t)(r.s - B.batch.b.s) + n;
+}
+
+/* publish the batch bytes before cut as one envelope, deflated when that makes it smaller. */
+static int
+_envelope(size_t cut, int count, int nacks, mqtt_qos_t qos) {
+    mqtt_str_t message;
+    uint16_t packet_id;
+    char *z;
+
+    z = 0;
+    mqtt_str_init(&message, B.batch.b.s, cut);
+    if (B.deflate) {
+        uLongf zn;
+
+        zn = compressBound(cut - 1);
+        z = (char *)malloc(1 + zn);
+        if (compress2((Bytef *)z + 1, &zn, (const Bytef *)B.batch.b.s + 1, cut - 1, Z_BEST_SPEED) == Z_OK &&
+            1 + zn < cut) {
+            z[0] = 1;
+            mqtt_str_init(&message, z, 1 + zn);
+        }
+    }
+    packet_id = 0;
+    if (mqtt_cli_publish(B.upstream.m, 0, B.topic, qos, &message, &packet_id)) {
+        fprintf(stderr, "mqtt_cli_publish(): envelope of %zu bytes failed\n", message.n);
+        free(z);
+        return -1;
+    }
+    B.stats.envelopes++;
+    B.stats.messages += count;
+    B.stats.raw += cut;
+    B.stats.sent += message.n;
+    if (qos == MQTT_QOS_0) {
+        _ack_local(B.batch.acks, nacks);
+    } else {
+        bridge_envelope_t *e;
+
+        e = (bridge_envelope_t *)malloc(sizeof *e);
+        e->packet_id = packet_id;
+        e->n = nacks;
+        e->acks = 0;
+        if (e->n > 0) {
+            e->acks = (bridge_ack_t *)malloc(e->n * sizeof *e->acks);
+            memcpy(e->acks, B.batch.acks, e->n * sizeof *e->acks);
+        }
+        e->next = 0;
+        *B.tail = e;
+        B.tail = &e->next;
+        B.ninflight++;
+    }
+    free(z);
+    return 0;
+}
+
+/*
+ * publish the batch upstream as envelopes of whole records that each fit the
+ * upstream maximum packet size. what cannot be published stays in the batch.
+ */
+static void
+_flush() {
+    mqtt_qos_t qos;
+    size_t room, cut, end;
+    int count, nacks, i;
+
+    if (B.batch.count == 0 || !_upstream_ready())
+        return;
+    qos = B.batch.qos < B.qos ? B.batch.qos : B.qos;
+    room = _envelope_room(qos);
+    while (B.batch.count > 0) {
+        for (cut = 1, count = 0; count < B.batch.count; count++) {
+            end = _record_end(cut);
+            if (room && end > room && count > 0)
+                break;
+            cut = end;
+        }
+        for (nacks = 0; nacks < B.batch.n && B.batch.acks[nacks].end <= cut; nacks++) {
+        }
+        if (room && cut > room) {
+            /* a record too large on its own never fits, ack it or local resends it forever. */
+            fprintf(stderr, "_flush(): message of %zu bytes exceeds the upstream maximum packet size\n", cut - 1);
+            B.stats.dropped++;
+            _ack_local(B.batch.acks, nacks);
+        } else if (_envelope(cut, count, nacks, qos)) {
+            /* retry once the rest is due again. */
+            B.batch.t_first = linux_time_now();
+            return;
+        }
+        memmove(B.batch.b.s + 1, B.batch.b.s + cut, B.batch.b.n - cut);
+        B.batch.b.n -= cut - 1;
+        B.batch.count -= count;
+        B.batch.n -= nacks;
+        for (i = 0; i < B.batch.n; i++) {
+            B.batch.acks[i] = B.batch.acks[nacks + i];
+            B.batch.acks[i].end -= cut - 1;
+        }
+    }
+}
+
+static void
+_local_connack(mqtt_cli_t *m, void *ud, const mqtt_packet_t *pkt) {
+    mqtt_qos_t qos[BRIDGE_FILTER_MAX];
+    int i;
+
+    (void)ud;
+    (void)pkt;
+    for (i = 0; i < B.nfilters; i++) {
+        qos[i] = B.qos;
+    }
+    mqtt_cli_subscribe(m, B.nfilters, B.filters, qos, 0);
+}
+
+static void
+_local_publish(mqtt_cli_t *m, void *ud, const mqtt_packet_t *pkt) {
+    (void)m;
+    (void)ud;
+
+    /* with upstream away only what local will resend is kept unbounded. */
+    if (!_upstream_ready() && pkt->f.bits.qos == MQTT_QOS_0 && B.batch.b.n >= B.size * 16) {
+        B.stats.dropped++;
+        return;
+    }
+    _batch_add(pkt);
+    if (B.batch.b.n >= B.size)
+        _flush();
+}
+
+static void
+_upstream_puback(mqtt_cli_t *m, void *ud, const mqtt_packet_t *pkt) {
+    bridge_envelope_t *e, **pe;
+    uint16_t packet_id;
+
+    (void)m;
+    (void)ud;
+    /* a qos 2 envelope is done at PUBCOMP, not at PUBREC. */
+    if (pkt->f.bits.type == MQTT_PUBREC)
+        return;
+    packet_id = pkt->f.bits.type == MQTT_PUBCOMP ? pkt->v.pubcomp.packet_id : pkt->v.puback.packet_id;
+    for (pe = &B.inflight; (e = *pe); pe = &e->next) {
+        if (e->packet_id == packet_id)
+            break;
+    }
+    if (!e)
+        return;
+    *pe = e->next;
+    if (B.tail == &e->next)
+        B.tail = pe;
+    B.ninflight--;
+    _ack_local(e->acks, e->n);
+    free(e->acks);
+    free(e);
+}
+
+static void
+_close(linux_loop_t *l, mqtt_cli_t *m, void *ud) {
+    bridge_side_t *side;
+
+    (void)l;
+    (void)m;
+    side = (bridge_side_t *)ud;
+    side->up = 0;
+    mqtt_cli_conn_event(&side->conn, MQTT_CLI_EVENT_FAILED);
+    fprintf(stderr, "%s %s: connection closed\n", side->name, side->addr);
+    if (side == &B.local) {
+        bridge_envelope_t *e;
+
+        /* the local broker resends unacknowledged messages to the new connection. */
+        for (e = B.inflight; e; e = e->next) {
+            e->n = 0;
+        }
+        B.batch.n = 0;
+    }
+}
+
+static void
+_failed(bridge_side_t *side, const char *what) {
+    fprintf(stderr, "%s %s: %s(): %s\n", side->name, side->addr, what, strerror(errno));
+    mqtt_cli_conn_event(&side->conn, MQTT_CLI_EVENT_FAILED);
+}
+
+static void
+_attach(bridge_side_t *side, void *net) {
+    if (linux_loop_add(B.loop, net, side->m, side)) {
+        _failed(side, "linux_loop_add");
+        return;
+    }
+    side->up = 1;
+    mqtt_cli_conn_event(&side->conn, MQTT_CLI_EVENT_CONNECTED);
+    if (B.verbose)
+        fprintf(stderr, "%s %s: connected\n", side->name, side->addr);
+}
+
+/*
+ * step one side without blocking: resolve and connect while it is away,
+ * then leave m to the loop and only let the state machine see CONNACK.
+ */
+static void
+_drive(bridge_side_t *side, uint64_t time) {
+    void *net;
+    int rc;
+
+    if (side->up) {
+        if (side->conn.state == MQTT_CLI_STATE_CONNACK && mqtt_cli_connected(side->m))
+            mqtt_cli_conn_elapsed(&side->conn, 0);
+        return;
+    }
+    mqtt_cli_conn_elapsed(&side->conn, time);
+    switch (side->conn.state) {
+    case MQTT_CLI_STATE_RESOLVING:
+        if (side->path) {
+            mqtt_cli_conn_event(&side->conn, MQTT_CLI_EVENT_RESOLVED);
+            break;
+        }
+        if (!side->resolve)
+            side->resolve = linux_resolve_start(side->host, side->port);
+        rc = linux_resolve_wait(side->resolve, 0);
+        if (rc > 0) {
+            side->connector = linux_tcp_connector_start(side->resolve);
+            mqtt_cli_conn_event(&side->conn, MQTT_CLI_EVENT_RESOLVED);
+        } else if (rc < 0) {
+            errno = EHOSTUNREACH;
+            _failed(side, "linux_resolve_wait");
+        }
+        if (rc) {
+            linux_resolve_release(side->resolve);
+            side->resolve = 0;
+        }
+        break;
+    case MQTT_CLI_STATE_CONNECTING:
+        if (side->path) {
+            net = linux_unix_connect(side->path);
+            if (net)
+                _attach(side, net);
+            else
+                _failed(side, "linux_unix_connect");
+            break;
+        }
+        net = linux_tcp_connector_poll(side->connector, 0);
+        if (net || errno != EINPROGRESS) {
+            linux_tcp_connector_close(side->connector);
+            side->connector = 0;
+        }
+        if (net)
+            _attach(side, net);
+        else if (errno != EINPROGRESS)
+            _failed(side, "linux_tcp_connect");
+        break;
+    default:
+        /* a resolve or connect that timed out is abandoned here. */
+        if (side->resolve) {
+            linux_resolve_release(side->resolve);
+            side->resolve = 0;
+        }
+        if (side->connector) {
+            linux_tcp_connector_close(side->connector);
+            side->connector = 0;
+        }
+        break;
+    }
+}
+
+/* how long the loop may wait before this side needs looking at. */
+static uint64_t
+_deadline(bridge_side_t *side) {
+    if (side->up)
+        return UINT64_MAX;
+    if (side->conn.state == MQTT_CLI_STATE_RESOLVING || side->conn.state == MQTT_CLI_STATE_CONNECTING)
+        return BRIDGE_CONNECT_POLL;
+    return mqtt_cli_conn_next_deadline(&side->conn);
+}
+
+static void
+_side_init(bridge_side_t *side, const char *name, const char *addr, mqtt_cli_conf_t *config) {
+    mqtt_cli_conn_conf_t conn_config = {
+        .backoff_base = 1000,
+        .backoff_cap = BRIDGE_BACKOFF_MAX,
+    };
+
+    side->name = name;
+    side->addr = addr;
+    side->port = MQTT_TCP_PORT;
+    if (!strncmp(addr, "unix://", 7)) {
+        side->path = addr + 7;
+    } else {
+        char *colon;
+
+        snprintf(side->host, sizeof(side->host), "%s", addr);
+        colon = strrchr(side->host, ':');
+        if (colon && colon == strchr(side->host, ':')) {
+            *colon = 0;
+            side->port = atoi(colon + 1);
+        }
+    }
+    side->m = mqtt_cli_create(config);
+    mqtt_cli_conn_init(&side->conn, side->m, &conn_config);
+}
+
+static void
+_usage(const char *name) {
+    printf("usage: %s [-f filter]... [-t topic] [-a ms] [-b bytes] [-z] [-q qos] [-i id] [-V version] [-e] [-v] "
+           "local upstream\n",
+           name);
+    printf("  local and upstream are host[:port] or unix://path\n");
+    printf("  -f local filter to forward, may repeat, default pms5003st/#\n");
+    printf("  -t upstream envelope topic, default bridge/envelope\n");
+    printf("  -a oldest message age in ms that sends the envelope, default 1000\n");
+    printf("  -b envelope size in bytes that sends it, default 8192\n");
+    printf("  -z deflate envelopes\n");
+    printf("  -q highest qos forwarded, default 1\n");
+}
+
+int
+main(int argc, char *argv[]) {
+    char client_id[64], local_id[80], upstream_id[80];
+    const char *id;
+    uint64_t t_report, t_drive;
+    int opt, uring;
+
+    id = 0;
+    uring = 1;
+    while ((opt = getopt(argc, argv, "f:t:a:b:zq:i:V:ev")) != -1) {
+        switch (opt) {
+        case 'f':
+            if (B.nfilters == BRIDGE_FILTER_MAX) {
+                fprintf(stderr, "at most %d filters\n", BRIDGE_FILTER_MAX);
+                return EXIT_FAILURE;
+            }
+            B.filters[B.nfilters++] = optarg;
+            break;
+        case 't':
+            B.topic = optarg;
+            break;
+        case 'a':
+            B.age = strtoull(optarg, 0, 10);
+            break;
+        case 'b':
+            B.size = strtoul(optarg, 0, 10);
+            break;
+        case 'z':
+            B.deflate = 1;
+            break;
+        case 'q':
+            B.qos = (mqtt_qos_t)atoi(optarg);
+            break;
+        case 'i':
+            id = optarg;
+            break;
+        case 'V':
+            B.version = (mqtt_version_t)atoi(optarg);
+            break;
+        case 'e':
+            uring = 0;
+            break;
+        case 'v':
+            B.verbose = 1;
+            break;
+        default:
+            _usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind + 2 != argc || B.qos > MQTT_QOS_2 || B.version < MQTT_VERSION_3 || B.version > MQTT_VERSION_5) {
+        _usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (B.nfilters == 0)
+        B.filters[B.nfilters++] = "pms5003st/#";
+    if (!id) {
+        char hostname[32];
+
+        gethostname(hostname, sizeof(hostname));
+        hostname[sizeof(hostname) - 1] = 0;
+        snprintf(client_id, sizeof(client_id), "mqtt_bridge-%s", hostname);
+        id = client_id;
+    }
+    B.tail = &B.inflight;
+
+    /* both sessions persist so neither side loses what is in flight over a reconnect. */
+    snprintf(local_id, sizeof(local_id), "%s-local", id);
+    mqtt_cli_conf_t local_config = {
+        .client_id = local_id,
+        .version = B.version,
+        .keep_alive = 60,
+        .clean_session = 0,
+        .manual_ack = 1,
+        .cb =
+            {
+                .connack = _local_connack,
+                .publish = _local_publish,
+            },
+    };
+    snprintf(upstream_id, sizeof(upstream_id), "%s-upstream", id);
+    mqtt_cli_conf_t upstream_config = {
+        .client_id = upstream_id,
+        .version = B.version,
+        .keep_alive = 60,
+        .clean_session = 0,
+        .cb =
+            {
+                .puback = _upstream_puback,
+            },
+    };
+    _side_init(&B.local, "local", argv[optind], &local_config);
+    _side_init(&B.upstream, "upstream", argv[optind + 1], &upstream_config);
+
+    B.loop = linux_loop_create(uring, _close, 0);
+    if (!B.loop) {
+        fprintf(stderr, "linux_loop_create(): %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    t_report = t_drive = linux_time_now();
+    while (1) {
+        uint64_t now, timeout, deadline;
+
+        now = linux_time_now();
+        _drive(&B.upstream, now - t_drive);
+        _drive(&B.local, now - t_drive);
+        t_drive = now;
+        if (B.batch.count > 0 && now - B.batch.t_first >= B.age)
+            _flush();
+
+        timeout = 1000;
+        deadline = _deadline(&B.upstream);
+        if (deadline < timeout)
+            timeout = deadline;
+        deadline = _deadline(&B.local);
+        if (deadline < timeout)
+            timeout = deadline;
+        if (B.batch.count > 0 && _upstream_ready()) {
+            uint64_t due = B.batch.t_first + B.age;
+
+            if (due <= now)
+                timeout = 0;
+            else if (due - now < timeout)
+                timeout = due - now;
+        }
+        if (B.verbose && now - t_report >= 10000) {
+            fprintf(stderr,
+                    "%" PRIu64 " messages in %" PRIu64 " envelopes, %" PRIu64 " -> %" PRIu64 " bytes, %" PRIu64
+                    " dropped, %d in flight\n",
+                    B.stats.messages, B.stats.envelopes, B.stats.raw, B.stats.sent, B.stats.dropped, B.ninflight);
+            t_report = now;
+        }
+        linux_loop_run(B.loop, timeout);
+    }
+
+    return 0;
+}
@@ -0,0 +1,1239 @@
+#define MQTT_IMPL
+#include "mqtt.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+/*
+ * a small MQTT broker for the edge and for tests: one thread, epoll,
+ * QoS 0 and 1 delivery (QoS 2 publishes are accepted once and delivered
+ * at 1), retained and will messages, sessions kept in memory by client id.
+ */
+
+#define BROKER_MAX_EVENTS 256
+#define BROKER_READ_SIZE 16384
+#define BROKER_PARSE_BATCH 16
+#define BROKER_QUEUE_MAX (1 << 20)
+#define BROKER_RECEIVE_MAXIMUM 65535
+
+typedef struct broker_client_s broker_client_t;
+typedef struct broker_session_s broker_session_t;
+
+typedef struct {
+    broker_session_t *s;
+    mqtt_qos_t qos;
+    mqtt_str_t filter;
+} broker_sub_t;
+
+/* a QoS 1 delivery, queued until there is room in flight, then kept until PUBACK. */
+typedef struct broker_msg_s {
+    struct broker_msg_s *next;
+    uint16_t packet_id;
+    int retain;
+    mqtt_str_t topic;
+    mqtt_str_t message;
+} broker_msg_t;
+
+typedef struct {
+    broker_msg_t *head;
+    broker_msg_t **tail;
+    int n;
+} broker_msgs_t;
+
+/*
+ * everything that outlives a connection: subscriptions, deliveries not yet
+ * acknowledged and QoS 2 packet ids waiting for PUBREL.
+ */
+struct broker_session_s {
+    char *client_id;
+    broker_client_t *c;
+    /* seconds kept after the connection goes, UINT32_MAX forever. */
+    uint32_t expiry;
+    uint64_t gone;
+    broker_sub_t **subs;
+    int nsubs;
+    broker_msgs_t inflight;
+    broker_msgs_t queued;
+    size_t queued_bytes;
+    uint16_t receive_maximum;
+    uint16_t packet_id;
+    /* packet ids in flight towards the client and received QoS 2 ids, one bit each. */
+    uint8_t *ids_out;
+    uint8_t *qos2_in;
+    uint64_t dropped;
+    /* match stamp so overlapping subscriptions deliver once. */
+    uint64_t mark;
+    int slot;
+    broker_session_t *prev;
+    broker_session_t *next;
+};
+
+struct broker_client_s {
+    int fd;
+    int connected;
+    int closing;
+    int will_on_close;
+    int dirty;
+    int writable;
+    mqtt_parser_t parser;
+    mqtt_version_t version;
+    char *client_id;
+    broker_session_t *s;
+    uint16_t keep_alive;
+    uint64_t last;
+    struct {
+        int set;
+        int retain;
+        mqtt_qos_t qos;
+        mqtt_str_t topic;
+        mqtt_str_t message;
+    } will;
+    struct {
+        char *s;
+        size_t off;
+        size_t n;
+        size_t size;
+    } out;
+    broker_client_t *prev;
+    broker_client_t *next;
+    broker_client_t *dirty_next;
+};
+
+typedef struct {
+    mqtt_str_t topic;
+    mqtt_str_t message;
+    mqtt_qos_t qos;
+} broker_retain_t;
+
+typedef struct {
+    broker_session_t *s;
+    mqtt_qos_t qos;
+} broker_target_t;
+
+static struct {
+    int epfd;
+    int listen_fd;
+    int unix_fd;
+    size_t queue_max;
+    int verbose;
+    volatile sig_atomic_t quit;
+    broker_client_t *clients;
+    broker_session_t *sessions;
+    broker_client_t *dirty;
+    int nclosing;
+    mqtt_topic_tree_t subs;
+    broker_retain_t *retained;
+    int nretained;
+    broker_target_t *targets;
+    int ntargets;
+    int targets_size;
+    uint64_t mark;
+    uint64_t next_id;
+} B = {
+    .listen_fd = -1,
+    .unix_fd = -1,
+    .queue_max = BROKER_QUEUE_MAX,
+};
+
+static uint64_t
+_now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void
+_log(broker_client_t *c, const char *what) {
+    if (B.verbose)
+        fprintf(stderr, "[%d] %s: %s\n", c->fd, c->client_id ? c->client_id : "-", what);
+}
+
+static void
+_str_dup(mqtt_str_t *dst, const mqtt_str_t *src) {
+    dst->s = 0;
+    dst->n = 0;
+    mqtt_str_copy(dst, (mqtt_str_t *)src);
+}
+
+static void
+_mark_dirty(broker_client_t *c) {
+    if (!c->dirty) {
+        c->dirty = 1;
+        c->dirty_next = B.dirty;
+        B.dirty = c;
+    }
+}
+
+static void
+_mark_closing(broker_client_t *c, int will) {
+    if (!c->closing) {
+        c->closing = 1;
+        c->will_on_close = will;
+        B.nclosing++;
+    }
+}
+
+/* room for len more bytes in the send queue, compacting or growing it. */
+static char *
+_reserve(broker_client_t *c, size_t len) {
+    if (c->out.off > 0 && c->out.n + len > c->out.size) {
+        memmove(c->out.s, c->out.s + c->out.off, c->out.n - c->out.off);
+        c->out.n -= c->out.off;
+        c->out.off = 0;
+    }
+    if (c->out.n + len > c->out.size) {
+        size_t size;
+
+        size = c->out.size ? c->out.size : 4096;
+        while (size < c->out.n + len) {
+            size *= 2;
+        }
+        c->out.s = (char *)realloc(c->out.s, size);
+        c->out.size = size;
+    }
+    _mark_dirty(c);
+    return c->out.s + c->out.n;
+}
+
+static void
+_send(broker_client_t *c, mqtt_packet_t *pkt) {
+    ssize_t n;
+
+    n = mqtt_serialized_size(pkt);
+    if (n > 0)
+        c->out.n += mqtt_serialize_into(pkt, _reserve(c, n), n);
+    mqtt_packet_unit(pkt);
+}
+
+static void
+_send_ack(broker_client_t *c, mqtt_packet_type_t type, uint16_t packet_id) {
+    mqtt_packet_t pkt;
+
+    mqtt_packet_init(&pkt, c->version, type);
+    if (type == MQTT_PUBREL)
+        pkt.f.bits.qos = MQTT_QOS_1;
+    /* packet_id leads puback, pubrec, pubrel and pubcomp alike. */
+    pkt.v.puback.packet_id = packet_id;
+    _send(c, &pkt);
+}
+
+static void
+_write_publish(broker_client_t *c, const mqtt_str_t *topic, const mqtt_str_t *message, mqtt_qos_t qos, int retain,
+               int dup, uint16_t packet_id) {
+    mqtt_fixed_header_t f;
+    mqtt_str_t b;
+    size_t len;
+
+    len = mqtt_publish_length(c->version, qos, topic, 0, message->n);
+    f.flags = 0;
+    f.bits.type = MQTT_PUBLISH;
+    f.bits.qos = qos;
+    f.bits.retain = retain;
+    f.bits.dup = dup;
+    mqtt_str_init(&b, _reserve(c, len), 0);
+    mqtt_publish_write(&b, c->version, f, topic, packet_id, 0, message);
+    c->out.n += b.n;
+}
+
+static void
+_msgs_init(broker_msgs_t *q) {
+    q->head = 0;
+    q->tail = &q->head;
+    q->n = 0;
+}
+
+static void
+_msgs_push(broker_msgs_t *q, broker_msg_t *m) {
+    m->next = 0;
+    *q->tail = m;
+    q->tail = &m->next;
+    q->n++;
+}
+
+static broker_msg_t *
+_msgs_shift(broker_msgs_t *q) {
+    broker_msg_t *m;
+
+    m = q->head;
+    q->head = m->next;
+    if (!q->head)
+        q->tail = &q->head;
+    q->n--;
+    return m;
+}
+
+static void
+_msg_free(broker_msg_t *m) {
+    mqtt_str_free(&m->topic);
+    mqtt_str_free(&m->message);
+    free(m);
+}
+
+static int
+_bit_test(const uint8_t *bits, uint16_t id) {
+    return bits && (bits[id >> 3] & (1 << (id & 7)));
+}
+
+static void
+_bit_set(uint8_t **bits, uint16_t id, int on) {
+    if (!*bits) {
+        if (!on)
+            return;
+        *bits = (uint8_t *)calloc(1, 65536 / 8);
+    }
+    if (on)
+        (*bits)[id >> 3] |= (uint8_t)(1 << (id & 7));
+    else
+        (*bits)[id >> 3] &= (uint8_t)~(1 << (id & 7));
+}
+
+/* the next packet id not in flight, the receive maximum keeps one free. */
+static uint16_t
+_packet_id(broker_session_t *s) {
+    do {
+        if (++s->packet_id == 0)
+            s->packet_id = 1;
+    } while (_bit_test(s->ids_out, s->packet_id));
+    _bit_set(&s->ids_out, s->packet_id, 1);
+    return s->packet_id;
+}
+
+/* move queued deliveries in flight while the client has room for them. */
+static void
+_pump(broker_session_t *s) {
+    broker_client_t *c;
+
+    c = s->c;
+    if (!c || c->closing)
+        return;
+    while (s->queued.head && s->inflight.n < s->receive_maximum && c->out.n - c->out.off < B.queue_max) {
+        broker_msg_t *m;
+
+        m = _msgs_shift(&s->queued);
+        s->queued_bytes -= m->topic.n + m->message.n;
+        m->packet_id = _packet_id(s);
+        _msgs_push(&s->inflight, m);
+        _write_publish(c, &m->topic, &m->message, MQTT_QOS_1, m->retain, 0, m->packet_id);
+    }
+}
+
+static void
+_puback(broker_session_t *s, uint16_t packet_id) {
+    broker_msg_t *m, **pm;
+
+    for (pm = &s->inflight.head; (m = *pm); pm = &m->next) {
+        if (m->packet_id == packet_id)
+            break;
+    }
+    if (!m)
+        return;
+    *pm = m->next;
+    if (s->inflight.tail == &m->next)
+        s->inflight.tail = pm;
+    s->inflight.n--;
+    _bit_set(&s->ids_out, packet_id, 0);
+    _msg_free(m);
+    _pump(s);
+}
+
+/*
+ * queue one PUBLISH. QoS 0 goes straight out and is dropped when the send
+ * queue is full or nobody is connected. QoS 1 is kept by the session until
+ * acknowledged, when its queue overflows a connected subscriber is closed
+ * and an offline one loses the message.
+ */
+static void
+_deliver(broker_session_t *s, const mqtt_str_t *topic, const mqtt_str_t *message, mqtt_qos_t qos, int retain) {
+    broker_client_t *c;
+    broker_msg_t *m;
+    size_t len;
+
+    c = s->c && !s->c->closing ? s->c : 0;
+    if (qos == MQTT_QOS_0) {
+        if (!c)
+            return;
+        len = mqtt_publish_length(c->version, qos, topic, 0, message->n);
+        if (c->out.n - c->out.off + len > B.queue_max) {
+            s->dropped++;
+            return;
+        }
+        _write_publish(c, topic, message, qos, retain, 0, 0);
+        return;
+    }
+    if (s->queued_bytes + topic->n + message->n > B.queue_max) {
+        if (c) {
+            _log(c, "send queue full");
+            _mark_closing(c, 1);
+        } else {
+            s->dropped++;
+        }
+        return;
+    }
+    m = (broker_msg_t *)malloc(sizeof *m);
+    m->packet_id = 0;
+    m->retain = retain;
+    _str_dup(&m->topic, topic);
+    _str_dup(&m->message, message);
+    _msgs_push(&s->queued, m);
+    s->queued_bytes += topic->n + message->n;
+    _pump(s);
+}
+
+static void
+_collect(void *ud, void *value) {
+    broker_sub_t *sub;
+    broker_session_t *s;
+
+    (void)ud;
+    sub = (broker_sub_t *)value;
+    s = sub->s;
+    if (s->mark == B.mark) {
+        if (sub->qos > B.targets[s->slot].qos)
+            B.targets[s->slot].qos = sub->qos;
+        return;
+    }
+    s->mark = B.mark;
+    if (B.ntargets == B.targets_size) {
+        B.targets_size = B.targets_size ? B.targets_size * 2 : 64;
+        B.targets = (broker_target_t *)realloc(B.targets, B.targets_size * sizeof *B.targets);
+    }
+    s->slot = B.ntargets;
+    B.targets[B.ntargets].s = s;
+    B.targets[B.ntargets].qos = sub->qos;
+    B.ntargets++;
+}
+
+static void
+_retain(const mqtt_str_t *topic, const mqtt_str_t *message, mqtt_qos_t qos) {
+    broker_retain_t *r;
+    int i;
+
+    for (i = 0; i < B.nretained; i++) {
+        if (mqtt_str_equal(&B.retained[i].topic, (mqtt_str_t *)topic))
+            break;
+    }
+    if (i < B.nretained) {
+        r = &B.retained[i];
+        mqtt_str_free(&r->message);
+        if (mqtt_str_empty(message)) {
+            mqtt_str_free(&r->topic);
+            B.retained[i] = B.retained[--B.nretained];
+            return;
+        }
+    } else {
+        if (mqtt_str_empty(message))
+            return;
+        B.retained = (broker_retain_t *)realloc(B.retained, (B.nretained + 1) * sizeof *B.retained);
+        r = &B.retained[B.nretained++];
+        _str_dup(&r->topic, topic);
+    }
+    _str_dup(&r->message, message);
+    r->qos = qos > MQTT_QOS_1 ? MQTT_QOS_1 : qos;
+}
+
+static void
+_route(const mqtt_str_t *topic, const mqtt_str_t *message, mqtt_qos_t qos, int retain) {
+    int i;
+
+    if (qos > MQTT_QOS_1)
+        qos = MQTT_QOS_1;
+    if (retain)
+        _retain(topic, message, qos);
+    B.mark++;
+    B.ntargets = 0;
+    mqtt_topic_tree_match(&B.subs, topic, _collect, 0);
+    for (i = 0; i < B.ntargets; i++) {
+        broker_target_t *t = &B.targets[i];
+
+        _deliver(t->s, topic, message, t->qos < qos ? t->qos : qos, 0);
+    }
+}
+
+static broker_session_t *
+_session_find(const char *client_id) {
+    broker_session_t *s;
+
+    for (s = B.sessions; s; s = s->next) {
+        if (!strcmp(s->client_id, client_id))
+            return s;
+    }
+    return 0;
+}
+
+static broker_session_t *
+_session_new(const char *client_id) {
+    broker_session_t *s;
+
+    s = (broker_session_t *)calloc(1, sizeof *s);
+    s->client_id = strdup(client_id);
+    _msgs_init(&s->inflight);
+    _msgs_init(&s->queued);
+    s->next = B.sessions;
+    if (B.sessions)
+        B.sessions->prev = s;
+    B.sessions = s;
+    return s;
+}
+
+static void
+_session_free(broker_session_t *s) {
+    int i;
+
+    if (s->c)
+        s->c->s = 0;
+    for (i = 0; i < s->nsubs; i++) {
+        broker_sub_t *sub = s->subs[i];
+
+        mqtt_topic_tree_remove(&B.subs, &sub->filter, sub);
+        mqtt_str_free(&sub->filter);
+        free(sub);
+    }
+    free(s->subs);
+    while (s->inflight.head) {
+        _msg_free(_msgs_shift(&s->inflight));
+    }
+    while (s->queued.head) {
+        _msg_free(_msgs_shift(&s->queued));
+    }
+    free(s->ids_out);
+    free(s->qos2_in);
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        B.sessions = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+    free(s->client_id);
+    free(s);
+}
+
+/* the connection is gone, a session without expiry goes with it. */
+static void
+_session_detach(broker_client_t *c) {
+    broker_session_t *s;
+
+    s = c->s;
+    if (!s)
+        return;
+    c->s = 0;
+    s->c = 0;
+    if (s->expiry == 0) {
+        _session_free(s);
+        return;
+    }
+    s->gone = _now();
+}
+
+static void
+_will_free(broker_client_t *c) {
+    mqtt_str_free(&c->will.topic);
+    mqtt_str_free(&c->will.message);
+    c->will.set = 0;
+}
+
+static void
+_client_free(broker_client_t *c) {
+    if (c->dirty) {
+        broker_client_t **p;
+
+        for (p = &B.dirty; *p != c; p = &(*p)->dirty_next)
+            ;
+        *p = c->dirty_next;
+    }
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        B.clients = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+    _session_detach(c);
+    _will_free(c);
+    mqtt_parser_unit(&c->parser);
+    free(c->client_id);
+    free(c->out.s);
+    free(c);
+}
+
+/* the socket is gone by now, publish the will before the subscriptions go too. */
+static void
+_client_close(broker_client_t *c) {
+    _log(c, c->will_on_close ? "closed" : "disconnected");
+    epoll_ctl(B.epfd, EPOLL_CTL_DEL, c->fd, 0);
+    close(c->fd);
+    c->connected = 0;
+    _session_detach(c);
+    if (c->will.set && c->will_on_close)
+        _route(&c->will.topic, &c->will.message, c->will.qos, c->will.retain);
+    _client_free(c);
+}
+
+static void
+_connack(broker_client_t *c, int code, int session_present, const char *assigned) {
+    mqtt_packet_t pkt;
+
+    mqtt_packet_init(&pkt, c->version, MQTT_CONNACK);
+    switch (c->version) {
+    case MQTT_VERSION_3:
+        pkt.v.connack.v3.return_code = (mqtt_crc_t)code;
+        break;
+    case MQTT_VERSION_4:
+        pkt.v.connack.v4.acknowledge_flags.bits.session_present = session_present;
+        pkt.v.connack.v4.return_code = (mqtt_crc_t)code;
+        break;
+    case MQTT_VERSION_5:
+        pkt.v.connack.v5.acknowledge_flags.bits.session_present = session_present;
+        pkt.v.connack.v5.reason_code = (mqtt_rc_t)code;
+        if (code == MQTT_RC_SUCCESS) {
+            uint8_t maximum_qos = MQTT_QOS_1, no = 0;
+
+            mqtt_properties_add(&pkt.v.connack.v5.properties, MQTT_PROPERTY_MAXIMUM_QOS, &maximum_qos, 0);
+            mqtt_properties_add(&pkt.v.connack.v5.properties, MQTT_PROPERTY_SHARED_SUBSCRIPTION_AVAILABLE, &no, 0);
+            mqtt_properties_add(&pkt.v.connack.v5.properties, MQTT_PROPERTY_SUBSCRIPTION_IDENTIFIERS_AVAILABLE, &no,
+                                0);
+            if (assigned)
+                mqtt_properties_add(&pkt.v.connack.v5.properties, MQTT_PROPERTY_ASSIGNED_CLIENT_IDENTIFER, assigned,
+                                    0);
+        }
+        break;
+    }
+    _send(c, &pkt);
+}
+
+static int
+_handle_connect(broker_client_t *c, mqtt_packet_t *pkt) {
+    mqtt_v_connect_t *v;
+    mqtt_p_connect_t *p;
+    mqtt_property_t *property;
+    broker_client_t *old;
+    broker_session_t *s;
+    char assigned[32];
+    uint32_t expiry;
+    uint16_t receive_maximum;
+    int clean, session_present;
+
+    v = &pkt->v.connect;
+    p = &pkt->p.connect;
+    if (c->connected)
+        return -1;
+    if (!MQTT_IS_VERSION(v->protocol_version)) {
+        c->version = MQTT_VERSION_4;
+        _connack(c, MQTT_CRC_REFUSED_PROTOCOL_VERSION, 0, 0);
+        _mark_closing(c, 0);
+        return 0;
+    }
+    c->version = v->protocol_version;
+    if (mqtt_str_empty(&p->client_id)) {
+        if (c->version != MQTT_VERSION_5 && !v->connect_flags.bits.clean_session) {
+            _connack(c, MQTT_CRC_REFUSED_IDENTIFIER_REJECTED, 0, 0);
+            _mark_closing(c, 0);
+            return 0;
+        }
+        snprintf(assigned, sizeof(assigned), "mqtt_broker-%" PRIu64, ++B.next_id);
+        c->client_id = strdup(assigned);
+    } else {
+        c->client_id = (char *)malloc(p->client_id.n + 1);
+        memcpy(c->client_id, p->client_id.s, p->client_id.n);
+        c->client_id[p->client_id.n] = 0;
+    }
+
+    /* v3 and v4 keep a session that is not clean forever, v5 says how long. */
+    clean = v->connect_flags.bits.clean_session;
+    expiry = clean ? 0 : UINT32_MAX;
+    receive_maximum = BROKER_RECEIVE_MAXIMUM;
+    if (c->version == MQTT_VERSION_5) {
+        property = mqtt_properties_find(&v->v5.properties, MQTT_PROPERTY_SESSION_EXPIRY_INTERVAL);
+        expiry = property ? property->b4 : 0;
+        property = mqtt_properties_find(&v->v5.properties, MQTT_PROPERTY_RECEIVE_MAXIMUM);
+        if (property && property->b2)
+            receive_maximum = property->b2;
+    }
+
+    /* a second connection with the same id takes over, the old one looks like it dropped. */
+    for (old = B.clients; old; old = old->next) {
+        if (old != c && old->connected && !old->closing && !strcmp(old->client_id, c->client_id)) {
+            if (old->version == MQTT_VERSION_5) {
+                mqtt_packet_t disconnect;
+
+                mqtt_packet_init(&disconnect, old->version, MQTT_DISCONNECT);
+                disconnect.v.disconnect.v5.reason_code = MQTT_RC_SESSION_TAKEN_OVER;
+                _send(old, &disconnect);
+            }
+            _log(old, "taken over");
+            _mark_closing(old, 1);
+        }
+    }
+    s = _session_find(c->client_id);
+    if (s && s->c) {
+        s->c->s = 0;
+        s->c = 0;
+    }
+    if (s && clean) {
+        _session_free(s);
+        s = 0;
+    }
+    session_present = s != 0;
+    if (!s)
+        s = _session_new(c->client_id);
+    s->c = c;
+    s->expiry = expiry;
+    s->receive_maximum = receive_maximum;
+    c->s = s;
+
+    c->keep_alive = v->keep_alive;
+    if (v->connect_flags.bits.will_flag) {
+        c->will.set = 1;
+        c->will.retain = v->connect_flags.bits.will_retain;
+        c->will.qos = (mqtt_qos_t)v->connect_flags.bits.will_qos;
+        _str_dup(&c->will.topic, &p->will_topic);
+        _str_dup(&c->will.message, &p->will_message);
+    }
+    c->connected = 1;
+    _connack(c, MQTT_CRC_ACCEPTED, session_present, mqtt_str_empty(&p->client_id) ? c->client_id : 0);
+    _log(c, session_present ? "resumed" : "connected");
+
+    /* whatever was in flight when the last connection went is sent again. */
+    if (session_present) {
+        broker_msg_t *m;
+
+        for (m = s->inflight.head; m; m = m->next) {
+            _write_publish(c, &m->topic, &m->message, MQTT_QOS_1, m->retain, 1, m->packet_id);
+        }
+        _pump(s);
+    }
+    return 0;
+}
+
+static int
+_handle_publish(broker_client_t *c, mqtt_packet_t *pkt) {
+    mqtt_qos_t qos;
+
+    qos = (mqtt_qos_t)pkt->f.bits.qos;
+    if (mqtt_str_empty(&pkt->v.publish.topic_name) || mqtt_topic_wildcard(&pkt->v.publish.topic_name))
+        return -1;
+    if (qos == MQTT_QOS_2) {
+        /* routed once, a resend before PUBREL only gets its PUBREC again. */
+        if (!_bit_test(c->s->qos2_in, pkt->v.publish.packet_id)) {
+            _bit_set(&c->s->qos2_in, pkt->v.publish.packet_id, 1);
+            _route(&pkt->v.publish.topic_name, &pkt->p.publish.message, qos, pkt->f.bits.retain);
+        }
+        _send_ack(c, MQTT_PUBREC, pkt->v.publish.packet_id);
+        return 0;
+    }
+    _route(&pkt->v.publish.topic_name, &pkt->p.publish.message, qos, pkt->f.bits.retain);
+    if (qos == MQTT_QOS_1)
+        _send_ack(c, MQTT_PUBACK, pkt->v.publish.packet_id);
+    return 0;
+}
+
+static int
+_handle_subscribe(broker_client_t *c, mqtt_packet_t *pkt) {
+    mqtt_packet_t ack;
+    broker_session_t *s;
+    int i, j;
+
+    s = c->s;
+    mqtt_packet_init(&ack, c->version, MQTT_SUBACK);
+    ack.v.suback.packet_id = pkt->v.subscribe.packet_id;
+    mqtt_suback_generate(&ack, pkt->p.subscribe.n);
+    for (i = 0; i < pkt->p.subscribe.n; i++) {
+        mqtt_str_t *filter;
+        mqtt_qos_t qos;
+        broker_sub_t *sub;
+        int ok;
+
+        filter = &pkt->p.subscribe.topic_filters[i];
+        qos = (mqtt_qos_t)pkt->p.subscribe.options[i].bits.qos;
+        if (qos > MQTT_QOS_1)
+            qos = MQTT_QOS_1;
+        ok = mqtt_topic_filter_valid(filter);
+        if (ok) {
+            /* resubscribing to the same filter replaces the old subscription. */
+            sub = 0;
+            for (j = 0; j < s->nsubs; j++) {
+                if (mqtt_str_equal(&s->subs[j]->filter, filter)) {
+                    sub = s->subs[j];
+                    break;
+                }
+            }
+            if (!sub) {
+                sub = (broker_sub_t *)malloc(sizeof *sub);
+                sub->s = s;
+                _str_dup(&sub->filter, filter);
+                mqtt_topic_tree_insert(&B.subs, &sub->filter, sub);
+                s->subs = (broker_sub_t **)realloc(s->subs, (s->nsubs + 1) * sizeof *s->subs);
+                s->subs[s->nsubs++] = sub;
+            }
+            sub->qos = qos;
+        }
+        switch (c->version) {
+        case MQTT_VERSION_3:
+            ack.p.suback.v3.granted[i].flags = ok ? (uint8_t)qos : 0x80;
+            break;
+        case MQTT_VERSION_4:
+            ack.p.suback.v4.return_codes[i] = ok ? mqtt_src_from_qos(qos) : MQTT_SRC_QOS_F;
+            break;
+        case MQTT_VERSION_5:
+            ack.p.suback.v5.reason_codes[i] = ok ? mqtt_rc_from_qos(qos) : MQTT_RC_TOPIC_FILTER_INVALID;
+            break;
+        }
+    }
+    _send(c, &ack);
+
+    /* retained messages follow the SUBACK. */
+    for (i = 0; i < pkt->p.subscribe.n; i++) {
+        mqtt_topic_filter_t filter;
+        mqtt_qos_t qos;
+
+        if (!B.nretained)
+            break;
+        if (c->version == MQTT_VERSION_5 && pkt->p.subscribe.options[i].bits.retain_handling == 2)
+            continue;
+        if (mqtt_topic_filter_compile(&filter, &pkt->p.subscribe.topic_filters[i]))
+            continue;
+        qos = (mqtt_qos_t)pkt->p.subscribe.options[i].bits.qos;
+        if (qos > MQTT_QOS_1)
+            qos = MQTT_QOS_1;
+        for (j = 0; j < B.nretained; j++) {
+            broker_retain_t *r = &B.retained[j];
+
+            if (mqtt_topic_filter_match(&filter, &r->topic))
+                _deliver(s, &r->topic, &r->message, r->qos < qos ? r->qos : qos, 1);
+        }
+        mqtt_topic_filter_unit(&filter);
+    }
+    return 0;
+}
+
+static int
+_handle_unsubscribe(broker_client_t *c, mqtt_packet_t *pkt) {
+    mqtt_packet_t ack;
+    broker_session_t *s;
+    int i, j;
+
+    s = c->s;
+    mqtt_packet_init(&ack, c->version, MQTT_UNSUBACK);
+    ack.v.unsuback.packet_id = pkt->v.unsubscribe.packet_id;
+    mqtt_unsuback_generate(&ack, pkt->p.unsubscribe.n);
+    for (i = 0; i < pkt->p.unsubscribe.n; i++) {
+        mqtt_rc_t rc;
+
+        rc = MQTT_RC_NO_SUBSCRIPTION_EXISTED;
+        for (j = 0; j < s->nsubs; j++) {
+            broker_sub_t *sub = s->subs[j];
+
+            if (mqtt_str_equal(&sub->filter, &pkt->p.unsubscribe.topic_filters[i])) {
+                mqtt_topic_tree_remove(&B.subs, &sub->filter, sub);
+                mqtt_str_free(&sub->filter);
+                free(sub);
+                s->subs[j] = s->subs[--s->nsubs];
+                rc = MQTT_RC_SUCCESS;
+                break;
+            }
+        }
+        if (c->version == MQTT_VERSION_5)
+            ack.p.unsuback.v5.reason_codes[i] = rc;
+    }
+    _send(c, &ack);
+    return 0;
+}
+
+static int
+_handle(broker_client_t *c, mqtt_packet_t *pkt) {
+    mqtt_packet_t resp;
+
+    if (!c->connected && pkt->f.bits.type != MQTT_CONNECT)
+        return -1;
+    switch (pkt->f.bits.type) {
+    case MQTT_CONNECT:
+        return _handle_connect(c, pkt);
+    case MQTT_PUBLISH:
+        return _handle_publish(c, pkt);
+    case MQTT_PUBREL:
+        _bit_set(&c->s->qos2_in, pkt->v.pubrel.packet_id, 0);
+        _send_ack(c, MQTT_PUBCOMP, pkt->v.pubrel.packet_id);
+        return 0;
+    case MQTT_PUBACK:
+        _puback(c->s, pkt->v.puback.packet_id);
+        return 0;
+    case MQTT_PUBCOMP:
+        return 0;
+    case MQTT_PUBREC:
+        /* only for QoS 2 deliveries, which this broker never makes. */
+        _send_ack(c, MQTT_PUBREL, pkt->v.pubrec.packet_id);
+        return 0;
+    case MQTT_SUBSCRIBE:
+        return _handle_subscribe(c, pkt);
+    case MQTT_UNSUBSCRIBE:
+        return _handle_unsubscribe(c, pkt);
+    case MQTT_PINGREQ:
+        mqtt_packet_init(&resp, c->version, MQTT_PINGRESP);
+        _send(c, &resp);
+        return 0;
+    case MQTT_DISCONNECT:
+        if (c->version == MQTT_VERSION_5) {
+            mqtt_property_t *property;
+
+            property = mqtt_properties_find(&pkt->v.disconnect.v5.properties, MQTT_PROPERTY_SESSION_EXPIRY_INTERVAL);
+            if (property)
+                c->s->expiry = property->b4;
+        }
+        _mark_closing(c, c->version == MQTT_VERSION_5 &&
+                             pkt->v.disconnect.v5.reason_code == MQTT_RC_DISCONNECT_WITH_WILL_MESSAGE);
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+static void
+_on_read(broker_client_t *c) {
+    char buff[BROKER_READ_SIZE];
+    mqtt_str_t b;
+    ssize_t n;
+
+    n = read(c->fd, buff, sizeof buff);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+        _mark_closing(c, 1);
+        return;
+    }
+    if (n < 0)
+        return;
+    c->last = _now();
+    mqtt_str_init(&b, buff, (size_t)n);
+    while (!c->closing) {
+        mqtt_packet_t pkts[BROKER_PARSE_BATCH];
+        int rc, i;
+
+        rc = mqtt_parse_batch(&c->parser, &b, pkts, BROKER_PARSE_BATCH);
+        if (rc < 0) {
+            _log(c, "malformed packet");
+            _mark_closing(c, 1);
+            break;
+        }
+        if (rc == 0)
+            break;
+        for (i = 0; i < rc; i++) {
+            if (!c->closing && _handle(c, &pkts[i])) {
+                _log(c, "protocol error");
+                _mark_closing(c, 1);
+            }
+            mqtt_packet_unit(&pkts[i]);
+        }
+    }
+}
+
+static void
+_flush(broker_client_t *c) {
+    struct epoll_event ev;
+    int writable;
+
+    while (c->out.off < c->out.n) {
+        ssize_t n;
+
+        n = write(c->fd, c->out.s + c->out.off, c->out.n - c->out.off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                _mark_closing(c, 1);
+            break;
+        }
+        c->out.off += (size_t)n;
+    }
+    if (c->out.off == c->out.n)
+        c->out.off = c->out.n = 0;
+
+    /* only wait for EPOLLOUT while something is left over. */
+    writable = c->out.n > 0;
+    if (writable != c->writable) {
+        ev.events = EPOLLIN | (writable ? EPOLLOUT : 0);
+        ev.data.ptr = c;
+        epoll_ctl(B.epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->writable = writable;
+    }
+}
+
+static void
+_accept(int listen_fd, int tcp) {
+    while (1) {
+        struct epoll_event ev;
+        broker_client_t *c;
+        int fd;
+
+        fd = accept(listen_fd, 0, 0);
+        if (fd < 0)
+            return;
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        if (tcp) {
+            int on = 1;
+
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+        }
+        c = (broker_client_t *)calloc(1, sizeof *c);
+        c->fd = fd;
+        c->last = _now();
+        mqtt_parser_init(&c->parser);
+        mqtt_parser_zero_copy(&c->parser, 1);
+        mqtt_parser_strict(&c->parser, 1);
+        c->next = B.clients;
+        if (B.clients)
+            B.clients->prev = c;
+        B.clients = c;
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        epoll_ctl(B.epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+/*
+ * clients that have not been heard from for one and a half keep alive
+ * periods are gone, so are sessions left alone past their expiry.
+ */
+static void
+_check_keep_alive(uint64_t now) {
+    broker_client_t *c;
+    broker_session_t *s, *next;
+
+    for (c = B.clients; c; c = c->next) {
+        uint64_t limit;
+
+        limit = c->connected ? (uint64_t)c->keep_alive * 1500 : 10000;
+        if (limit && now - c->last > limit) {
+            _log(c, "keep alive timeout");
+            _mark_closing(c, 1);
+        }
+    }
+    for (s = B.sessions; s; s = next) {
+        next = s->next;
+        if (!s->c && s->expiry != UINT32_MAX && now - s->gone >= (uint64_t)s->expiry * 1000)
+            _session_free(s);
+    }
+}
+
+static void
+_sweep() {
+    broker_client_t *c, *next;
+
+    while (B.nclosing > 0) {
+        B.nclosing = 0;
+        for (c = B.clients; c; c = next) {
+            next = c->next;
+            if (c->closing) {
+                if (c->dirty)
+                    _flush(c);
+                _client_close(c);
+            }
+        }
+        /* a will may have overflowed another queue, go around again. */
+    }
+}
+
+static int
+_listen_tcp(const char *bind_addr, int port) {
+    struct sockaddr_in addr;
+    int fd, on = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, bind_addr, &addr.sin_addr) != 1 || bind(fd, (struct sockaddr *)&addr, sizeof addr) ||
+        listen(fd, SOMAXCONN)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int
+_listen_unix(const char *path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof addr) || listen(fd, SOMAXCONN)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void
+_on_signal(int sig) {
+    (void)sig;
+    B.quit = 1;
+}
+
+static void
+_usage(const char *name) {
+    printf("usage: %s [-b address] [-p port] [-u path] [-q bytes] [-v]\n", name);
+    printf("  -p tcp port, 0 disables tcp, default %d\n", MQTT_TCP_PORT);
+    printf("  -u also listen on a unix socket\n");
+    printf("  -q send queue limit per client, default %d\n", BROKER_QUEUE_MAX);
+}
+
+int
+main(int argc, char *argv[]) {
+    struct epoll_event events[BROKER_MAX_EVENTS], ev;
+    const char *bind_addr, *unix_path;
+    uint64_t last_check;
+    int port, opt, i;
+
+    bind_addr = "0.0.0.0";
+    unix_path = 0;
+    port = MQTT_TCP_PORT;
+    while ((opt = getopt(argc, argv, "b:p:u:q:v")) != -1) {
+        switch (opt) {
+        case 'b':
+            bind_addr = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'u':
+            unix_path = optarg;
+            break;
+        case 'q':
+            B.queue_max = strtoul(optarg, 0, 10);
+            break;
+        case 'v':
+            B.verbose = 1;
+            break;
+        default:
+            _usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if ((!port && !unix_path) || B.queue_max == 0) {
+        _usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, _on_signal);
+    signal(SIGTERM, _on_signal);
+
+    B.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (port) {
+        B.listen_fd = _listen_tcp(bind_addr, port);
+        if (B.listen_fd < 0) {
+            fprintf(stderr, "listen(): %s:%d: %s\n", bind_addr, port, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = &B.listen_fd;
+        epoll_ctl(B.epfd, EPOLL_CTL_ADD, B.listen_fd, &ev);
+    }
+    if (unix_path) {
+        B.unix_fd = _listen_unix(unix_path);
+        if (B.unix_fd < 0) {
+            fprintf(stderr, "listen(): %s: %s\n", unix_path, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = &B.unix_fd;
+        epoll_ctl(B.epfd, EPOLL_CTL_ADD, B.unix_fd, &ev);
+    }
+    mqtt_topic_tree_init(&B.subs);
+
+    last_check = _now();
+    while (!B.quit) {
+        uint64_t now;
+        int n;
+
+        n = epoll_wait(B.epfd, events, BROKER_MAX_EVENTS, 1000);
+        if (n < 0 && errno != EINTR)
+            break;
+        for (i = 0; i < n; i++) {
+            broker_client_t *c;
+
+            if (events[i].data.ptr == &B.listen_fd) {
+                _accept(B.listen_fd, 1);
+                continue;
+            }
+            if (events[i].data.ptr == &B.unix_fd) {
+                _accept(B.unix_fd, 0);
+                continue;
+            }
+            c = (broker_client_t *)events[i].data.ptr;
+            if (c->closing)
+                continue;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                _on_read(c);
+            if (!c->closing && (events[i].events & EPOLLOUT))
+                _mark_dirty(c);
+        }
+        now = _now();
+        if (now - last_check >= 1000) {
+            _check_keep_alive(now);
+            last_check = now;
+        }
+        _sweep();
+
+        /* everything queued in this round goes out with one write per client. */
+        while (B.dirty) {
+            broker_client_t *c = B.dirty;
+
+            B.dirty = c->dirty_next;
+            c->dirty = 0;
+            _flush(c);
+            if (c->s && !c->closing)
+                _pump(c->s);
+        }
+        _sweep();
+    }
+
+    while (B.clients) {
+        broker_client_t *c = B.clients;
+
+        close(c->fd);
+        _client_free(c);
+    }
+    while (B.sessions) {
+        _session_free(B.sessions);
+    }
+    for (i = 0; i < B.nretained; i++) {
+        mqtt_str_free(&B.retained[i].topic);
+        mqtt_str_free(&B.retained[i].message);
+    }
+    free(B.retained);
+    free(B.targets);
+    mqtt_topic_tree_unit(&B.subs, 0);
+    if (B.listen_fd >= 0)
+        close(B.listen_fd);
+    if (B.unix_fd >= 0) {
+        close(B.unix_fd);
+        unlink(unix_path);
+    }
+    close(B.epfd);
+    return 0;
+}
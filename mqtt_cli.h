@@ -28,6 +28,8 @@
 #define MQTT_CLI_DEFAULT_KEEPALIVE 30
 #define MQTT_CLI_PACKET_TIMEOUT 5
 #define MQTT_CLI_PACKET_TTL 3
+#define MQTT_CLI_TOPIC_ALIAS_MAX 64
+#define MQTT_CLI_PARSE_BATCH 16
 
 #include "mqtt.h"
 
@@ -46,6 +48,15 @@ typedef struct {
         const char *password;
     } auth;
 
+    /*
+     * optional file keeping unacknowledged qos 1/2 packets across restarts,
+     * a qos 1/2 publish that cannot be synced to it returns -1 with errno set.
+     */
+    const char *session_file;
+
+    /* qos 1/2 PUBLISH is acknowledged by mqtt_cli_puback instead of on delivery. */
+    uint8_t manual_ack;
+
     struct {
         uint8_t retain;
         const char *topic;
@@ -53,6 +64,14 @@ typedef struct {
         mqtt_str_t message;
     } lwt;
 
+    /* mqttv5.0 only, zero means not sent in CONNECT. */
+    struct {
+        uint32_t session_expiry_interval;
+        uint16_t receive_maximum;
+        uint32_t maximum_packet_size;
+        uint16_t topic_alias_maximum;
+    } v5;
+
     struct {
         mqtt_cli_callback_pt connack;
         mqtt_cli_callback_pt suback;
@@ -71,15 +90,152 @@ void mqtt_cli_destroy(mqtt_cli_t *m);
 int mqtt_cli_connect(mqtt_cli_t *m);
 int mqtt_cli_publish(mqtt_cli_t *m, int retain, const char *topic, mqtt_qos_t qos, mqtt_str_t *message,
                      uint16_t *packet_id);
+
+/**
+ * publish through a template built for the version of m, the topic is
+ * always sent in full, topic aliases are left to mqtt_cli_publish.
+ */
+int mqtt_cli_publish_template(mqtt_cli_t *m, const mqtt_publish_template_t *tpl, mqtt_str_t *message,
+                              uint16_t *packet_id);
 int mqtt_cli_subscribe(mqtt_cli_t *m, int count, const char *topic[], mqtt_qos_t qos[], uint16_t *packet_id);
+
+/**
+ * acknowledge a received PUBLISH with manual_ack, qos and packet_id as it
+ * came in. a qos 2 resend arriving before the ack is delivered again.
+ */
+int mqtt_cli_puback(mqtt_cli_t *m, mqtt_qos_t qos, uint16_t packet_id);
 int mqtt_cli_unsubscribe(mqtt_cli_t *m, int count, const char *topic[], uint16_t *packet_id);
 int mqtt_cli_pingreq(mqtt_cli_t *m);
 int mqtt_cli_disconnect(mqtt_cli_t *m);
 
+/**
+ * outgoing points into a transmit buffer owned by m, it stays valid until
+ * the next mqtt_cli_outgoing call and must not be freed by the caller.
+ */
 int mqtt_cli_outgoing(mqtt_cli_t *m, mqtt_str_t *outgoing);
 int mqtt_cli_incoming(mqtt_cli_t *m, mqtt_str_t *incoming);
 int mqtt_cli_elapsed(mqtt_cli_t *m, uint64_t time);
 
+/**
+ * milliseconds until the next retransmission or keepalive deadline,
+ * UINT64_MAX when nothing is scheduled.
+ */
+uint64_t mqtt_cli_next_deadline(mqtt_cli_t *m);
+
+/**
+ * non-zero once the server accepted the current connection.
+ */
+int mqtt_cli_connected(mqtt_cli_t *m);
+
+/**
+ * largest packet the server accepts on the current connection, 0 when it
+ * set no limit.
+ */
+uint32_t mqtt_cli_maximum_packet_size(mqtt_cli_t *m);
+
+/*
+ * requests posted from any thread. they queue lock-free and are carried
+ * out by the thread driving mqtt_cli_outgoing, which also runs done.
+ * status is the reason code of the ack, 0 on success, or -1 when the
+ * request could not be sent or was dropped.
+ */
+typedef void (*mqtt_cli_done_pt)(mqtt_cli_t *m, void *ud, uint16_t packet_id, int status);
+
+/* called on the posting thread when the driving thread should run. */
+typedef void (*mqtt_cli_wakeup_pt)(void *ud);
+
+int mqtt_cli_post_publish(mqtt_cli_t *m, int retain, const char *topic, mqtt_qos_t qos, const mqtt_str_t *message,
+                          mqtt_cli_done_pt done, void *ud);
+int mqtt_cli_post_subscribe(mqtt_cli_t *m, int count, const char *topic[], mqtt_qos_t qos[], mqtt_cli_done_pt done,
+                            void *ud);
+int mqtt_cli_post_unsubscribe(mqtt_cli_t *m, int count, const char *topic[], mqtt_cli_done_pt done, void *ud);
+
+/**
+ * mqtt_cli_puback from another thread, for manual_ack clients that hand
+ * messages off before they are done with them.
+ */
+int mqtt_cli_post_puback(mqtt_cli_t *m, mqtt_qos_t qos, uint16_t packet_id, mqtt_cli_done_pt done, void *ud);
+
+/**
+ * wakeup is 0 to clear, a cleared hook must not be in use by a posting thread.
+ */
+void mqtt_cli_set_wakeup(mqtt_cli_t *m, mqtt_cli_wakeup_pt wakeup, void *ud);
+
+/**
+ * call handler for PUBLISH packets whose topic name matches filter, + and #
+ * included. cb.publish gets the packets no handler matched. neither may be
+ * called from inside a handler.
+ */
+int mqtt_cli_on(mqtt_cli_t *m, const char *filter, mqtt_cli_callback_pt handler, void *ud);
+int mqtt_cli_off(mqtt_cli_t *m, const char *filter, mqtt_cli_callback_pt handler, void *ud);
+
+/* connection state machine, the driver performs i/o and reports events. */
+typedef enum {
+    MQTT_CLI_STATE_DISCONNECTED,
+    MQTT_CLI_STATE_RESOLVING,
+    MQTT_CLI_STATE_CONNECTING,
+    MQTT_CLI_STATE_CONNACK,
+    MQTT_CLI_STATE_CONNECTED,
+    MQTT_CLI_STATE_DRAINING,
+} mqtt_cli_state_t;
+
+static const char *MQTT_CLI_STATE_NAMES[] = {
+    [MQTT_CLI_STATE_DISCONNECTED] = "DISCONNECTED",
+    [MQTT_CLI_STATE_RESOLVING]    = "RESOLVING",
+    [MQTT_CLI_STATE_CONNECTING]   = "CONNECTING",
+    [MQTT_CLI_STATE_CONNACK]      = "CONNACK",
+    [MQTT_CLI_STATE_CONNECTED]    = "CONNECTED",
+    [MQTT_CLI_STATE_DRAINING]     = "DRAINING",
+};
+
+static inline const char *
+mqtt_cli_state_name(mqtt_cli_state_t state) {
+    return MQTT_CLI_STATE_NAMES[state];
+}
+
+typedef enum {
+    MQTT_CLI_EVENT_RESOLVED,
+    MQTT_CLI_EVENT_CONNECTED,
+    MQTT_CLI_EVENT_FAILED,
+    MQTT_CLI_EVENT_STOP,
+} mqtt_cli_event_t;
+
+typedef struct mqtt_cli_conn_s mqtt_cli_conn_t;
+
+/* spent is the time in milliseconds the connection stayed in from. */
+typedef void (*mqtt_cli_state_pt)(mqtt_cli_conn_t *c, void *ud, mqtt_cli_state_t from, mqtt_cli_state_t to,
+                                  uint64_t spent);
+
+typedef struct {
+    /* decorrelated jitter backoff bounds in milliseconds. */
+    uint64_t backoff_base;
+    uint64_t backoff_cap;
+    /* per state limits for resolving/connecting, CONNACK and draining. */
+    uint64_t connect_timeout;
+    uint64_t connack_timeout;
+    uint64_t drain_timeout;
+    uint64_t seed;
+    mqtt_cli_state_pt state;
+    void *ud;
+} mqtt_cli_conn_conf_t;
+
+struct mqtt_cli_conn_s {
+    mqtt_cli_t *m;
+    mqtt_cli_conn_conf_t conf;
+    mqtt_cli_state_t state;
+    int stopped;
+    uint64_t now;
+    uint64_t t_state;
+    uint64_t sleep;
+    uint64_t wakeup;
+    uint64_t rng;
+};
+
+void mqtt_cli_conn_init(mqtt_cli_conn_t *c, mqtt_cli_t *m, const mqtt_cli_conn_conf_t *conf);
+int mqtt_cli_conn_event(mqtt_cli_conn_t *c, mqtt_cli_event_t event);
+int mqtt_cli_conn_elapsed(mqtt_cli_conn_t *c, uint64_t time);
+uint64_t mqtt_cli_conn_next_deadline(mqtt_cli_conn_t *c);
+
 #endif /* _MQTT_CLI_H_ */
 
 #ifdef MQTT_CLI_IMPL
@@ -87,16 +243,77 @@ int mqtt_cli_elapsed(mqtt_cli_t *m, uint64_t time);
 #define MQTT_IMPL
 #include "mqtt.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <unistd.h>
+
+/* timer wheel, 1 ms ticks, 4 levels of 64 slots cover about 4.6 hours. */
+#define MQTT_CLI_WHEEL_BITS 6
+#define MQTT_CLI_WHEEL_SIZE (1 << MQTT_CLI_WHEEL_BITS)
+#define MQTT_CLI_WHEEL_MASK (MQTT_CLI_WHEEL_SIZE - 1)
+#define MQTT_CLI_WHEEL_LEVELS 4
+
+/* exact topic names remembered with their handlers, a power of 2. */
+#define MQTT_CLI_ROUTE_CACHE 4096
+
+typedef struct mqtt_cli_timer_s {
+    uint64_t expire;
+    struct mqtt_cli_timer_s *prev;
+    struct mqtt_cli_timer_s *next;
+} mqtt_cli_timer_t;
+
 typedef struct mqtt_cli_packet_s {
+    mqtt_cli_timer_t timer;
     uint64_t t_send;
     int ttl;
     int wait_ack;
+    int quota;
+    int held;
+    uint16_t alias;
     mqtt_str_t b;
     mqtt_packet_type_t type;
     uint16_t packet_id;
     struct mqtt_cli_packet_s *next;
 } mqtt_cli_packet_t;
 
+/* a posted request, topics and message are copied behind the struct. */
+typedef struct mqtt_cli_cmd_s {
+    _Atomic(struct mqtt_cli_cmd_s *) next;
+    mqtt_packet_type_t type;
+    int retain;
+    int count;
+    const char **topic;
+    mqtt_qos_t *qos;
+    mqtt_str_t message;
+    /* the PUBLISH a posted PUBACK acknowledges. */
+    uint16_t packet_id;
+    mqtt_cli_done_pt done;
+    void *ud;
+} mqtt_cli_cmd_t;
+
+typedef struct {
+    mqtt_cli_callback_pt handler;
+    void *ud;
+} mqtt_cli_handler_t;
+
+typedef struct {
+    uint32_t hash;
+    mqtt_str_t topic;
+    mqtt_cli_handler_t **handlers;
+    int n;
+} mqtt_cli_route_t;
+
+/* a sent request waiting for its ack. */
+typedef struct mqtt_cli_done_s {
+    mqtt_packet_type_t type;
+    uint16_t packet_id;
+    mqtt_cli_done_pt done;
+    void *ud;
+    struct mqtt_cli_done_s *next;
+} mqtt_cli_done_t;
+
 struct mqtt_cli_s {
     mqtt_str_t client_id;
     mqtt_version_t version;
@@ -121,10 +338,66 @@ struct mqtt_cli_s {
         uint64_t send;
     } t;
 
+    /* slot heads are list sentinels, tick is the last time processed. */
+    struct {
+        uint64_t tick;
+        size_t n;
+        mqtt_cli_timer_t slot[MQTT_CLI_WHEEL_LEVELS][MQTT_CLI_WHEEL_SIZE];
+    } wheel;
+
+    mqtt_cli_timer_t keepalive;
+
+    struct {
+        uint32_t session_expiry_interval;
+        uint16_t receive_maximum;
+        uint32_t maximum_packet_size;
+        uint16_t topic_alias_maximum;
+
+        /* limits announced by the server in CONNACK. */
+        struct {
+            uint16_t receive_maximum;
+            uint32_t maximum_packet_size;
+            uint16_t topic_alias_maximum;
+        } server;
+
+        /* reused by every aliased PUBLISH, so only the first one allocates. */
+        mqtt_properties_t alias_properties;
+        /* topic aliases, alias n is index n-1. */
+        struct {
+            mqtt_str_t *topics;
+            uint16_t n;
+            uint16_t max;
+        } alias_out, alias_in;
+    } v5;
+
+    /* qos 1/2 publishes the server still accepts, see receive maximum. */
+    uint16_t quota;
+    int held;
+
+    int connected;
+    int manual_ack;
+
+    /* received qos 2 packet ids waiting for PUBREL, one bit each. */
+    uint8_t *qos2_in;
+
+    struct {
+        char *path;
+        FILE *fp;
+        size_t records;
+        size_t live;
+        /* the file is behind memory, the next store rewrites it. */
+        int failed;
+    } session;
+
     uint16_t packet_id;
     mqtt_parser_t parser;
     mqtt_cli_packet_t *padding;
 
+    struct {
+        mqtt_str_t b;
+        size_t size;
+    } tx[2];
+
     struct {
         mqtt_cli_callback_pt connack;
         mqtt_cli_callback_pt suback;
@@ -134,6 +407,26 @@ struct mqtt_cli_s {
         mqtt_cli_callback_pt pingresp;
     } cb;
 
+    /* requests from other threads, a vyukov mpsc queue around stub. */
+    struct {
+        _Atomic(mqtt_cli_cmd_t *) head;
+        mqtt_cli_cmd_t *tail;
+        mqtt_cli_cmd_t stub;
+        atomic_int signaled;
+        _Atomic(mqtt_cli_wakeup_pt) wakeup;
+        void *ud;
+    } q;
+
+    mqtt_cli_done_t *pending;
+
+    /* handlers by topic filter, and the exact topic names routed so far. */
+    mqtt_topic_tree_t handlers;
+    struct {
+        mqtt_cli_route_t *slots;
+        size_t n;
+    } routes;
+    int dispatching;
+
     void *ud;
 };
 
@@ -147,6 +440,168 @@ _generate_packet_id(mqtt_cli_t *m) {
     return id;
 }
 
+static mqtt_str_t *
+_tx_reserve(mqtt_cli_t *m, size_t n) {
+    mqtt_str_t *b;
+
+    b = &m->tx[0].b;
+    if (b->n + n > m->tx[0].size) {
+        size_t size;
+
+        size = m->tx[0].size ? m->tx[0].size : 256;
+        while (size < b->n + n) {
+            size *= 2;
+        }
+        b->s = (char *)realloc(b->s, size);
+        m->tx[0].size = size;
+    }
+    return b;
+}
+
+static void
+_tx_append(mqtt_cli_t *m, const mqtt_str_t *s) {
+    mqtt_str_concat(_tx_reserve(m, s->n), s);
+}
+
+static void
+_timer_list_init(mqtt_cli_timer_t *head) {
+    head->prev = head->next = head;
+}
+
+static void
+_wheel_init(mqtt_cli_t *m) {
+    int i, j;
+
+    m->wheel.tick = m->t.now;
+    m->wheel.n = 0;
+    for (i = 0; i < MQTT_CLI_WHEEL_LEVELS; i++) {
+        for (j = 0; j < MQTT_CLI_WHEEL_SIZE; j++) {
+            _timer_list_init(&m->wheel.slot[i][j]);
+        }
+    }
+    _timer_list_init(&m->keepalive);
+}
+
+static void
+_wheel_link(mqtt_cli_t *m, mqtt_cli_timer_t *t) {
+    mqtt_cli_timer_t *head;
+    uint64_t base, expire, delta;
+    int level;
+
+    /* relative to the next tick to process. */
+    base = m->wheel.tick + 1;
+    expire = t->expire < base ? base : t->expire;
+    delta = expire - base;
+    for (level = 0; level < MQTT_CLI_WHEEL_LEVELS - 1; level++) {
+        if (delta < (uint64_t)1 << (MQTT_CLI_WHEEL_BITS * (level + 1)))
+            break;
+    }
+    /* beyond the wheel range, park in the last level and re-link on cascade. */
+    if (delta >= (uint64_t)1 << (MQTT_CLI_WHEEL_BITS * MQTT_CLI_WHEEL_LEVELS))
+        expire = base + ((uint64_t)1 << (MQTT_CLI_WHEEL_BITS * MQTT_CLI_WHEEL_LEVELS)) - 1;
+    head = &m->wheel.slot[level][(expire >> (MQTT_CLI_WHEEL_BITS * level)) & MQTT_CLI_WHEEL_MASK];
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+    m->wheel.n++;
+}
+
+static void
+_timer_stop(mqtt_cli_t *m, mqtt_cli_timer_t *t) {
+    if (t->next && t->next != t) {
+        t->prev->next = t->next;
+        t->next->prev = t->prev;
+        m->wheel.n--;
+    }
+    t->prev = t->next = t;
+}
+
+static void
+_timer_start(mqtt_cli_t *m, mqtt_cli_timer_t *t, uint64_t expire) {
+    _timer_stop(m, t);
+    t->expire = expire;
+    _wheel_link(m, t);
+}
+
+/* move the expired timers into fired, cascading higher levels on the way. */
+static void
+_wheel_advance(mqtt_cli_t *m, mqtt_cli_timer_t *fired) {
+    while (m->wheel.tick < m->t.now) {
+        mqtt_cli_timer_t *head, *t;
+        uint64_t tick;
+        int level;
+
+        if (m->wheel.n == 0) {
+            m->wheel.tick = m->t.now;
+            break;
+        }
+        tick = m->wheel.tick + 1;
+        for (level = 1; level < MQTT_CLI_WHEEL_LEVELS; level++) {
+            mqtt_cli_timer_t list;
+
+            if (tick & (((uint64_t)1 << (MQTT_CLI_WHEEL_BITS * level)) - 1))
+                break;
+            head = &m->wheel.slot[level][(tick >> (MQTT_CLI_WHEEL_BITS * level)) & MQTT_CLI_WHEEL_MASK];
+            if (head->next == head)
+                continue;
+            list.next = head->next;
+            list.prev = head->prev;
+            list.next->prev = list.prev->next = &list;
+            _timer_list_init(head);
+            while ((t = list.next) != &list) {
+                list.next = t->next;
+                t->next->prev = &list;
+                m->wheel.n--;
+                _wheel_link(m, t);
+            }
+        }
+        m->wheel.tick = tick;
+        head = &m->wheel.slot[0][tick & MQTT_CLI_WHEEL_MASK];
+        while ((t = head->next) != head) {
+            head->next = t->next;
+            t->next->prev = head;
+            m->wheel.n--;
+            t->prev = fired->prev;
+            t->next = fired;
+            fired->prev->next = t;
+            fired->prev = t;
+        }
+    }
+}
+
+static void
+_clear_aliases(mqtt_cli_t *m) {
+    uint16_t i;
+
+    for (i = 0; i < m->v5.alias_out.max; i++) {
+        mqtt_str_free(&m->v5.alias_out.topics[i]);
+    }
+    for (i = 0; i < m->v5.alias_in.max; i++) {
+        mqtt_str_free(&m->v5.alias_in.topics[i]);
+    }
+    m->v5.alias_out.n = 0;
+    m->v5.alias_in.n = 0;
+}
+
+static uint16_t
+_topic_alias(mqtt_cli_t *m, mqtt_str_t *topic, int assign, int *known) {
+    uint16_t i;
+
+    for (i = 0; i < m->v5.alias_out.n; i++) {
+        if (mqtt_str_equal(&m->v5.alias_out.topics[i], topic)) {
+            *known = 1;
+            return i + 1;
+        }
+    }
+    *known = 0;
+    if (assign && m->v5.alias_out.n < m->v5.alias_out.max && m->v5.alias_out.n < m->v5.server.topic_alias_maximum) {
+        mqtt_str_copy(&m->v5.alias_out.topics[m->v5.alias_out.n], topic);
+        return ++m->v5.alias_out.n;
+    }
+    return 0;
+}
+
 static void
 _clear_padding(mqtt_cli_t *m) {
     mqtt_cli_packet_t *mp;
@@ -156,6 +611,7 @@ _clear_padding(mqtt_cli_t *m) {
         mqtt_cli_packet_t *next;
 
         next = mp->next;
+        _timer_stop(m, &mp->timer);
         mqtt_str_free(&mp->b);
         free(mp);
         mp = next;
@@ -163,27 +619,26 @@ _clear_padding(mqtt_cli_t *m) {
 }
 
 static int
-_check_padding(mqtt_cli_t *m) {
-    mqtt_cli_packet_t *mp;
-    int rc;
+_timeout_padding(mqtt_cli_packet_t *mp) {
+    if (--mp->ttl <= 0)
+        return -1;
+    mp->wait_ack = 0;
+    if (mp->type == MQTT_PUBLISH) {
+        ((mqtt_fixed_header_t *)mp->b.s)->bits.dup = 1;
+    }
+    return 0;
+}
 
-    rc = 0;
-    mp = m->padding;
-    while (mp) {
-        if (mp->ttl > 0 && m->t.now - mp->t_send >= MQTT_CLI_PACKET_TIMEOUT * 1000) {
-            if (--mp->ttl > 0) {
-                mp->wait_ack = 0;
-                if (mp->type == MQTT_PUBLISH) {
-                    ((mqtt_fixed_header_t *)mp->b.s)->bits.dup = 1;
-                }
-            } else {
-                rc = -1;
-                break;
-            }
-        }
-        mp = mp->next;
+static void
+_arm_keepalive(mqtt_cli_t *m) {
+    if (m->keep_alive == 0) {
+        _timer_stop(m, &m->keepalive);
+        return;
     }
-    return rc;
+    if (m->t.ping > 0)
+        _timer_start(m, &m->keepalive, m->t.ping + (uint64_t)m->keep_alive * 1000 + 1);
+    else
+        _timer_start(m, &m->keepalive, m->t.send + (uint64_t)m->keep_alive * 1000);
 }
 
 static int
@@ -200,6 +655,143 @@ _check_keepalive(mqtt_cli_t *m) {
     return 0;
 }
 
+static int
+_session_record(mqtt_cli_t *m, FILE *fp, char op, mqtt_cli_packet_t *mp) {
+    char h[8];
+    mqtt_str_t b;
+
+    mqtt_str_init(&b, h, 0);
+    mqtt_str_write_u8(&b, (uint8_t)op);
+    mqtt_str_write_u8(&b, (uint8_t)mp->type);
+    mqtt_str_write_u16(&b, mp->packet_id);
+    if (op == '+')
+        mqtt_str_write_u32(&b, (uint32_t)mp->b.n);
+    if (fwrite(b.s, 1, b.n, fp) != b.n)
+        return -1;
+    if (op == '+' && fwrite(mp->b.s, 1, mp->b.n, fp) != mp->b.n)
+        return -1;
+    m->session.records++;
+    return 0;
+}
+
+static int
+_session_sync(FILE *fp) {
+    if (fflush(fp) || fsync(fileno(fp)))
+        return -1;
+    return 0;
+}
+
+/* make the rename of the session file itself durable. */
+static int
+_session_sync_dir(const char *path) {
+    const char *slash;
+    char *dir;
+    int fd, rc;
+
+    slash = strrchr(path, '/');
+    if (!slash)
+        dir = strdup(".");
+    else if (slash == path)
+        dir = strdup("/");
+    else
+        dir = strndup(path, slash - path);
+    fd = open(dir, O_RDONLY);
+    free(dir);
+    if (fd < 0)
+        return -1;
+    rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+/*
+ * rewrite the live packets into path.tmp, sync it and rename it over path.
+ * on failure the current file and its handle are kept as they are and the
+ * session is marked failed, errno tells why.
+ */
+static int
+_session_compact(mqtt_cli_t *m) {
+    mqtt_cli_packet_t *mp;
+    size_t records, live;
+    char *tmp;
+    FILE *fp;
+
+    tmp = (char *)malloc(strlen(m->session.path) + 5);
+    sprintf(tmp, "%s.tmp", m->session.path);
+    fp = fopen(tmp, "wb");
+    if (!fp) {
+        free(tmp);
+        m->session.failed = 1;
+        return -1;
+    }
+    records = m->session.records;
+    live = m->session.live;
+    m->session.records = 0;
+    m->session.live = 0;
+    for (mp = m->padding; mp; mp = mp->next) {
+        if (_session_record(m, fp, '+', mp))
+            goto e;
+        m->session.live++;
+    }
+    /* fp keeps appending to the new file once it is renamed into place. */
+    if (_session_sync(fp) || rename(tmp, m->session.path))
+        goto e;
+    if (m->session.fp)
+        fclose(m->session.fp);
+    m->session.fp = fp;
+    free(tmp);
+    /* the new file is in place, but the rename may not survive a crash yet. */
+    m->session.failed = _session_sync_dir(m->session.path) != 0;
+    return m->session.failed ? -1 : 0;
+
+e:
+    fclose(fp);
+    remove(tmp);
+    free(tmp);
+    m->session.records = records;
+    m->session.live = live;
+    m->session.failed = 1;
+    return -1;
+}
+
+/*
+ * a stored packet is synced to disk before it goes out, so it survives a
+ * power loss, -1 when it could not be made durable. an erase is only
+ * flushed, losing one resends a packet the peer already acknowledged,
+ * which qos 1/2 tolerates.
+ */
+static int
+_session_store(mqtt_cli_t *m, mqtt_cli_packet_t *mp) {
+    if (!m->session.path)
+        return 0;
+    m->session.live++;
+    if (!m->session.failed && !_session_record(m, m->session.fp, '+', mp) && !_session_sync(m->session.fp))
+        return 0;
+    /* a torn record would cut the log short, rewrite it from memory with mp in it. */
+    return _session_compact(m);
+}
+
+static void
+_session_erase(mqtt_cli_t *m, mqtt_cli_packet_t *mp) {
+    if (!m->session.path)
+        return;
+    m->session.live--;
+    if (m->session.failed || _session_record(m, m->session.fp, '-', mp) || fflush(m->session.fp)) {
+        _session_compact(m);
+        return;
+    }
+    if (m->session.records > 1024 && m->session.records > 4 * m->session.live)
+        _session_compact(m);
+}
+
+static void
+_release_quota(mqtt_cli_t *m, mqtt_cli_packet_t *mp) {
+    if (mp->quota) {
+        mp->quota = 0;
+        m->quota++;
+    }
+}
+
 static int
 _erase_padding(mqtt_cli_t *m, mqtt_packet_type_t type, uint16_t packet_id) {
     mqtt_cli_packet_t *mp, **pmp;
@@ -209,6 +801,11 @@ _erase_padding(mqtt_cli_t *m, mqtt_packet_type_t type, uint16_t packet_id) {
         mp = *pmp;
         if (mp->type == type && mp->packet_id == packet_id) {
             *pmp = mp->next;
+            _release_quota(m, mp);
+            if (mp->held)
+                m->held--;
+            _session_erase(m, mp);
+            _timer_stop(m, &mp->timer);
             mqtt_str_free(&mp->b);
             free(mp);
             return 0;
@@ -218,51 +815,185 @@ _erase_padding(mqtt_cli_t *m, mqtt_packet_type_t type, uint16_t packet_id) {
     return -1;
 }
 
-static int
-_append_padding(mqtt_cli_t *m, mqtt_packet_t *pkt) {
-    mqtt_str_t b = MQTT_STR_INITIALIZER;
-    int rc;
+static void
+_link_padding(mqtt_cli_t *m, mqtt_cli_packet_t *mp) {
+    if (!m->padding)
+        m->padding = mp;
+    else {
+        mqtt_cli_packet_t *p;
+
+        p = m->padding;
+        while (p->next) {
+            p = p->next;
+        }
+        p->next = mp;
+    }
+}
 
-    rc = mqtt_serialize(pkt, &b);
-    if (!rc) {
-        mqtt_cli_packet_t *mp;
+static mqtt_cli_packet_t *
+_new_padding(mqtt_cli_t *m, mqtt_packet_type_t type, uint16_t packet_id) {
+    mqtt_cli_packet_t *mp;
 
-        mp = (mqtt_cli_packet_t *)malloc(sizeof *mp);
-        memset(mp, 0, sizeof *mp);
-        mp->type = (mqtt_packet_type_t)pkt->f.bits.type;
-        mqtt_str_set(&mp->b, &b);
-        mp->t_send = m->t.now;
-        switch (pkt->f.bits.type) {
-        case MQTT_PUBLISH:
-            mp->packet_id = pkt->v.publish.packet_id;
-            if (pkt->f.bits.qos > MQTT_QOS_0)
-                mp->ttl = MQTT_CLI_PACKET_TTL;
-            break;
-        case MQTT_PUBREL:
-            mp->packet_id = pkt->v.pubrel.packet_id;
+    mp = (mqtt_cli_packet_t *)malloc(sizeof *mp);
+    memset(mp, 0, sizeof *mp);
+    mp->type = type;
+    mp->packet_id = packet_id;
+    mp->ttl = MQTT_CLI_PACKET_TTL;
+    mp->wait_ack = 1;
+    mp->t_send = m->t.now;
+    _timer_start(m, &mp->timer, mp->t_send + MQTT_CLI_PACKET_TIMEOUT * 1000);
+    _link_padding(m, mp);
+    return mp;
+}
+
+static void
+_session_load(mqtt_cli_t *m, const char *path) {
+    FILE *fp;
+    char h[8];
+    mqtt_str_t b;
+
+    fp = fopen(path, "rb");
+    if (!fp)
+        return;
+    while (fread(h, 1, 4, fp) == 4) {
+        mqtt_packet_type_t type;
+        uint16_t packet_id;
+        char op;
+
+        mqtt_str_init(&b, h, 4);
+        op = (char)mqtt_str_read_u8(&b);
+        type = (mqtt_packet_type_t)mqtt_str_read_u8(&b);
+        packet_id = mqtt_str_read_u16(&b);
+        if (op == '+') {
+            mqtt_cli_packet_t *mp;
+            uint32_t n;
+
+            if (fread(h + 4, 1, 4, fp) != 4)
+                break;
+            mqtt_str_init(&b, h + 4, 4);
+            n = mqtt_str_read_u32(&b);
+            mp = (mqtt_cli_packet_t *)malloc(sizeof *mp);
+            memset(mp, 0, sizeof *mp);
+            mp->type = type;
+            mp->packet_id = packet_id;
             mp->ttl = MQTT_CLI_PACKET_TTL;
-            break;
-        default:
+            mp->b.s = (char *)malloc(n);
+            mp->b.n = n;
+            if (n == 0 || fread(mp->b.s, 1, n, fp) != n) {
+                mqtt_str_free(&mp->b);
+                free(mp);
+                break;
+            }
+            if (type == MQTT_PUBLISH)
+                ((mqtt_fixed_header_t *)mp->b.s)->bits.dup = 1;
+            _link_padding(m, mp);
+            if (packet_id > m->packet_id)
+                m->packet_id = packet_id;
+        } else if (op == '-') {
+            _erase_padding(m, type, packet_id);
+        } else {
             break;
         }
+    }
+    fclose(fp);
+}
+
+static void
+_send_padding(mqtt_cli_t *m, mqtt_cli_packet_t *mp) {
+    if (mp->type == MQTT_PUBLISH && !mp->quota) {
+        /* keep publishes in order behind the ones waiting for quota. */
+        if (!m->quota || (m->held && !mp->held)) {
+            if (!mp->held) {
+                mp->held = 1;
+                m->held++;
+            }
+            mp->wait_ack = 0;
+            _timer_stop(m, &mp->timer);
+            return;
+        }
+        if (mp->held) {
+            mp->held = 0;
+            m->held--;
+        }
+        m->quota--;
+        mp->quota = 1;
+    }
+    _tx_append(m, &mp->b);
+    mp->wait_ack = 1;
+    mp->t_send = m->t.now;
+    _timer_start(m, &mp->timer, mp->t_send + MQTT_CLI_PACKET_TIMEOUT * 1000);
+}
+
+/* topic aliases do not survive the connection, resend with the topic name. */
+static void
+_unalias_padding(mqtt_cli_t *m) {
+    mqtt_cli_packet_t *mp;
 
-        if (!m->padding)
-            m->padding = mp;
-        else {
-            mqtt_cli_packet_t *p;
+    for (mp = m->padding; mp; mp = mp->next) {
+        mqtt_parser_t parser;
+        mqtt_packet_t pkt;
+        mqtt_str_t b;
 
-            p = m->padding;
-            while (p->next) {
-                p = p->next;
+        if (mp->type != MQTT_PUBLISH || !mp->alias)
+            continue;
+        mqtt_parser_init(&parser);
+        mqtt_parser_version(&parser, m->version);
+        mqtt_str_set(&b, &mp->b);
+        if (mqtt_parse(&parser, &b, &pkt) == 1) {
+            mqtt_properties_remove(&pkt.v.publish.v5.properties, MQTT_PROPERTY_TOPIC_ALIAS);
+            mqtt_str_set(&pkt.v.publish.topic_name, &m->v5.alias_out.topics[mp->alias - 1]);
+            if (!mqtt_serialize(&pkt, &b)) {
+                mqtt_str_free(&mp->b);
+                mqtt_str_set(&mp->b, &b);
             }
-            p->next = mp;
+            mqtt_packet_unit(&pkt);
         }
-    } else {
-        mqtt_str_free(&b);
+        mqtt_parser_unit(&parser);
+        mp->alias = 0;
+    }
+}
+
+static int
+_append_padding(mqtt_cli_t *m, mqtt_packet_t *pkt) {
+    mqtt_cli_packet_t *mp;
+    mqtt_str_t *tx, b;
+    ssize_t n;
+
+    n = mqtt_serialized_size(pkt);
+    if (n < 0 || (m->v5.server.maximum_packet_size && (size_t)n > m->v5.server.maximum_packet_size)) {
+        mqtt_packet_unit(pkt);
+        return -1;
+    }
+    /* serialize straight into the transmit buffer, only packets kept for resend get a copy. */
+    tx = _tx_reserve(m, n);
+    mqtt_str_init(&b, tx->s + tx->n, (size_t)n);
+    mqtt_serialize_into(pkt, b.s, b.n);
+    tx->n += n;
+    mp = 0;
+    switch (pkt->f.bits.type) {
+    case MQTT_PUBLISH:
+        if (pkt->f.bits.qos > MQTT_QOS_0)
+            mp = _new_padding(m, MQTT_PUBLISH, pkt->v.publish.packet_id);
+        break;
+    case MQTT_PUBREL:
+        /* the quota of the QoS 2 publish is held until PUBCOMP. */
+        mp = _new_padding(m, MQTT_PUBREL, pkt->v.pubrel.packet_id);
+        if (m->quota) {
+            m->quota--;
+            mp->quota = 1;
+        }
+        break;
+    default:
+        break;
+    }
+    if (mp) {
+        mqtt_str_copy(&mp->b, &b);
+        /* the packet is already on its way, a failed store is reported by the next publish. */
+        _session_store(m, mp);
     }
     mqtt_packet_unit(pkt);
 
-    return rc;
+    return 0;
 }
 
 static int
@@ -290,26 +1021,329 @@ _send_puback(mqtt_cli_t *m, mqtt_packet_type_t type, uint16_t packet_id) {
     return _append_padding(m, &pkt);
 }
 
-static int
-_handle_packet(mqtt_cli_t *m, mqtt_packet_t *pkt) {
-    int rc;
+static void
+_handle_connack(mqtt_cli_t *m, mqtt_packet_t *pkt) {
+    mqtt_properties_t *properties;
+    mqtt_property_t *property;
+    mqtt_cli_packet_t *mp;
+    int accepted, session_present;
+
+    m->v5.server.receive_maximum = 0xFFFF;
+    m->v5.server.maximum_packet_size = 0;
+    m->v5.server.topic_alias_maximum = 0;
+    if (pkt->ver == MQTT_VERSION_5 && pkt->v.connack.v5.reason_code == MQTT_RC_SUCCESS) {
+        properties = &pkt->v.connack.v5.properties;
+        if ((property = mqtt_properties_find(properties, MQTT_PROPERTY_RECEIVE_MAXIMUM)) && property->b2)
+            m->v5.server.receive_maximum = property->b2;
+        if ((property = mqtt_properties_find(properties, MQTT_PROPERTY_MAXIMUM_PACKET_SIZE)))
+            m->v5.server.maximum_packet_size = property->b4;
+        if ((property = mqtt_properties_find(properties, MQTT_PROPERTY_TOPIC_ALIAS_MAXIMUM)))
+            m->v5.server.topic_alias_maximum = property->b2;
+        if ((property = mqtt_properties_find(properties, MQTT_PROPERTY_SERVER_KEEP_ALIVE)))
+            m->keep_alive = property->b2;
+        _arm_keepalive(m);
+        property = mqtt_properties_find(properties, MQTT_PROPERTY_ASSIGNED_CLIENT_IDENTIFER);
+        if (property && mqtt_str_empty(&m->client_id))
+            mqtt_str_copy(&m->client_id, &property->str);
+    }
 
-    rc = 0;
-    switch (pkt->f.bits.type) {
-    case MQTT_CONNACK:
-        if (m->cb.connack) {
-            m->cb.connack(m, m->ud, pkt);
-        }
-        break;
-    case MQTT_PUBLISH:
+    m->quota = m->v5.server.receive_maximum;
+    for (mp = m->padding; mp; mp = mp->next) {
+        if (!mp->quota)
+            continue;
+        /* the new limit may be lower than what is already in flight. */
+        if (m->quota)
+            m->quota--;
+        else
+            mp->quota = 0;
+    }
+
+    switch (pkt->ver) {
+    case MQTT_VERSION_3:
+        accepted = pkt->v.connack.v3.return_code == MQTT_CRC_ACCEPTED;
+        session_present = 0;
+        break;
+    case MQTT_VERSION_4:
+        accepted = pkt->v.connack.v4.return_code == MQTT_CRC_ACCEPTED;
+        session_present = pkt->v.connack.v4.acknowledge_flags.bits.session_present;
+        break;
+    case MQTT_VERSION_5:
+        accepted = pkt->v.connack.v5.reason_code == MQTT_RC_SUCCESS;
+        session_present = pkt->v.connack.v5.acknowledge_flags.bits.session_present;
+        break;
+    default:
+        accepted = session_present = 0;
+        break;
+    }
+    if (!accepted)
+        return;
+    m->connected = 1;
+
+    /* without a session the server knows nothing of our PUBRELs or its PUBRECs. */
+    if (!session_present) {
+        mqtt_cli_packet_t *next;
+
+        for (mp = m->padding; mp; mp = next) {
+            next = mp->next;
+            if (mp->type == MQTT_PUBREL)
+                _erase_padding(m, MQTT_PUBREL, mp->packet_id);
+        }
+        if (m->qos2_in)
+            memset(m->qos2_in, 0, 0x10000 / 8);
+    }
+
+    /* replay in-flight packets in their original order, right after CONNECT. */
+    for (mp = m->padding; mp; mp = mp->next) {
+        if (mp->wait_ack == 0) {
+            mp->ttl = MQTT_CLI_PACKET_TTL;
+            _send_padding(m, mp);
+        }
+    }
+}
+
+static int
+_handle_publish(mqtt_cli_t *m, mqtt_packet_t *pkt) {
+    mqtt_property_t *property;
+    uint16_t alias;
+
+    if (pkt->ver != MQTT_VERSION_5)
+        return 0;
+    property = mqtt_properties_find(&pkt->v.publish.v5.properties, MQTT_PROPERTY_TOPIC_ALIAS);
+    if (!property)
+        return mqtt_str_empty(&pkt->v.publish.topic_name) ? -1 : 0;
+    alias = property->b2;
+    if (alias == 0 || alias > m->v5.alias_in.max)
+        return -1;
+    if (!mqtt_str_empty(&pkt->v.publish.topic_name)) {
+        mqtt_str_free(&m->v5.alias_in.topics[alias - 1]);
+        mqtt_str_copy(&m->v5.alias_in.topics[alias - 1], &pkt->v.publish.topic_name);
+    } else if (mqtt_str_empty(&m->v5.alias_in.topics[alias - 1])) {
+        return -1;
+    } else {
+        mqtt_str_set(&pkt->v.publish.topic_name, &m->v5.alias_in.topics[alias - 1]);
+    }
+    return 0;
+}
+
+static int
+_qos2_received(mqtt_cli_t *m, uint16_t packet_id) {
+    return m->qos2_in && (m->qos2_in[packet_id >> 3] & (1 << (packet_id & 7)));
+}
+
+static void
+_qos2_mark(mqtt_cli_t *m, uint16_t packet_id, int on) {
+    if (!m->qos2_in) {
+        if (!on)
+            return;
+        m->qos2_in = (uint8_t *)calloc(0x10000 / 8, 1);
+    }
+    if (on)
+        m->qos2_in[packet_id >> 3] |= (uint8_t)(1 << (packet_id & 7));
+    else
+        m->qos2_in[packet_id >> 3] &= (uint8_t)~(1 << (packet_id & 7));
+}
+
+static void
+_add_pending(mqtt_cli_t *m, mqtt_packet_type_t type, uint16_t packet_id, mqtt_cli_done_pt done, void *ud) {
+    mqtt_cli_done_t *d, **pd;
+
+    d = (mqtt_cli_done_t *)malloc(sizeof *d);
+    d->type = type;
+    d->packet_id = packet_id;
+    d->done = done;
+    d->ud = ud;
+    d->next = 0;
+    /* acks mostly arrive in order, keep the oldest first. */
+    pd = &m->pending;
+    while (*pd) {
+        pd = &(*pd)->next;
+    }
+    *pd = d;
+}
+
+static void
+_complete_pending(mqtt_cli_t *m, mqtt_packet_type_t type, uint16_t packet_id, int status) {
+    mqtt_cli_done_t *d, **pd;
+
+    pd = &m->pending;
+    while ((d = *pd)) {
+        if (d->type == type && d->packet_id == packet_id) {
+            *pd = d->next;
+            d->done(m, d->ud, packet_id, status);
+            free(d);
+            return;
+        }
+        pd = &d->next;
+    }
+}
+
+/* subscriptions are not resent on a new connection, publishes are. */
+static void
+_fail_pending(mqtt_cli_t *m, int all) {
+    mqtt_cli_done_t *d, **pd;
+
+    pd = &m->pending;
+    while ((d = *pd)) {
+        if (all || d->type != MQTT_PUBLISH) {
+            *pd = d->next;
+            d->done(m, d->ud, d->packet_id, -1);
+            free(d);
+            continue;
+        }
+        pd = &d->next;
+    }
+}
+
+/* the first failure among the granted subscriptions, 0 if all succeeded. */
+static int
+_suback_status(mqtt_packet_t *pkt) {
+    int i;
+
+    for (i = 0; i < pkt->p.suback.n; i++) {
+        if (pkt->ver == MQTT_VERSION_3 && pkt->p.suback.v3.granted[i].flags & 0x80)
+            return pkt->p.suback.v3.granted[i].flags;
+        if (pkt->ver == MQTT_VERSION_4 && pkt->p.suback.v4.return_codes[i] == MQTT_SRC_QOS_F)
+            return pkt->p.suback.v4.return_codes[i];
+        if (pkt->ver == MQTT_VERSION_5 && pkt->p.suback.v5.reason_codes[i] >= MQTT_RC_UNSPECIFIED_ERROR)
+            return pkt->p.suback.v5.reason_codes[i];
+    }
+    return 0;
+}
+
+static int
+_unsuback_status(mqtt_packet_t *pkt) {
+    int i;
+
+    if (pkt->ver != MQTT_VERSION_5)
+        return 0;
+    for (i = 0; i < pkt->p.unsuback.v5.n; i++) {
+        if (pkt->p.unsuback.v5.reason_codes[i] >= MQTT_RC_UNSPECIFIED_ERROR)
+            return pkt->p.unsuback.v5.reason_codes[i];
+    }
+    return 0;
+}
+
+static uint32_t
+_route_hash(const mqtt_str_t *topic) {
+    uint32_t h;
+    size_t i;
+
+    h = 2166136261u;
+    for (i = 0; i < topic->n; i++) {
+        h = (h ^ (uint8_t)topic->s[i]) * 16777619u;
+    }
+    return h;
+}
+
+static void
+_routes_clear(mqtt_cli_t *m) {
+    size_t i;
+
+    if (!m->routes.slots || !m->routes.n)
+        return;
+    for (i = 0; i < MQTT_CLI_ROUTE_CACHE; i++) {
+        mqtt_cli_route_t *r;
+
+        r = &m->routes.slots[i];
+        if (!r->topic.s)
+            continue;
+        mqtt_str_free(&r->topic);
+        if (r->handlers)
+            free(r->handlers);
+        memset(r, 0, sizeof *r);
+    }
+    m->routes.n = 0;
+}
+
+static void
+_route_collect(void *ud, void *value) {
+    mqtt_cli_route_t *r;
+
+    r = (mqtt_cli_route_t *)ud;
+    r->handlers = (mqtt_cli_handler_t **)realloc(r->handlers, (r->n + 1) * sizeof(mqtt_cli_handler_t *));
+    r->handlers[r->n++] = (mqtt_cli_handler_t *)value;
+}
+
+/* the handlers for an exact topic name, matched in the trie on a miss. */
+static mqtt_cli_route_t *
+_route_lookup(mqtt_cli_t *m, mqtt_str_t *topic) {
+    mqtt_cli_route_t *r;
+    uint32_t hash;
+    size_t i;
+
+    if (!m->routes.slots)
+        m->routes.slots = (mqtt_cli_route_t *)calloc(MQTT_CLI_ROUTE_CACHE, sizeof(mqtt_cli_route_t));
+    hash = _route_hash(topic);
+    i = hash & (MQTT_CLI_ROUTE_CACHE - 1);
+    while ((r = &m->routes.slots[i])->topic.s) {
+        if (r->hash == hash && mqtt_str_equal(&r->topic, topic))
+            return r;
+        i = (i + 1) & (MQTT_CLI_ROUTE_CACHE - 1);
+    }
+    /* start over rather than evict, the topic set of a client is small. */
+    if (m->routes.n >= MQTT_CLI_ROUTE_CACHE / 4 * 3) {
+        _routes_clear(m);
+        i = hash & (MQTT_CLI_ROUTE_CACHE - 1);
+        r = &m->routes.slots[i];
+    }
+    r->hash = hash;
+    mqtt_str_copy(&r->topic, topic);
+    mqtt_topic_tree_match(&m->handlers, topic, _route_collect, r);
+    m->routes.n++;
+    return r;
+}
+
+static void
+_dispatch_publish(mqtt_cli_t *m, mqtt_packet_t *pkt) {
+    mqtt_cli_route_t *r;
+    int i;
+
+    r = 0;
+    if (m->handlers.count > 0 && !mqtt_str_empty(&pkt->v.publish.topic_name))
+        r = _route_lookup(m, &pkt->v.publish.topic_name);
+    if (!r || r->n == 0) {
         if (m->cb.publish) {
             m->cb.publish(m, m->ud, pkt);
         }
+        return;
+    }
+    m->dispatching = 1;
+    for (i = 0; i < r->n; i++) {
+        r->handlers[i]->handler(m, r->handlers[i]->ud, pkt);
+    }
+    m->dispatching = 0;
+}
+
+static int
+_handle_packet(mqtt_cli_t *m, mqtt_packet_t *pkt) {
+    int rc;
+
+    rc = 0;
+    switch (pkt->f.bits.type) {
+    case MQTT_CONNACK:
+        _handle_connack(m, pkt);
+        if (m->cb.connack) {
+            m->cb.connack(m, m->ud, pkt);
+        }
+        break;
+    case MQTT_PUBLISH:
+        rc = _handle_publish(m, pkt);
+        if (rc)
+            break;
+        if (pkt->f.bits.qos == MQTT_QOS_2 && _qos2_received(m, pkt->v.publish.packet_id)) {
+            /* a resent PUBLISH we already delivered, only ack it again. */
+            rc = _send_puback(m, MQTT_PUBREC, pkt->v.publish.packet_id);
+            break;
+        }
+        _dispatch_publish(m, pkt);
+        if (m->manual_ack)
+            break;
         switch (pkt->f.bits.qos) {
         case MQTT_QOS_1:
             rc = _send_puback(m, MQTT_PUBACK, pkt->v.publish.packet_id);
             break;
         case MQTT_QOS_2:
+            _qos2_mark(m, pkt->v.publish.packet_id, 1);
             rc = _send_puback(m, MQTT_PUBREC, pkt->v.publish.packet_id);
             break;
         default:
@@ -318,6 +1352,8 @@ _handle_packet(mqtt_cli_t *m, mqtt_packet_t *pkt) {
         break;
     case MQTT_PUBACK:
         if (!_erase_padding(m, MQTT_PUBLISH, pkt->v.puback.packet_id)) {
+            _complete_pending(m, MQTT_PUBLISH, pkt->v.puback.packet_id,
+                              pkt->ver == MQTT_VERSION_5 ? pkt->v.puback.v5.reason_code : 0);
             if (m->cb.puback) {
                 m->cb.puback(m, m->ud, pkt);
             }
@@ -327,16 +1363,27 @@ _handle_packet(mqtt_cli_t *m, mqtt_packet_t *pkt) {
         break;
     case MQTT_PUBREC:
         if (!_erase_padding(m, MQTT_PUBLISH, pkt->v.pubrec.packet_id)) {
+            if (pkt->ver == MQTT_VERSION_5 && pkt->v.pubrec.v5.reason_code >= MQTT_RC_UNSPECIFIED_ERROR) {
+                /* the exchange ends here, no PUBREL. */
+                _complete_pending(m, MQTT_PUBLISH, pkt->v.pubrec.packet_id, pkt->v.pubrec.v5.reason_code);
+                if (m->cb.puback) {
+                    m->cb.puback(m, m->ud, pkt);
+                }
+                break;
+            }
             rc = _send_puback(m, MQTT_PUBREL, pkt->v.pubrec.packet_id);
         } else {
             rc = -1;
         }
         break;
     case MQTT_PUBREL:
+        _qos2_mark(m, pkt->v.pubrel.packet_id, 0);
         rc = _send_puback(m, MQTT_PUBCOMP, pkt->v.pubrel.packet_id);
         break;
     case MQTT_PUBCOMP:
         if (!_erase_padding(m, MQTT_PUBREL, pkt->v.pubcomp.packet_id)) {
+            _complete_pending(m, MQTT_PUBLISH, pkt->v.pubcomp.packet_id,
+                              pkt->ver == MQTT_VERSION_5 ? pkt->v.pubcomp.v5.reason_code : 0);
             if (m->cb.puback) {
                 m->cb.puback(m, m->ud, pkt);
             }
@@ -345,17 +1392,20 @@ _handle_packet(mqtt_cli_t *m, mqtt_packet_t *pkt) {
         }
         break;
     case MQTT_SUBACK:
+        _complete_pending(m, MQTT_SUBSCRIBE, pkt->v.suback.packet_id, _suback_status(pkt));
         if (m->cb.suback) {
             m->cb.suback(m, m->ud, pkt);
         }
         break;
     case MQTT_UNSUBACK:
+        _complete_pending(m, MQTT_UNSUBSCRIBE, pkt->v.unsuback.packet_id, _unsuback_status(pkt));
         if (m->cb.unsuback) {
             m->cb.unsuback(m, m->ud, pkt);
         }
         break;
     case MQTT_PINGRESP:
         m->t.ping = 0;
+        _arm_keepalive(m);
         if (m->cb.pingresp) {
             m->cb.pingresp(m, m->ud, pkt);
         }
@@ -368,6 +1418,142 @@ _handle_packet(mqtt_cli_t *m, mqtt_packet_t *pkt) {
     return rc;
 }
 
+static void
+_queue_push(mqtt_cli_t *m, mqtt_cli_cmd_t *cmd) {
+    mqtt_cli_cmd_t *prev;
+
+    atomic_store_explicit(&cmd->next, 0, memory_order_relaxed);
+    prev = atomic_exchange_explicit(&m->q.head, cmd, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, cmd, memory_order_release);
+}
+
+/* 0 when empty, or while a producer is between its two steps in push. */
+static mqtt_cli_cmd_t *
+_queue_pop(mqtt_cli_t *m) {
+    mqtt_cli_cmd_t *tail, *next;
+
+    tail = m->q.tail;
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (tail == &m->q.stub) {
+        if (!next)
+            return 0;
+        m->q.tail = next;
+        tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+    if (next) {
+        m->q.tail = next;
+        return tail;
+    }
+    if (tail != atomic_load_explicit(&m->q.head, memory_order_acquire))
+        return 0;
+    _queue_push(m, &m->q.stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next) {
+        m->q.tail = next;
+        return tail;
+    }
+    return 0;
+}
+
+static int
+_queue_post(mqtt_cli_t *m, mqtt_cli_cmd_t *cmd) {
+    mqtt_cli_wakeup_pt wakeup;
+
+    _queue_push(m, cmd);
+    /* one wakeup until the driving thread takes the queue again. */
+    if (!atomic_exchange(&m->q.signaled, 1)) {
+        wakeup = atomic_load_explicit(&m->q.wakeup, memory_order_acquire);
+        if (wakeup)
+            wakeup(m->q.ud);
+    }
+    return 0;
+}
+
+static mqtt_cli_cmd_t *
+_cmd_new(mqtt_packet_type_t type, int count, const char *topic[], mqtt_qos_t qos[], const mqtt_str_t *message) {
+    mqtt_cli_cmd_t *cmd;
+    size_t size;
+    char *p;
+    int i;
+
+    size = sizeof *cmd + count * (sizeof(char *) + sizeof(mqtt_qos_t));
+    for (i = 0; i < count; i++) {
+        size += strlen(topic[i]) + 1;
+    }
+    if (message)
+        size += message->n;
+    cmd = (mqtt_cli_cmd_t *)malloc(size);
+    memset(cmd, 0, sizeof *cmd);
+    cmd->type = type;
+    cmd->count = count;
+    cmd->topic = (const char **)(cmd + 1);
+    cmd->qos = (mqtt_qos_t *)(cmd->topic + count);
+    p = (char *)(cmd->qos + count);
+    for (i = 0; i < count; i++) {
+        size_t n;
+
+        n = strlen(topic[i]) + 1;
+        memcpy(p, topic[i], n);
+        cmd->topic[i] = p;
+        cmd->qos[i] = qos ? qos[i] : MQTT_QOS_0;
+        p += n;
+    }
+    if (message && message->n) {
+        memcpy(p, message->s, message->n);
+        mqtt_str_init(&cmd->message, p, message->n);
+    }
+    return cmd;
+}
+
+static void
+_cmd_run(mqtt_cli_t *m, mqtt_cli_cmd_t *cmd) {
+    uint16_t packet_id;
+    int rc;
+
+    packet_id = 0;
+    switch (cmd->type) {
+    case MQTT_PUBLISH:
+        rc = mqtt_cli_publish(m, cmd->retain, cmd->topic[0], cmd->qos[0], &cmd->message, &packet_id);
+        break;
+    case MQTT_SUBSCRIBE:
+        rc = mqtt_cli_subscribe(m, cmd->count, cmd->topic, cmd->qos, &packet_id);
+        break;
+    case MQTT_UNSUBSCRIBE:
+        rc = mqtt_cli_unsubscribe(m, cmd->count, cmd->topic, &packet_id);
+        break;
+    case MQTT_PUBACK:
+        rc = mqtt_cli_puback(m, cmd->qos[0], cmd->packet_id);
+        break;
+    default:
+        rc = -1;
+        break;
+    }
+    if (!cmd->done)
+        return;
+    if (rc)
+        cmd->done(m, cmd->ud, packet_id, -1);
+    else if (packet_id == 0)
+        cmd->done(m, cmd->ud, 0, 0);
+    else
+        _add_pending(m, cmd->type, packet_id, cmd->done, cmd->ud);
+}
+
+/* carry out the posted requests, or fail them all when m goes away. */
+static void
+_drain_commands(mqtt_cli_t *m, int run) {
+    mqtt_cli_cmd_t *cmd;
+
+    atomic_store(&m->q.signaled, 0);
+    while ((cmd = _queue_pop(m))) {
+        if (run)
+            _cmd_run(m, cmd);
+        else if (cmd->done)
+            cmd->done(m, cmd->ud, 0, -1);
+        free(cmd);
+    }
+}
+
 mqtt_cli_t *
 mqtt_cli_create(mqtt_cli_conf_t *config) {
     mqtt_cli_t *m;
@@ -379,6 +1565,8 @@ mqtt_cli_create(mqtt_cli_conf_t *config) {
     m->version = config->version;
     m->clean_session = config->clean_session;
     m->keep_alive = config->keep_alive;
+    m->manual_ack = config->manual_ack;
+    _wheel_init(m);
 
     if (config->auth.username) {
         mqtt_str_dup(&m->auth.username, config->auth.username);
@@ -392,6 +1580,18 @@ mqtt_cli_create(mqtt_cli_conf_t *config) {
         mqtt_str_copy(&m->lwt.message, &config->lwt.message);
     }
 
+    if (m->version == MQTT_VERSION_5) {
+        m->v5.session_expiry_interval = config->v5.session_expiry_interval;
+        m->v5.receive_maximum = config->v5.receive_maximum;
+        m->v5.maximum_packet_size = config->v5.maximum_packet_size;
+        m->v5.topic_alias_maximum = config->v5.topic_alias_maximum;
+        m->v5.alias_out.max = MQTT_CLI_TOPIC_ALIAS_MAX;
+        m->v5.alias_out.topics = (mqtt_str_t *)calloc(m->v5.alias_out.max, sizeof(mqtt_str_t));
+        m->v5.alias_in.max = m->v5.topic_alias_maximum;
+        if (m->v5.alias_in.max > 0)
+            m->v5.alias_in.topics = (mqtt_str_t *)calloc(m->v5.alias_in.max, sizeof(mqtt_str_t));
+    }
+
     m->cb.connack = config->cb.connack;
     m->cb.suback = config->cb.suback;
     m->cb.unsuback = config->cb.unsuback;
@@ -402,13 +1602,45 @@ mqtt_cli_create(mqtt_cli_conf_t *config) {
 
     mqtt_parser_init(&m->parser);
     mqtt_parser_version(&m->parser, m->version);
+    mqtt_parser_zero_copy(&m->parser, 1);
+
+    atomic_init(&m->q.head, &m->q.stub);
+    m->q.tail = &m->q.stub;
+    mqtt_topic_tree_init(&m->handlers);
+
+    if (config->session_file) {
+        /* the path comes after loading, replayed acks are not logged again. */
+        _session_load(m, config->session_file);
+        m->session.path = strdup(config->session_file);
+        _session_compact(m);
+    }
 
     return m;
 }
 
 void
 mqtt_cli_destroy(mqtt_cli_t *m) {
+    _drain_commands(m, 0);
+    _fail_pending(m, 1);
     _clear_padding(m);
+    mqtt_str_free(&m->tx[0].b);
+    mqtt_str_free(&m->tx[1].b);
+    _clear_aliases(m);
+    _routes_clear(m);
+    if (m->routes.slots)
+        free(m->routes.slots);
+    mqtt_topic_tree_unit(&m->handlers, free);
+    if (m->session.fp)
+        fclose(m->session.fp);
+    if (m->session.path)
+        free(m->session.path);
+    if (m->qos2_in)
+        free(m->qos2_in);
+    __properties_free(&m->v5.alias_properties);
+    if (m->v5.alias_out.topics)
+        free(m->v5.alias_out.topics);
+    if (m->v5.alias_in.topics)
+        free(m->v5.alias_in.topics);
     mqtt_str_free(&m->client_id);
     mqtt_str_free(&m->auth.username);
     mqtt_str_free(&m->auth.password);
@@ -419,9 +1651,42 @@ mqtt_cli_destroy(mqtt_cli_t *m) {
 
 int
 mqtt_cli_connect(mqtt_cli_t *m) {
+    mqtt_cli_packet_t *mp;
     mqtt_packet_t pkt;
 
+    /* bytes queued for a previous connection must not precede CONNECT. */
+    m->tx[0].b.n = 0;
+    m->connected = 0;
+    _unalias_padding(m);
+    _fail_pending(m, 0);
+
+    /* in-flight packets wait for CONNACK, then go out again. */
+    for (mp = m->padding; mp; mp = mp->next) {
+        if (mp->wait_ack && mp->type == MQTT_PUBLISH)
+            ((mqtt_fixed_header_t *)mp->b.s)->bits.dup = 1;
+        mp->wait_ack = 0;
+        _timer_stop(m, &mp->timer);
+    }
+    if (m->session.path)
+        _session_compact(m);
+    _clear_aliases(m);
+    m->v5.server.topic_alias_maximum = 0;
+    m->v5.server.maximum_packet_size = 0;
+
     mqtt_packet_init(&pkt, m->version, MQTT_CONNECT);
+    if (m->version == MQTT_VERSION_5) {
+        mqtt_properties_t *properties;
+
+        properties = &pkt.v.connect.v5.properties;
+        if (m->v5.session_expiry_interval)
+            mqtt_properties_add(properties, MQTT_PROPERTY_SESSION_EXPIRY_INTERVAL, &m->v5.session_expiry_interval, 0);
+        if (m->v5.receive_maximum)
+            mqtt_properties_add(properties, MQTT_PROPERTY_RECEIVE_MAXIMUM, &m->v5.receive_maximum, 0);
+        if (m->v5.maximum_packet_size)
+            mqtt_properties_add(properties, MQTT_PROPERTY_MAXIMUM_PACKET_SIZE, &m->v5.maximum_packet_size, 0);
+        if (m->v5.topic_alias_maximum)
+            mqtt_properties_add(properties, MQTT_PROPERTY_TOPIC_ALIAS_MAXIMUM, &m->v5.topic_alias_maximum, 0);
+    }
     pkt.v.connect.connect_flags.bits.clean_session = m->clean_session;
     pkt.v.connect.keep_alive = m->keep_alive;
     mqtt_str_set(&pkt.p.connect.client_id, &m->client_id);
@@ -447,21 +1712,103 @@ mqtt_cli_connect(mqtt_cli_t *m) {
 int
 mqtt_cli_publish(mqtt_cli_t *m, int retain, const char *topic, mqtt_qos_t qos, mqtt_str_t *message,
                  uint16_t *packet_id) {
-    mqtt_packet_t pkt;
+    mqtt_fixed_header_t f;
+    mqtt_str_t t = MQTT_STR_INITIALIZER;
+    mqtt_properties_t *properties;
+    uint16_t id, alias;
+    size_t n;
+
+    f.flags = 0;
+    f.bits.type = MQTT_PUBLISH;
+    f.bits.retain = retain;
+    f.bits.qos = qos;
+    mqtt_str_from(&t, topic);
+
+    properties = 0;
+    alias = 0;
+    /* persisted packets must stand on their own, without the alias table. */
+    if (m->version == MQTT_VERSION_5 && m->v5.server.topic_alias_maximum > 0 &&
+        (qos == MQTT_QOS_0 || !m->session.path)) {
+        int known;
+
+        /* a new alias must reach the server before anything that uses it. */
+        alias = _topic_alias(m, &t, qos == MQTT_QOS_0 || (m->quota && !m->held), &known);
+        if (alias) {
+            properties = &m->v5.alias_properties;
+            mqtt_properties_remove(properties, MQTT_PROPERTY_TOPIC_ALIAS);
+            mqtt_properties_add(properties, MQTT_PROPERTY_TOPIC_ALIAS, &alias, 0);
+            if (known)
+                mqtt_str_init(&t, 0, 0);
+        }
+    }
+
+    n = mqtt_publish_length(m->version, qos, &t, properties, message->n);
+    if (m->v5.server.maximum_packet_size && n > m->v5.server.maximum_packet_size)
+        return -1;
 
-    mqtt_packet_init(&pkt, m->version, MQTT_PUBLISH);
-    pkt.f.bits.retain = retain;
-    pkt.f.bits.qos = qos;
+    id = 0;
     if (qos > MQTT_QOS_0) {
-        pkt.v.publish.packet_id = _generate_packet_id(m);
+        id = _generate_packet_id(m);
     }
-    mqtt_str_from(&pkt.v.publish.topic_name, topic);
-    mqtt_str_set(&pkt.p.publish.message, message);
     if (packet_id) {
-        *packet_id = pkt.v.publish.packet_id;
+        *packet_id = id;
     }
 
-    return _append_padding(m, &pkt);
+    if (qos == MQTT_QOS_0) {
+        mqtt_publish_write(_tx_reserve(m, n), m->version, f, &t, id, properties, message);
+    } else {
+        mqtt_cli_packet_t *mp;
+
+        mp = _new_padding(m, MQTT_PUBLISH, id);
+        mp->alias = alias;
+        mp->b.s = (char *)malloc(n);
+        mqtt_publish_write(&mp->b, m->version, f, &t, id, properties, message);
+        if (_session_store(m, mp)) {
+            _erase_padding(m, MQTT_PUBLISH, id);
+            return -1;
+        }
+        _send_padding(m, mp);
+    }
+
+    return 0;
+}
+
+int
+mqtt_cli_publish_template(mqtt_cli_t *m, const mqtt_publish_template_t *tpl, mqtt_str_t *message,
+                          uint16_t *packet_id) {
+    uint16_t id;
+    size_t n;
+
+    if (tpl->ver != m->version)
+        return -1;
+    n = mqtt_publish_template_length(tpl, message->n);
+    if (m->v5.server.maximum_packet_size && n > m->v5.server.maximum_packet_size)
+        return -1;
+
+    id = 0;
+    if (tpl->flags & 0x06) {
+        id = _generate_packet_id(m);
+    }
+    if (packet_id) {
+        *packet_id = id;
+    }
+
+    if (!id) {
+        mqtt_publish_template_write(_tx_reserve(m, n), tpl, id, message);
+    } else {
+        mqtt_cli_packet_t *mp;
+
+        mp = _new_padding(m, MQTT_PUBLISH, id);
+        mp->b.s = (char *)malloc(n);
+        mqtt_publish_template_write(&mp->b, tpl, id, message);
+        if (_session_store(m, mp)) {
+            _erase_padding(m, MQTT_PUBLISH, id);
+            return -1;
+        }
+        _send_padding(m, mp);
+    }
+
+    return 0;
 }
 
 int
@@ -483,6 +1830,19 @@ mqtt_cli_subscribe(mqtt_cli_t *m, int count, const char *topic[], mqtt_qos_t qos
     return _append_padding(m, &pkt);
 }
 
+int
+mqtt_cli_puback(mqtt_cli_t *m, mqtt_qos_t qos, uint16_t packet_id) {
+    switch (qos) {
+    case MQTT_QOS_1:
+        return _send_puback(m, MQTT_PUBACK, packet_id);
+    case MQTT_QOS_2:
+        _qos2_mark(m, packet_id, 1);
+        return _send_puback(m, MQTT_PUBREC, packet_id);
+    default:
+        return -1;
+    }
+}
+
 int
 mqtt_cli_unsubscribe(mqtt_cli_t *m, int count, const char *topic[], uint16_t *packet_id) {
     mqtt_packet_t pkt;
@@ -507,6 +1867,7 @@ mqtt_cli_pingreq(mqtt_cli_t *m) {
 
     mqtt_packet_init(&pkt, m->version, MQTT_PINGREQ);
     m->t.ping = m->t.now;
+    _arm_keepalive(m);
 
     return _append_padding(m, &pkt);
 }
@@ -523,39 +1884,31 @@ mqtt_cli_disconnect(mqtt_cli_t *m) {
 int
 mqtt_cli_outgoing(mqtt_cli_t *m, mqtt_str_t *outgoing) {
     mqtt_cli_packet_t *mp;
+    mqtt_str_t b;
+    size_t size;
 
-    mqtt_str_init(outgoing, 0, 0);
-    mp = m->padding;
+    _drain_commands(m, 1);
+
+    mp = m->connected ? m->padding : 0;
     while (mp) {
         if (mp->wait_ack == 0) {
-            outgoing->n += mp->b.n;
+            _send_padding(m, mp);
         }
         mp = mp->next;
     }
 
+    /* hand out the filled buffer, keep filling the other one. */
+    m->tx[1].b.n = 0;
+    b = m->tx[0].b;
+    size = m->tx[0].size;
+    m->tx[0].b = m->tx[1].b;
+    m->tx[0].size = m->tx[1].size;
+    m->tx[1].b = b;
+    m->tx[1].size = size;
+    mqtt_str_set(outgoing, &m->tx[1].b);
     if (outgoing->n > 0) {
-        mqtt_cli_packet_t **pmp;
-
-        outgoing->s = (char *)malloc(outgoing->n);
-        outgoing->n = 0;
-
-        pmp = &m->padding;
-        while (*pmp) {
-            mp = *pmp;
-            if (mp->wait_ack == 0) {
-                mqtt_str_concat(outgoing, &mp->b);
-                if (mp->ttl == 0) {
-                    *pmp = mp->next;
-                    mqtt_str_free(&mp->b);
-                    free(mp);
-                    continue;
-                }
-                mp->wait_ack = 1;
-                mp->t_send = m->t.now;
-            }
-            pmp = &mp->next;
-        }
         m->t.send = m->t.now;
+        _arm_keepalive(m);
     }
 
     return 0;
@@ -563,104 +1916,840 @@ mqtt_cli_outgoing(mqtt_cli_t *m, mqtt_str_t *outgoing) {
 
 int
 mqtt_cli_incoming(mqtt_cli_t *m, mqtt_str_t *incoming) {
-    mqtt_packet_t pkt;
-    int rc;
+    mqtt_packet_t pkts[MQTT_CLI_PARSE_BATCH];
+    int n, i, rc;
 
-    while ((rc = mqtt_parse(&m->parser, incoming, &pkt)) > 0) {
-        rc = _handle_packet(m, &pkt);
-        mqtt_packet_unit(&pkt);
+    rc = 0;
+    while ((n = mqtt_parse_batch(&m->parser, incoming, pkts, MQTT_CLI_PARSE_BATCH)) > 0) {
+        for (i = 0; i < n; i++) {
+            if (!rc)
+                rc = _handle_packet(m, &pkts[i]);
+            mqtt_packet_unit(&pkts[i]);
+        }
         if (rc)
-            break;
+            return rc;
     }
 
-    return rc;
+    return n;
 }
 
 int
 mqtt_cli_elapsed(mqtt_cli_t *m, uint64_t time) {
+    mqtt_cli_timer_t fired, *t;
     int rc;
 
     m->t.now += time;
-    rc = _check_keepalive(m);
-    if (!rc)
-        rc = _check_padding(m);
+    _timer_list_init(&fired);
+    _wheel_advance(m, &fired);
+
+    rc = 0;
+    while ((t = fired.next) != &fired) {
+        fired.next = t->next;
+        t->next->prev = &fired;
+        _timer_list_init(t);
+        if (rc) {
+            /* keep the rest due, they fire again on the next call. */
+            _wheel_link(m, t);
+            continue;
+        }
+        if (t == &m->keepalive) {
+            rc = _check_keepalive(m);
+            _arm_keepalive(m);
+        } else {
+            rc = _timeout_padding((mqtt_cli_packet_t *)((char *)t - offsetof(mqtt_cli_packet_t, timer)));
+        }
+    }
     return rc;
 }
 
-#endif /* MQTT_CLI_IMPL */
+uint64_t
+mqtt_cli_next_deadline(mqtt_cli_t *m) {
+    uint64_t tick, deadline;
+    int level, i;
+
+    if (m->wheel.n == 0)
+        return UINT64_MAX;
+    deadline = UINT64_MAX;
+    tick = m->wheel.tick;
+    /* level 0 slots hold exact times, higher levels are due at their cascade. */
+    for (i = 1; i <= MQTT_CLI_WHEEL_SIZE; i++) {
+        mqtt_cli_timer_t *head;
+
+        head = &m->wheel.slot[0][(tick + i) & MQTT_CLI_WHEEL_MASK];
+        if (head->next != head) {
+            deadline = tick + i;
+            break;
+        }
+    }
+    for (level = 1; level < MQTT_CLI_WHEEL_LEVELS; level++) {
+        int shift;
 
-#ifdef MQTT_CLI_LINUX_PLATFORM
+        shift = MQTT_CLI_WHEEL_BITS * level;
+        for (i = 1; i <= MQTT_CLI_WHEEL_SIZE; i++) {
+            mqtt_cli_timer_t *head;
+            uint64_t at;
 
-#include <errno.h>
-#include <fcntl.h>
-#include <netdb.h>
-#include <netinet/in.h>
-#include <netinet/tcp.h>
-#include <sys/socket.h>
-#include <sys/time.h>
-#include <sys/types.h>
-#include <unistd.h>
+            at = ((tick >> shift) + i) << shift;
+            if (at >= deadline)
+                break;
+            head = &m->wheel.slot[level][((tick >> shift) + i) & MQTT_CLI_WHEEL_MASK];
+            if (head->next != head) {
+                deadline = at;
+                break;
+            }
+        }
+    }
+    return deadline > m->t.now ? deadline - m->t.now : 0;
+}
 
-#define LINUX_TCP_BUFF_SIZE 4096
+int
+mqtt_cli_connected(mqtt_cli_t *m) {
+    return m->connected;
+}
 
-typedef struct {
+uint32_t
+mqtt_cli_maximum_packet_size(mqtt_cli_t *m) {
+    return m->v5.server.maximum_packet_size;
+}
+
+int
+mqtt_cli_post_publish(mqtt_cli_t *m, int retain, const char *topic, mqtt_qos_t qos, const mqtt_str_t *message,
+                      mqtt_cli_done_pt done, void *ud) {
+    mqtt_cli_cmd_t *cmd;
+
+    cmd = _cmd_new(MQTT_PUBLISH, 1, &topic, &qos, message);
+    cmd->retain = retain;
+    cmd->done = done;
+    cmd->ud = ud;
+    return _queue_post(m, cmd);
+}
+
+int
+mqtt_cli_post_subscribe(mqtt_cli_t *m, int count, const char *topic[], mqtt_qos_t qos[], mqtt_cli_done_pt done,
+                        void *ud) {
+    mqtt_cli_cmd_t *cmd;
+
+    cmd = _cmd_new(MQTT_SUBSCRIBE, count, topic, qos, 0);
+    cmd->done = done;
+    cmd->ud = ud;
+    return _queue_post(m, cmd);
+}
+
+int
+mqtt_cli_post_unsubscribe(mqtt_cli_t *m, int count, const char *topic[], mqtt_cli_done_pt done, void *ud) {
+    mqtt_cli_cmd_t *cmd;
+
+    cmd = _cmd_new(MQTT_UNSUBSCRIBE, count, topic, 0, 0);
+    cmd->done = done;
+    cmd->ud = ud;
+    return _queue_post(m, cmd);
+}
+
+int
+mqtt_cli_post_puback(mqtt_cli_t *m, mqtt_qos_t qos, uint16_t packet_id, mqtt_cli_done_pt done, void *ud) {
+    mqtt_cli_cmd_t *cmd;
+    const char *none = "";
+
+    cmd = _cmd_new(MQTT_PUBACK, 1, &none, &qos, 0);
+    cmd->packet_id = packet_id;
+    cmd->done = done;
+    cmd->ud = ud;
+    return _queue_post(m, cmd);
+}
+
+void
+mqtt_cli_set_wakeup(mqtt_cli_t *m, mqtt_cli_wakeup_pt wakeup, void *ud) {
+    m->q.ud = ud;
+    atomic_store_explicit(&m->q.wakeup, wakeup, memory_order_release);
+}
+
+int
+mqtt_cli_on(mqtt_cli_t *m, const char *filter, mqtt_cli_callback_pt handler, void *ud) {
+    mqtt_cli_handler_t *h;
+    mqtt_str_t f = MQTT_STR_INITIALIZER;
+
+    if (m->dispatching || !handler)
+        return -1;
+    mqtt_str_from(&f, filter);
+    h = (mqtt_cli_handler_t *)malloc(sizeof *h);
+    h->handler = handler;
+    h->ud = ud;
+    if (mqtt_topic_tree_insert(&m->handlers, &f, h)) {
+        free(h);
+        return -1;
+    }
+    _routes_clear(m);
+    return 0;
+}
+
+int
+mqtt_cli_off(mqtt_cli_t *m, const char *filter, mqtt_cli_callback_pt handler, void *ud) {
+    mqtt_str_t f = MQTT_STR_INITIALIZER;
+    void **values;
+    int i, n;
+
+    if (m->dispatching)
+        return -1;
+    mqtt_str_from(&f, filter);
+    values = mqtt_topic_tree_get(&m->handlers, &f, &n);
+    for (i = 0; i < n; i++) {
+        mqtt_cli_handler_t *h;
+
+        h = (mqtt_cli_handler_t *)values[i];
+        if (h->handler == handler && h->ud == ud) {
+            mqtt_topic_tree_remove(&m->handlers, &f, h);
+            free(h);
+            _routes_clear(m);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static uint64_t
+_conn_random(mqtt_cli_conn_t *c) {
+    uint64_t x;
+
+    x = c->rng;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    c->rng = x;
+    return x;
+}
+
+static void
+_conn_enter(mqtt_cli_conn_t *c, mqtt_cli_state_t state) {
+    mqtt_cli_state_t from;
+    uint64_t spent;
+
+    from = c->state;
+    spent = c->now - c->t_state;
+    c->state = state;
+    c->t_state = c->now;
+    if (c->conf.state)
+        c->conf.state(c, c->conf.ud, from, state, spent);
+}
+
+/* sleep = min(cap, random_between(base, sleep * 3)), spreads out reconnecting clients. */
+static void
+_conn_backoff(mqtt_cli_conn_t *c) {
+    uint64_t hi;
+
+    hi = c->sleep * 3;
+    if (hi < c->conf.backoff_base)
+        hi = c->conf.backoff_base;
+    c->sleep = c->conf.backoff_base + _conn_random(c) % (hi - c->conf.backoff_base + 1);
+    if (c->sleep > c->conf.backoff_cap)
+        c->sleep = c->conf.backoff_cap;
+    c->wakeup = c->now + c->sleep;
+    _conn_enter(c, MQTT_CLI_STATE_DISCONNECTED);
+}
+
+void
+mqtt_cli_conn_init(mqtt_cli_conn_t *c, mqtt_cli_t *m, const mqtt_cli_conn_conf_t *conf) {
+    size_t i;
+
+    memset(c, 0, sizeof *c);
+    c->m = m;
+    if (conf)
+        c->conf = *conf;
+    if (!c->conf.backoff_base)
+        c->conf.backoff_base = 1000;
+    if (c->conf.backoff_cap < c->conf.backoff_base)
+        c->conf.backoff_cap = c->conf.backoff_base * 120;
+    if (!c->conf.connect_timeout)
+        c->conf.connect_timeout = 10000;
+    if (!c->conf.connack_timeout)
+        c->conf.connack_timeout = 10000;
+    if (!c->conf.drain_timeout)
+        c->conf.drain_timeout = 5000;
+    /* mix in the client id so identical gateways do not share a sequence. */
+    c->rng = c->conf.seed ^ 0x9E3779B97F4A7C15ULL;
+    for (i = 0; i < m->client_id.n; i++) {
+        c->rng = (c->rng ^ (uint8_t)m->client_id.s[i]) * 0x100000001B3ULL;
+    }
+    if (!c->rng)
+        c->rng = 0x9E3779B97F4A7C15ULL;
+    c->sleep = c->conf.backoff_base;
+    c->state = MQTT_CLI_STATE_DISCONNECTED;
+}
+
+int
+mqtt_cli_conn_event(mqtt_cli_conn_t *c, mqtt_cli_event_t event) {
+    switch (event) {
+    case MQTT_CLI_EVENT_RESOLVED:
+        if (c->state != MQTT_CLI_STATE_RESOLVING)
+            return -1;
+        _conn_enter(c, MQTT_CLI_STATE_CONNECTING);
+        break;
+    case MQTT_CLI_EVENT_CONNECTED:
+        if (c->state != MQTT_CLI_STATE_RESOLVING && c->state != MQTT_CLI_STATE_CONNECTING)
+            return -1;
+        _conn_enter(c, MQTT_CLI_STATE_CONNACK);
+        return mqtt_cli_connect(c->m);
+    case MQTT_CLI_EVENT_FAILED:
+        c->m->connected = 0;
+        if (c->stopped)
+            _conn_enter(c, MQTT_CLI_STATE_DISCONNECTED);
+        else if (c->state != MQTT_CLI_STATE_DISCONNECTED)
+            _conn_backoff(c);
+        break;
+    case MQTT_CLI_EVENT_STOP:
+        c->stopped = 1;
+        if (c->state == MQTT_CLI_STATE_CONNECTED)
+            _conn_enter(c, MQTT_CLI_STATE_DRAINING);
+        else if (c->state != MQTT_CLI_STATE_DRAINING)
+            _conn_enter(c, MQTT_CLI_STATE_DISCONNECTED);
+        break;
+    default:
+        return -1;
+    }
+    return 0;
+}
+
+int
+mqtt_cli_conn_elapsed(mqtt_cli_conn_t *c, uint64_t time) {
+    uint64_t spent;
+
+    c->now += time;
+    spent = c->now - c->t_state;
+    switch (c->state) {
+    case MQTT_CLI_STATE_DISCONNECTED:
+        if (!c->stopped && c->now >= c->wakeup)
+            _conn_enter(c, MQTT_CLI_STATE_RESOLVING);
+        break;
+    case MQTT_CLI_STATE_RESOLVING:
+    case MQTT_CLI_STATE_CONNECTING:
+        if (spent >= c->conf.connect_timeout)
+            _conn_backoff(c);
+        break;
+    case MQTT_CLI_STATE_CONNACK:
+        if (mqtt_cli_elapsed(c->m, time)) {
+            _conn_backoff(c);
+        } else if (c->m->connected) {
+            c->sleep = c->conf.backoff_base;
+            _conn_enter(c, MQTT_CLI_STATE_CONNECTED);
+        } else if (spent >= c->conf.connack_timeout) {
+            _conn_backoff(c);
+        }
+        break;
+    case MQTT_CLI_STATE_CONNECTED:
+        if (mqtt_cli_elapsed(c->m, time))
+            _conn_backoff(c);
+        break;
+    case MQTT_CLI_STATE_DRAINING:
+        if (mqtt_cli_elapsed(c->m, time)) {
+            _conn_enter(c, MQTT_CLI_STATE_DISCONNECTED);
+        } else if (!c->m->padding || spent >= c->conf.drain_timeout) {
+            mqtt_cli_disconnect(c->m);
+            c->m->connected = 0;
+            _conn_enter(c, MQTT_CLI_STATE_DISCONNECTED);
+        }
+        break;
+    }
+    return c->state == MQTT_CLI_STATE_DISCONNECTED ? -1 : 0;
+}
+
+uint64_t
+mqtt_cli_conn_next_deadline(mqtt_cli_conn_t *c) {
+    uint64_t deadline, limit;
+
+    switch (c->state) {
+    case MQTT_CLI_STATE_DISCONNECTED:
+        if (c->stopped)
+            return UINT64_MAX;
+        return c->wakeup > c->now ? c->wakeup - c->now : 0;
+    case MQTT_CLI_STATE_RESOLVING:
+    case MQTT_CLI_STATE_CONNECTING:
+        limit = c->conf.connect_timeout;
+        break;
+    case MQTT_CLI_STATE_CONNACK:
+        limit = c->conf.connack_timeout;
+        break;
+    case MQTT_CLI_STATE_DRAINING:
+        limit = c->conf.drain_timeout;
+        break;
+    default:
+        return mqtt_cli_next_deadline(c->m);
+    }
+    limit = c->t_state + limit > c->now ? c->t_state + limit - c->now : 0;
+    deadline = mqtt_cli_next_deadline(c->m);
+    return deadline < limit ? deadline : limit;
+}
+
+#endif /* MQTT_CLI_IMPL */
+
+#ifdef MQTT_CLI_LINUX_PLATFORM
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LINUX_TCP_BUFF_SIZE 4096
+#define LINUX_TCP_CONNECT_TIMEOUT 10000
+#define LINUX_TCP_CONNECT_STAGGER 250
+#define LINUX_RESOLVE_ADDRS 8
+#define LINUX_RESOLVE_CACHE_SIZE 8
+#define LINUX_RESOLVE_CACHE_TTL 60000
+
+
+typedef struct {
     int fd;
+    uint64_t timeout;
+    /* eventfd that cuts a receive wait short, -1 if none. */
+    int wakeup;
+    /* transport specific transfer and close, see linux_net_*. */
+    int (*transfer)(void *net, mqtt_str_t *outgoing, mqtt_str_t *incoming);
+    void (*close)(void *net);
     char buff[LINUX_TCP_BUFF_SIZE];
 } linux_tcp_network_t;
 
-void *
-linux_tcp_connect(const char *host, int port) {
-    linux_tcp_network_t *net;
+int linux_tcp_transfer(void *net, mqtt_str_t *outgoing, mqtt_str_t *incoming);
+void linux_tcp_close(void *net);
+
+uint64_t
+linux_time_now() {
+    struct timeval tv;
+
+    gettimeofday(&tv, 0);
+    return (tv.tv_sec * 1000 + tv.tv_usec / 1000);
+}
+
+typedef struct {
+    int n;
+    struct sockaddr_storage addr[LINUX_RESOLVE_ADDRS];
+    socklen_t len[LINUX_RESOLVE_ADDRS];
+} linux_addrs_t;
+
+/* a getaddrinfo call on a helper thread, shared by the caller and the thread. */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int refs;
+    int done;
+    char *host;
+    int port;
+    linux_addrs_t addrs;
+} linux_resolve_t;
+
+static pthread_mutex_t linux_resolve_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+    struct {
+        char host[256];
+        int port;
+        uint64_t expire;
+        linux_addrs_t addrs;
+    } entry[LINUX_RESOLVE_CACHE_SIZE];
+} linux_resolve_cache;
+
+static int
+_linux_resolve_cached(const char *host, int port, linux_addrs_t *addrs, int store) {
+    uint64_t now;
+    int i, slot;
+
+    now = linux_time_now();
+    slot = 0;
+    pthread_mutex_lock(&linux_resolve_lock);
+    for (i = 0; i < LINUX_RESOLVE_CACHE_SIZE; i++) {
+        if (linux_resolve_cache.entry[i].port == port && !strcmp(linux_resolve_cache.entry[i].host, host))
+            break;
+        if (linux_resolve_cache.entry[i].expire < linux_resolve_cache.entry[slot].expire)
+            slot = i;
+    }
+    if (store) {
+        if (i < LINUX_RESOLVE_CACHE_SIZE)
+            slot = i;
+        snprintf(linux_resolve_cache.entry[slot].host, sizeof(linux_resolve_cache.entry[slot].host), "%s", host);
+        linux_resolve_cache.entry[slot].port = port;
+        linux_resolve_cache.entry[slot].expire = now + LINUX_RESOLVE_CACHE_TTL;
+        linux_resolve_cache.entry[slot].addrs = *addrs;
+    } else if (i < LINUX_RESOLVE_CACHE_SIZE && linux_resolve_cache.entry[i].expire > now) {
+        *addrs = linux_resolve_cache.entry[i].addrs;
+    } else {
+        i = -1;
+    }
+    pthread_mutex_unlock(&linux_resolve_lock);
+    return i < LINUX_RESOLVE_CACHE_SIZE ? i : -1;
+}
+
+void
+linux_resolve_release(linux_resolve_t *r) {
+    int refs;
+
+    pthread_mutex_lock(&r->lock);
+    refs = --r->refs;
+    pthread_mutex_unlock(&r->lock);
+    if (refs == 0) {
+        pthread_mutex_destroy(&r->lock);
+        pthread_cond_destroy(&r->cond);
+        free(r->host);
+        free(r);
+    }
+}
+
+static void *
+_linux_resolve_thread(void *arg) {
+    linux_resolve_t *r;
     struct addrinfo hints, *servinfo, *p;
-    char ip[16];
+    linux_addrs_t addrs;
     char portstr[6];
-    int fd, rc;
+    int rc, family;
 
+    r = (linux_resolve_t *)arg;
     memset(&hints, 0, sizeof hints);
     hints.ai_socktype = SOCK_STREAM;
-    hints.ai_family = AF_INET;
+    hints.ai_family = AF_UNSPEC;
     hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_flags = AI_ADDRCONFIG;
 
-    fd = -1;
-    snprintf(portstr, sizeof(portstr), "%d", port);
-    if ((rc = getaddrinfo(host, portstr, &hints, &servinfo)) != 0) {
-        fprintf(stderr, "getaddrinfo %s e: %s\n", host, gai_strerror(rc));
-        return 0;
+    addrs.n = 0;
+    snprintf(portstr, sizeof(portstr), "%d", r->port);
+    if ((rc = getaddrinfo(r->host, portstr, &hints, &servinfo)) != 0) {
+        fprintf(stderr, "getaddrinfo %s e: %s\n", r->host, gai_strerror(rc));
+    } else {
+        /* keep the preferred order but alternate address families. */
+        family = servinfo->ai_family;
+        while (addrs.n < LINUX_RESOLVE_ADDRS) {
+            for (p = servinfo; p; p = p->ai_next) {
+                if (p->ai_family == family && p->ai_addrlen <= sizeof(addrs.addr[0]))
+                    break;
+            }
+            if (!p) {
+                family = family == AF_INET6 ? AF_INET : AF_INET6;
+                for (p = servinfo; p; p = p->ai_next) {
+                    if (p->ai_family == family && p->ai_addrlen <= sizeof(addrs.addr[0]))
+                        break;
+                }
+                if (!p)
+                    break;
+            }
+            memcpy(&addrs.addr[addrs.n], p->ai_addr, p->ai_addrlen);
+            addrs.len[addrs.n] = p->ai_addrlen;
+            addrs.n++;
+            p->ai_family = AF_UNSPEC;
+            family = family == AF_INET6 ? AF_INET : AF_INET6;
+        }
+        freeaddrinfo(servinfo);
+        if (addrs.n > 0)
+            _linux_resolve_cached(r->host, r->port, &addrs, 1);
+    }
+
+    pthread_mutex_lock(&r->lock);
+    r->addrs = addrs;
+    r->done = addrs.n > 0 ? 1 : -1;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    linux_resolve_release(r);
+    return 0;
+}
+
+/**
+ * start resolving host, answered from a short lived cache when possible.
+ */
+linux_resolve_t *
+linux_resolve_start(const char *host, int port) {
+    linux_resolve_t *r;
+    pthread_t tid;
+
+    r = (linux_resolve_t *)malloc(sizeof *r);
+    memset(r, 0, sizeof *r);
+    pthread_mutex_init(&r->lock, 0);
+    pthread_cond_init(&r->cond, 0);
+    r->refs = 1;
+    r->host = strdup(host);
+    r->port = port;
+    if (_linux_resolve_cached(host, port, &r->addrs, 0) >= 0) {
+        r->done = 1;
+        return r;
+    }
+    r->refs++;
+    if (pthread_create(&tid, 0, _linux_resolve_thread, r)) {
+        r->refs--;
+        r->done = -1;
+        return r;
+    }
+    pthread_detach(tid);
+    return r;
+}
+
+/**
+ * wait up to timeout milliseconds, 1 when resolved, 0 while pending, -1 on failure.
+ */
+int
+linux_resolve_wait(linux_resolve_t *r, uint64_t timeout) {
+    struct timespec ts;
+    int done;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout / 1000;
+    ts.tv_nsec += (timeout % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&r->lock);
+    while (!r->done) {
+        if (pthread_cond_timedwait(&r->cond, &r->lock, &ts) == ETIMEDOUT)
+            break;
+    }
+    done = r->done;
+    pthread_mutex_unlock(&r->lock);
+    return done;
+}
+
+/* parallel connect attempts, a new one every LINUX_TCP_CONNECT_STAGGER ms. */
+typedef struct {
+    linux_addrs_t addrs;
+    int next;
+    int n;
+    int fds[LINUX_RESOLVE_ADDRS];
+    uint64_t t_next;
+} linux_tcp_connector_t;
+
+linux_tcp_connector_t *
+linux_tcp_connector_start(linux_resolve_t *r) {
+    linux_tcp_connector_t *c;
+
+    c = (linux_tcp_connector_t *)malloc(sizeof *c);
+    memset(c, 0, sizeof *c);
+    pthread_mutex_lock(&r->lock);
+    c->addrs = r->addrs;
+    pthread_mutex_unlock(&r->lock);
+    c->t_next = linux_time_now();
+    return c;
+}
+
+void
+linux_tcp_connector_close(linux_tcp_connector_t *c) {
+    int i;
+
+    for (i = 0; i < c->n; i++) {
+        close(c->fds[i]);
     }
-    for (p = servinfo; p; p = p->ai_next) {
-        struct timeval timeout = {1, 0};
-        int on = 1;
+    free(c);
+}
+
+static void *
+_linux_tcp_network(int fd, int nodelay) {
+    linux_tcp_network_t *net;
+    struct timeval timeout = {1, 0};
+    int on = 1;
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (nodelay)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    net = (linux_tcp_network_t *)malloc(sizeof *net);
+    memset(net, 0, sizeof *net);
+
+    net->fd = fd;
+    net->timeout = 1000;
+    net->wakeup = -1;
+    net->transfer = linux_tcp_transfer;
+    net->close = linux_tcp_close;
+
+    return net;
+}
 
-        if ((rc = getnameinfo(p->ai_addr, p->ai_addrlen, ip, sizeof(ip), portstr, sizeof(portstr),
-                              NI_NUMERICHOST | NI_NUMERICSERV)) != 0) {
+static void
+_linux_tcp_connector_drop(linux_tcp_connector_t *c, int i) {
+    close(c->fds[i]);
+    c->fds[i] = c->fds[--c->n];
+}
+
+/**
+ * poll the attempts for up to timeout milliseconds, returns the network of
+ * the first connected address, 0 while pending with errno EINPROGRESS,
+ * 0 with another errno once every address failed.
+ */
+void *
+linux_tcp_connector_poll(linux_tcp_connector_t *c, uint64_t timeout) {
+    uint64_t now, end;
+    int polled;
+
+    polled = 0;
+    now = linux_time_now();
+    end = now + timeout;
+    while (1) {
+        struct pollfd pfd[LINUX_RESOLVE_ADDRS];
+        uint64_t wait;
+        int i, rc;
+
+        if (c->next < c->addrs.n && (now >= c->t_next || c->n == 0)) {
+            struct sockaddr *addr;
+            int fd;
+
+            addr = (struct sockaddr *)&c->addrs.addr[c->next];
+            fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+            if (fd != -1) {
+                rc = connect(fd, addr, c->addrs.len[c->next]);
+                if (rc == 0) {
+                    for (i = 0; i < c->n; i++) {
+                        close(c->fds[i]);
+                    }
+                    c->n = 0;
+                    return _linux_tcp_network(fd, 1);
+                }
+                if (errno == EINPROGRESS)
+                    c->fds[c->n++] = fd;
+                else
+                    close(fd);
+            }
+            c->next++;
+            c->t_next = now + LINUX_TCP_CONNECT_STAGGER;
             continue;
         }
-        if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
-            continue;
+        if (c->n == 0) {
+            if (errno == EINPROGRESS)
+                errno = ECONNREFUSED;
+            return 0;
         }
-        if (connect(fd, p->ai_addr, p->ai_addrlen) == -1) {
-            close(fd);
-            fd = -1;
-            continue;
+        /* a zero timeout still looks at the attempts once. */
+        if (polled && now >= end) {
+            errno = EINPROGRESS;
+            return 0;
         }
-        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
-        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        wait = end > now ? end - now : 0;
+        if (c->next < c->addrs.n && c->t_next - now < wait)
+            wait = c->t_next > now ? c->t_next - now : 0;
+        for (i = 0; i < c->n; i++) {
+            pfd[i].fd = c->fds[i];
+            pfd[i].events = POLLOUT;
+            pfd[i].revents = 0;
+        }
+        rc = poll(pfd, c->n, (int)wait);
+        polled = 1;
+        for (i = c->n - 1; rc > 0 && i >= 0; i--) {
+            int err;
+            socklen_t len;
+
+            if (!pfd[i].revents)
+                continue;
+            err = 0;
+            len = sizeof(err);
+            getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err == 0) {
+                int fd;
+
+                fd = c->fds[i];
+                c->fds[i] = c->fds[--c->n];
+                for (i = 0; i < c->n; i++) {
+                    close(c->fds[i]);
+                }
+                c->n = 0;
+                return _linux_tcp_network(fd, 1);
+            }
+            errno = err;
+            _linux_tcp_connector_drop(c, i);
+            /* a failed attempt starts the next one right away. */
+            c->t_next = 0;
+        }
+        now = linux_time_now();
     }
-    freeaddrinfo(servinfo);
+}
+
+/**
+ * connect to a unix domain stream socket, a leading '@' names an abstract
+ * socket. the network has the same contract as a tcp one.
+ */
+void *
+linux_unix_connect(const char *path) {
+    struct sockaddr_un addr;
+    socklen_t len;
+    size_t n;
+    int fd;
 
-    if (fd == -1) {
+    n = strlen(path);
+    if (n == 0 || n >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
         return 0;
     }
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, n);
+    if (path[0] == '@')
+        addr.sun_path[0] = '\0';
+    len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + n + (path[0] == '@' ? 0 : 1));
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+        return 0;
+    if (connect(fd, (struct sockaddr *)&addr, len) == -1) {
+        int e;
 
-    net = (linux_tcp_network_t *)malloc(sizeof *net);
-    memset(net, 0, sizeof *net);
+        e = errno;
+        close(fd);
+        errno = e;
+        return 0;
+    }
+    return _linux_tcp_network(fd, 0);
+}
 
-    net->fd = fd;
+void *
+linux_tcp_connect(const char *host, int port) {
+    linux_resolve_t *r;
+    linux_tcp_connector_t *c;
+    void *net;
+    int rc;
 
+    r = linux_resolve_start(host, port);
+    rc = linux_resolve_wait(r, LINUX_TCP_CONNECT_TIMEOUT);
+    if (rc <= 0) {
+        linux_resolve_release(r);
+        errno = rc ? EHOSTUNREACH : ETIMEDOUT;
+        return 0;
+    }
+    c = linux_tcp_connector_start(r);
+    linux_resolve_release(r);
+    net = linux_tcp_connector_poll(c, LINUX_TCP_CONNECT_TIMEOUT);
+    if (!net && errno == EINPROGRESS)
+        errno = ETIMEDOUT;
+    linux_tcp_connector_close(c);
     return net;
 }
 
+/**
+ * bound how long linux_tcp_transfer waits for incoming data, in milliseconds.
+ */
+void
+linux_tcp_timeout(void *net, uint64_t timeout) {
+    linux_tcp_network_t *n;
+    struct timeval tv;
+
+    n = (linux_tcp_network_t *)net;
+    if (timeout == 0)
+        timeout = 1;
+    if (timeout == n->timeout)
+        return;
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+    setsockopt(n->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    n->timeout = timeout;
+}
+
+/**
+ * let a write to the eventfd wakeup end the wait in linux_tcp_transfer.
+ */
+void
+linux_tcp_wakeup(void *net, int wakeup) {
+    ((linux_tcp_network_t *)net)->wakeup = wakeup;
+}
+
 ssize_t
 linux_tcp_send(void *net, const void *data, size_t size) {
     int fd;
@@ -685,10 +2774,32 @@ linux_tcp_send(void *net, const void *data, size_t size) {
 
 ssize_t
 linux_tcp_recv(void *net, void *data, size_t size) {
+    linux_tcp_network_t *n;
     int fd;
     ssize_t nrecv;
 
-    fd = ((linux_tcp_network_t *)net)->fd;
+    n = (linux_tcp_network_t *)net;
+    fd = n->fd;
+    if (n->wakeup >= 0) {
+        struct pollfd pfd[2];
+
+        pfd[0].fd = fd;
+        pfd[0].events = POLLIN;
+        pfd[0].revents = 0;
+        pfd[1].fd = n->wakeup;
+        pfd[1].events = POLLIN;
+        pfd[1].revents = 0;
+        if (poll(pfd, 2, (int)n->timeout) < 0 && errno != EINTR)
+            return -1;
+        if (pfd[1].revents & POLLIN) {
+            uint64_t v;
+
+            if (read(n->wakeup, &v, sizeof v) < 0 && errno != EAGAIN)
+                return -1;
+        }
+        if (!pfd[0].revents)
+            return 0;
+    }
     nrecv = recv(fd, data, size, 0);
     if (nrecv == 0)
         return -1;
@@ -709,7 +2820,6 @@ linux_tcp_transfer(void *net, mqtt_str_t *outgoing, mqtt_str_t *incoming) {
         ssize_t nsend;
 
         nsend = linux_tcp_send(net, outgoing->s, outgoing->n);
-        mqtt_str_free(outgoing);
         if (nsend < 0) {
             return -1;
         }
@@ -733,12 +2843,977 @@ linux_tcp_close(void *net) {
     free(net);
 }
 
-uint64_t
-linux_time_now() {
-    struct timeval tv;
+int
+linux_net_transfer(void *net, mqtt_str_t *outgoing, mqtt_str_t *incoming) {
+    return ((linux_tcp_network_t *)net)->transfer(net, outgoing, incoming);
+}
 
-    gettimeofday(&tv, 0);
-    return (tv.tv_sec * 1000 + tv.tv_usec / 1000);
+void
+linux_net_close(void *net) {
+    ((linux_tcp_network_t *)net)->close(net);
+}
+
+#ifdef MQTT_CLI_LINUX_WEBSOCKET
+
+#include "libhttp.h"
+#include "websocket.h"
+
+#include <sys/random.h>
+
+#define LINUX_WS_HANDSHAKE_TIMEOUT 10000
+
+typedef struct {
+    linux_tcp_network_t tcp;
+    websocket_decoder_t decoder;
+    size_t pending;
+    char *tx;
+    size_t tx_size;
+} linux_ws_network_t;
+
+static int
+_linux_ws_send(linux_ws_network_t *ws, int opcode, const char *data, size_t n) {
+    unsigned char mask[4];
+    size_t hn;
+
+    if (n + WEBSOCKET_HEADER_MAX > ws->tx_size) {
+        ws->tx_size = n + WEBSOCKET_HEADER_MAX;
+        ws->tx = (char *)realloc(ws->tx, ws->tx_size);
+    }
+    if (getrandom(mask, sizeof mask, 0) != sizeof mask)
+        memset(mask, 0x5A, sizeof mask);
+    hn = websocket_frame_header((unsigned char *)ws->tx, opcode, n, mask);
+    memcpy(ws->tx + hn, data, n);
+    websocket_mask(ws->tx + hn, n, mask, 0);
+    return linux_tcp_send(ws, ws->tx, hn + n) < 0 ? -1 : 0;
+}
+
+int
+linux_ws_transfer(void *net, mqtt_str_t *outgoing, mqtt_str_t *incoming) {
+    linux_ws_network_t *ws;
+    const char *in;
+    size_t n, out_n;
+    int rc;
+
+    ws = (linux_ws_network_t *)net;
+    if (!mqtt_str_empty(outgoing)) {
+        if (_linux_ws_send(ws, WEBSOCKET_OP_BINARY, outgoing->s, outgoing->n))
+            return -1;
+    }
+
+    if (ws->pending) {
+        n = ws->pending;
+        ws->pending = 0;
+    } else {
+        ssize_t nrecv;
+
+        nrecv = linux_tcp_recv(net, ws->tcp.buff, LINUX_TCP_BUFF_SIZE);
+        if (nrecv < 0)
+            return -1;
+        n = (size_t)nrecv;
+    }
+
+    /* unframe in place, answering control frames on the way. */
+    in = ws->tcp.buff;
+    out_n = 0;
+    while ((rc = websocket_decode(&ws->decoder, &in, &n, ws->tcp.buff, &out_n)) > 0) {
+        if (rc == WEBSOCKET_OP_CLOSE)
+            return -1;
+        if (rc == WEBSOCKET_OP_PING) {
+            if (_linux_ws_send(ws, WEBSOCKET_OP_PONG, (const char *)ws->decoder.control, ws->decoder.control_n))
+                return -1;
+        }
+    }
+    if (rc < 0)
+        return -1;
+    mqtt_str_init(incoming, ws->tcp.buff, out_n);
+    return 0;
+}
+
+void
+linux_ws_close(void *net) {
+    linux_ws_network_t *ws;
+
+    ws = (linux_ws_network_t *)net;
+    _linux_ws_send(ws, WEBSOCKET_OP_CLOSE, "\x03\xe8", 2);
+    if (ws->tx)
+        free(ws->tx);
+    linux_tcp_close(net);
+}
+
+/**
+ * upgrade a connected tcp network to websocket, net is consumed either way.
+ */
+void *
+linux_ws_upgrade(void *net, const char *host, const char *path) {
+    struct libhttp_request *req;
+    struct libhttp_response *res;
+    struct libhttp_buf buf;
+    linux_ws_network_t *ws;
+    unsigned char nonce[16];
+    char key[25], accept[29], *end;
+    const char *value;
+    size_t n;
+    uint64_t t;
+    int rc;
+
+    if (getrandom(nonce, sizeof nonce, 0) != sizeof nonce) {
+        linux_tcp_close(net);
+        return 0;
+    }
+    websocket_key(nonce, key);
+    websocket_accept(key, accept);
+
+    req = request_api.create();
+    request_api.set_method(req, "GET");
+    url_api.set_path(request_api.url(req), path);
+    request_api.set_header(req, "Host", host);
+    request_api.set_header(req, "Upgrade", "websocket");
+    request_api.set_header(req, "Connection", "Upgrade");
+    request_api.set_header(req, "Sec-WebSocket-Key", key);
+    request_api.set_header(req, "Sec-WebSocket-Version", "13");
+    request_api.set_header(req, "Sec-WebSocket-Protocol", "mqtt");
+    buf = request_api.build(req);
+    request_api.destroy(req);
+    rc = linux_tcp_send(net, buf.data, buf.size) < 0 ? -1 : 0;
+    free(buf.data);
+    if (rc) {
+        linux_tcp_close(net);
+        return 0;
+    }
+
+    /* read up to the end of the response headers, frames may follow. */
+    n = 0;
+    end = 0;
+    t = linux_time_now();
+    while (!end && n < LINUX_TCP_BUFF_SIZE - 1 && linux_time_now() - t < LINUX_WS_HANDSHAKE_TIMEOUT) {
+        ssize_t nrecv;
+        char *buff;
+
+        buff = ((linux_tcp_network_t *)net)->buff;
+        nrecv = linux_tcp_recv(net, buff + n, LINUX_TCP_BUFF_SIZE - 1 - n);
+        if (nrecv < 0)
+            break;
+        n += nrecv;
+        buff[n] = '\0';
+        end = strstr(buff, "\r\n\r\n");
+    }
+    if (!end) {
+        linux_tcp_close(net);
+        return 0;
+    }
+    end += 4;
+
+    res = response_api.create();
+    buf.data = ((linux_tcp_network_t *)net)->buff;
+    buf.size = (int)(end - buf.data);
+    rc = response_api.parse(res, buf);
+    if (rc >= 0 && response_api.status(res) == 101) {
+        value = response_api.header(res, "Upgrade");
+        if (!value || strcasecmp(value, "websocket"))
+            rc = -1;
+        value = response_api.header(res, "Sec-WebSocket-Accept");
+        if (!value || strcmp(value, accept))
+            rc = -1;
+    } else {
+        fprintf(stderr, "linux_ws_upgrade(): status %d\n", response_api.status(res));
+        rc = -1;
+    }
+    response_api.destroy(res);
+    if (rc < 0) {
+        linux_tcp_close(net);
+        return 0;
+    }
+
+    /* keep what followed the headers, it is the first websocket data. */
+    n -= end - ((linux_tcp_network_t *)net)->buff;
+    memmove(((linux_tcp_network_t *)net)->buff, end, n);
+    ws = (linux_ws_network_t *)realloc(net, sizeof *ws);
+    websocket_decoder_init(&ws->decoder, 0);
+    ws->pending = n;
+    ws->tx = 0;
+    ws->tx_size = 0;
+    ws->tcp.transfer = linux_ws_transfer;
+    ws->tcp.close = linux_ws_close;
+    return ws;
+}
+
+#endif /* MQTT_CLI_LINUX_WEBSOCKET */
+
+typedef enum {
+    LINUX_URL_TCP,
+    LINUX_URL_WS,
+    LINUX_URL_UNIX,
+} linux_url_scheme_t;
+
+typedef struct {
+    linux_url_scheme_t scheme;
+    char host[256];
+    int port;
+    const char *path;
+} linux_url_t;
+
+/* host, host:port, ws://host[:port][/path] or unix:///path, ipv6 literals in brackets. */
+static int
+_linux_url_parse(linux_url_t *u, const char *url, int port) {
+    const char *p, *e;
+    size_t n;
+
+    memset(u, 0, sizeof *u);
+    u->port = port;
+    p = url;
+    if (!strncmp(p, "unix://", 7)) {
+        u->scheme = LINUX_URL_UNIX;
+        u->path = p + 7;
+        return *u->path ? 0 : -1;
+    } else if (!strncmp(p, "ws://", 5)) {
+        u->scheme = LINUX_URL_WS;
+        u->port = 80;
+        u->path = "/mqtt";
+        p += 5;
+    } else if (!strncmp(p, "mqtt://", 7) || !strncmp(p, "tcp://", 6)) {
+        p = strstr(p, "://") + 3;
+    } else if (strstr(p, "://")) {
+        return -1;
+    }
+    if (*p == '[') {
+        e = strchr(++p, ']');
+        if (!e)
+            return -1;
+        n = e++ - p;
+    } else {
+        e = p + strcspn(p, ":/");
+        n = e - p;
+    }
+    if (n == 0 || n >= sizeof(u->host))
+        return -1;
+    memcpy(u->host, p, n);
+    if (*e == ':') {
+        u->port = atoi(e + 1);
+        e += strcspn(e, "/");
+    }
+    if (*e == '/' && u->scheme == LINUX_URL_WS)
+        u->path = e;
+    return 0;
+}
+
+static void
+_linux_cli_wakeup(void *ud) {
+    uint64_t v;
+    ssize_t n;
+
+    v = 1;
+    n = write((int)(intptr_t)ud, &v, sizeof v);
+    (void)n;
+}
+
+/**
+ * drive c until it is stopped, reconnecting with backoff. host is a name,
+ * host:port, a unix:// url, or a ws:// url when built with
+ * MQTT_CLI_LINUX_WEBSOCKET.
+ */
+int
+linux_cli_run(mqtt_cli_conn_t *c, const char *host, int port) {
+    linux_resolve_t *resolve;
+    linux_tcp_connector_t *connector;
+    linux_url_t url;
+    void *net;
+    uint64_t t1, t2, deadline;
+    int rc, wakeup;
+
+    if (_linux_url_parse(&url, host, port)) {
+        fprintf(stderr, "linux_cli_run(): bad url %s\n", host);
+        return -1;
+    }
+#ifndef MQTT_CLI_LINUX_WEBSOCKET
+    if (url.scheme == LINUX_URL_WS) {
+        fprintf(stderr, "linux_cli_run(): %s needs MQTT_CLI_LINUX_WEBSOCKET\n", host);
+        return -1;
+    }
+#endif
+    net = 0;
+    resolve = 0;
+    connector = 0;
+    /* posting threads write the eventfd to end the receive wait early. */
+    wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wakeup >= 0)
+        mqtt_cli_set_wakeup(c->m, _linux_cli_wakeup, (void *)(intptr_t)wakeup);
+    t1 = linux_time_now();
+    while (1) {
+        mqtt_str_t outgoing, incoming;
+
+        switch (c->state) {
+        case MQTT_CLI_STATE_DISCONNECTED:
+            if (net) {
+                if (c->stopped) {
+                    mqtt_cli_outgoing(c->m, &outgoing);
+                    if (!mqtt_str_empty(&outgoing))
+                        linux_net_transfer(net, &outgoing, &incoming);
+                }
+                linux_net_close(net);
+                net = 0;
+            }
+            /* a timed out resolve or connect is abandoned here. */
+            if (resolve) {
+                linux_resolve_release(resolve);
+                resolve = 0;
+            }
+            if (connector) {
+                linux_tcp_connector_close(connector);
+                connector = 0;
+            }
+            if (c->stopped) {
+                if (wakeup >= 0) {
+                    mqtt_cli_set_wakeup(c->m, 0, 0);
+                    close(wakeup);
+                }
+                return 0;
+            }
+            deadline = mqtt_cli_conn_next_deadline(c);
+            usleep((deadline < 1000 ? deadline : 1000) * 1000);
+            break;
+        case MQTT_CLI_STATE_RESOLVING:
+            if (url.scheme == LINUX_URL_UNIX) {
+                mqtt_cli_conn_event(c, MQTT_CLI_EVENT_RESOLVED);
+                break;
+            }
+            if (!resolve)
+                resolve = linux_resolve_start(url.host, url.port);
+            deadline = mqtt_cli_conn_next_deadline(c);
+            rc = linux_resolve_wait(resolve, deadline < 1000 ? deadline : 1000);
+            if (rc > 0) {
+                connector = linux_tcp_connector_start(resolve);
+                mqtt_cli_conn_event(c, MQTT_CLI_EVENT_RESOLVED);
+            } else if (rc < 0) {
+                fprintf(stderr, "linux_resolve_wait(): %s failed\n", url.host);
+                mqtt_cli_conn_event(c, MQTT_CLI_EVENT_FAILED);
+            }
+            if (rc) {
+                linux_resolve_release(resolve);
+                resolve = 0;
+            }
+            break;
+        case MQTT_CLI_STATE_CONNECTING:
+            if (url.scheme == LINUX_URL_UNIX) {
+                net = linux_unix_connect(url.path);
+                if (net) {
+                    linux_tcp_wakeup(net, wakeup);
+                    mqtt_cli_conn_event(c, MQTT_CLI_EVENT_CONNECTED);
+                } else {
+                    fprintf(stderr, "linux_unix_connect(): %s: %s\n", url.path, strerror(errno));
+                    mqtt_cli_conn_event(c, MQTT_CLI_EVENT_FAILED);
+                }
+                break;
+            }
+            deadline = mqtt_cli_conn_next_deadline(c);
+            net = linux_tcp_connector_poll(connector, deadline < 1000 ? deadline : 1000);
+            if (net || errno != EINPROGRESS) {
+                linux_tcp_connector_close(connector);
+                connector = 0;
+            }
+#ifdef MQTT_CLI_LINUX_WEBSOCKET
+            if (net && url.scheme == LINUX_URL_WS) {
+                char authority[300];
+
+                if (url.port == 80)
+                    snprintf(authority, sizeof(authority), "%s", url.host);
+                else if (strchr(url.host, ':'))
+                    snprintf(authority, sizeof(authority), "[%s]:%d", url.host, url.port);
+                else
+                    snprintf(authority, sizeof(authority), "%s:%d", url.host, url.port);
+                net = linux_ws_upgrade(net, authority, url.path);
+                if (!net)
+                    errno = EPROTO;
+            }
+#endif
+            if (net) {
+                linux_tcp_wakeup(net, wakeup);
+                mqtt_cli_conn_event(c, MQTT_CLI_EVENT_CONNECTED);
+            } else if (errno != EINPROGRESS) {
+                fprintf(stderr, "linux_tcp_connect(): %s\n", strerror(errno));
+                mqtt_cli_conn_event(c, MQTT_CLI_EVENT_FAILED);
+            }
+            break;
+        default:
+            mqtt_cli_outgoing(c->m, &outgoing);
+            deadline = mqtt_cli_conn_next_deadline(c);
+            linux_tcp_timeout(net, deadline < 1000 ? deadline : 1000);
+            if (linux_net_transfer(net, &outgoing, &incoming) || mqtt_cli_incoming(c->m, &incoming))
+                mqtt_cli_conn_event(c, MQTT_CLI_EVENT_FAILED);
+            break;
+        }
+        t2 = linux_time_now();
+        mqtt_cli_conn_elapsed(c, t2 - t1);
+        t1 = t2;
+    }
+}
+
+#ifdef MQTT_CLI_LINUX_LOOP
+
+/*
+ * event loop for many connections, io_uring when the kernel offers it,
+ * epoll otherwise. each connection keeps one multishot recv fed from a ring
+ * of provided buffers, and every outgoing buffer of every connection is
+ * submitted with the wait in a single io_uring_enter.
+ */
+
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define LINUX_LOOP_ENTRIES 1024
+#define LINUX_LOOP_BUFS 256
+#define LINUX_LOOP_BUF_SIZE 4096
+#define LINUX_LOOP_BGID 1
+
+typedef struct linux_loop_s linux_loop_t;
+
+/* called once a connection is gone, m is no longer driven by the loop. */
+typedef void (*linux_loop_close_pt)(linux_loop_t *l, mqtt_cli_t *m, void *ud);
+
+typedef struct linux_loop_conn_s {
+    int fd;
+    mqtt_cli_t *m;
+    void *ud;
+    mqtt_str_t out;
+    size_t sent;
+    int sending;
+    int recving;
+    int closing;
+    int shut;
+    struct linux_loop_conn_s *next;
+} linux_loop_conn_t;
+
+struct linux_loop_s {
+    int uring;
+    int epfd;
+    uint64_t t;
+    linux_loop_conn_t *conns;
+    linux_loop_close_pt on_close;
+    void *ud;
+
+    struct {
+        int fd;
+        unsigned *sq_head;
+        unsigned *sq_tail;
+        unsigned *sq_mask;
+        unsigned *sq_array;
+        unsigned *cq_head;
+        unsigned *cq_tail;
+        unsigned *cq_mask;
+        struct io_uring_sqe *sqes;
+        struct io_uring_cqe *cqes;
+        void *sq_ring;
+        void *cq_ring;
+        size_t sq_ring_size;
+        size_t cq_ring_size;
+        size_t sqes_size;
+        unsigned to_submit;
+        struct io_uring_buf_ring *br;
+        size_t br_size;
+        char *bufs;
+    } ring;
+
+    char buff[LINUX_LOOP_BUF_SIZE];
+};
+
+static int
+_linux_uring_enter(linux_loop_t *l, unsigned wait, uint64_t timeout) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags;
+    int rc;
+
+    flags = 0;
+    memset(&arg, 0, sizeof arg);
+    if (wait) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    }
+    rc = (int)syscall(__NR_io_uring_enter, l->ring.fd, l->ring.to_submit, wait, flags, wait ? &arg : 0,
+                      wait ? sizeof arg : 0);
+    if (rc >= 0) {
+        l->ring.to_submit -= (unsigned)rc < l->ring.to_submit ? (unsigned)rc : l->ring.to_submit;
+        return 0;
+    }
+    return errno == ETIME || errno == EINTR || errno == EBUSY ? 0 : -1;
+}
+
+static struct io_uring_sqe *
+_linux_uring_sqe(linux_loop_t *l) {
+    struct io_uring_sqe *sqe;
+    unsigned head, tail;
+
+    tail = *l->ring.sq_tail;
+    head = __atomic_load_n(l->ring.sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head > *l->ring.sq_mask) {
+        _linux_uring_enter(l, 0, 0);
+        head = __atomic_load_n(l->ring.sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head > *l->ring.sq_mask)
+            return 0;
+    }
+    sqe = &l->ring.sqes[tail & *l->ring.sq_mask];
+    memset(sqe, 0, sizeof *sqe);
+    l->ring.sq_array[tail & *l->ring.sq_mask] = tail & *l->ring.sq_mask;
+    __atomic_store_n(l->ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    l->ring.to_submit++;
+    return sqe;
+}
+
+static void
+_linux_uring_provide(linux_loop_t *l, unsigned short bid) {
+    struct io_uring_buf *buf;
+    unsigned short tail;
+
+    tail = l->ring.br->tail;
+    buf = &l->ring.br->bufs[tail & (LINUX_LOOP_BUFS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(l->ring.bufs + (size_t)bid * LINUX_LOOP_BUF_SIZE);
+    buf->len = LINUX_LOOP_BUF_SIZE;
+    buf->bid = bid;
+    __atomic_store_n(&l->ring.br->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+/*
+ * multishot recv came with 6.0, the buffer ring with 5.19: arm one on a
+ * socketpair, between the two every recv would fail with -EINVAL.
+ */
+static int
+_linux_uring_probe(linux_loop_t *l) {
+    struct io_uring_sqe *sqe;
+    uint64_t t;
+    int sv[2], ok, done;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv))
+        return -1;
+    sqe = _linux_uring_sqe(l);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sv[0];
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = LINUX_LOOP_BGID;
+    ok = 0;
+    done = write(sv[1], "", 1) != 1;
+    t = linux_time_now();
+    while (!done && linux_time_now() - t < 1000) {
+        unsigned head, tail;
+
+        if (_linux_uring_enter(l, 1, 100))
+            break;
+        head = *l->ring.cq_head;
+        tail = __atomic_load_n(l->ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe;
+
+            cqe = &l->ring.cqes[head & *l->ring.cq_mask];
+            if (cqe->flags & IORING_CQE_F_BUFFER)
+                _linux_uring_provide(l, (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT));
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                done = 1;
+            } else if (cqe->res > 0) {
+                /* it is armed and delivered, end it the way a peer would. */
+                ok = 1;
+                shutdown(sv[0], SHUT_RDWR);
+            }
+        }
+        __atomic_store_n(l->ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    close(sv[0]);
+    close(sv[1]);
+    return ok && done ? 0 : -1;
+}
+
+static int
+_linux_uring_init(linux_loop_t *l) {
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    unsigned char *sq, *cq;
+    int i;
+
+    memset(&p, 0, sizeof p);
+    l->ring.fd = (int)syscall(__NR_io_uring_setup, LINUX_LOOP_ENTRIES, &p);
+    if (l->ring.fd < 0)
+        return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+        close(l->ring.fd);
+        return -1;
+    }
+
+    l->ring.sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    l->ring.cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (l->ring.cq_ring_size > l->ring.sq_ring_size)
+        l->ring.sq_ring_size = l->ring.cq_ring_size;
+    l->ring.sq_ring = mmap(0, l->ring.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, l->ring.fd,
+                           IORING_OFF_SQ_RING);
+    if (l->ring.sq_ring == MAP_FAILED) {
+        close(l->ring.fd);
+        return -1;
+    }
+    l->ring.cq_ring = l->ring.sq_ring;
+    l->ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    l->ring.sqes = (struct io_uring_sqe *)mmap(0, l->ring.sqes_size, PROT_READ | PROT_WRITE,
+                                               MAP_SHARED | MAP_POPULATE, l->ring.fd, IORING_OFF_SQES);
+    if (l->ring.sqes == MAP_FAILED) {
+        munmap(l->ring.sq_ring, l->ring.sq_ring_size);
+        close(l->ring.fd);
+        return -1;
+    }
+    sq = (unsigned char *)l->ring.sq_ring;
+    cq = (unsigned char *)l->ring.cq_ring;
+    l->ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+    l->ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    l->ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    l->ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    l->ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+    l->ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    l->ring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    l->ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    /* provided buffer ring shared by the multishot receives. */
+    l->ring.br_size = LINUX_LOOP_BUFS * sizeof(struct io_uring_buf);
+    l->ring.br = (struct io_uring_buf_ring *)mmap(0, l->ring.br_size, PROT_READ | PROT_WRITE,
+                                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    l->ring.bufs = (char *)malloc((size_t)LINUX_LOOP_BUFS * LINUX_LOOP_BUF_SIZE);
+    memset(&reg, 0, sizeof reg);
+    reg.ring_addr = (uint64_t)(uintptr_t)l->ring.br;
+    reg.ring_entries = LINUX_LOOP_BUFS;
+    reg.bgid = LINUX_LOOP_BGID;
+    if (l->ring.br == MAP_FAILED ||
+        syscall(__NR_io_uring_register, l->ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        if (l->ring.br != MAP_FAILED)
+            munmap(l->ring.br, l->ring.br_size);
+        free(l->ring.bufs);
+        munmap(l->ring.sqes, l->ring.sqes_size);
+        munmap(l->ring.sq_ring, l->ring.sq_ring_size);
+        close(l->ring.fd);
+        return -1;
+    }
+    l->ring.br->tail = 0;
+    for (i = 0; i < LINUX_LOOP_BUFS; i++) {
+        _linux_uring_provide(l, (unsigned short)i);
+    }
+    return 0;
+}
+
+static void
+_linux_uring_unit(linux_loop_t *l) {
+    munmap(l->ring.br, l->ring.br_size);
+    free(l->ring.bufs);
+    munmap(l->ring.sqes, l->ring.sqes_size);
+    munmap(l->ring.sq_ring, l->ring.sq_ring_size);
+    close(l->ring.fd);
+}
+
+/* user_data is the connection with the operation in the low bit. */
+#define LINUX_LOOP_RECV 0
+#define LINUX_LOOP_SEND 1
+
+static void
+_linux_uring_recv(linux_loop_t *l, linux_loop_conn_t *c) {
+    struct io_uring_sqe *sqe;
+
+    if (!(sqe = _linux_uring_sqe(l))) {
+        c->closing = 1;
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = LINUX_LOOP_BGID;
+    sqe->user_data = (uint64_t)(uintptr_t)c | LINUX_LOOP_RECV;
+    c->recving = 1;
+}
+
+static void
+_linux_uring_send(linux_loop_t *l, linux_loop_conn_t *c) {
+    struct io_uring_sqe *sqe;
+
+    if (!(sqe = _linux_uring_sqe(l))) {
+        c->closing = 1;
+        return;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = c->fd;
+    sqe->addr = (uint64_t)(uintptr_t)(c->out.s + c->sent);
+    sqe->len = (unsigned)(c->out.n - c->sent);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)(uintptr_t)c | LINUX_LOOP_SEND;
+    c->sending = 1;
 }
 
+static void
+_linux_uring_complete(linux_loop_t *l, struct io_uring_cqe *cqe) {
+    linux_loop_conn_t *c;
+
+    c = (linux_loop_conn_t *)(uintptr_t)(cqe->user_data & ~(uint64_t)1);
+    if ((cqe->user_data & 1) == LINUX_LOOP_SEND) {
+        c->sending = 0;
+        if (cqe->res <= 0) {
+            c->closing = 1;
+        } else {
+            c->sent += cqe->res;
+            if (c->sent < c->out.n && !c->closing)
+                _linux_uring_send(l, c);
+        }
+        return;
+    }
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned short bid;
+
+        bid = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        if (cqe->res > 0 && !c->closing) {
+            mqtt_str_t incoming;
+
+            mqtt_str_init(&incoming, l->ring.bufs + (size_t)bid * LINUX_LOOP_BUF_SIZE, cqe->res);
+            if (mqtt_cli_incoming(c->m, &incoming))
+                c->closing = 1;
+        }
+        _linux_uring_provide(l, bid);
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        c->recving = 0;
+        /* out of buffers ends the multishot, anything else ends the connection. */
+        if (cqe->res == -ENOBUFS && !c->closing)
+            _linux_uring_recv(l, c);
+        else
+            c->closing = 1;
+    } else if (cqe->res <= 0) {
+        c->closing = 1;
+    }
+}
+
+static void
+_linux_epoll_send(linux_loop_t *l, linux_loop_conn_t *c) {
+    struct epoll_event ev;
+
+    while (c->sent < c->out.n) {
+        ssize_t nsend;
+
+        nsend = send(c->fd, c->out.s + c->sent, c->out.n - c->sent, MSG_NOSIGNAL);
+        if (nsend < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN) {
+                c->closing = 1;
+                return;
+            }
+            break;
+        }
+        c->sent += nsend;
+    }
+    if (c->sent < c->out.n && !c->sending) {
+        ev.events = EPOLLIN | EPOLLOUT;
+        ev.data.ptr = c;
+        epoll_ctl(l->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    } else if (c->sent == c->out.n && c->sending) {
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        epoll_ctl(l->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    }
+    c->sending = c->sent < c->out.n;
+}
+
+static void
+_linux_epoll_recv(linux_loop_t *l, linux_loop_conn_t *c) {
+    while (!c->closing) {
+        mqtt_str_t incoming;
+        ssize_t nrecv;
+
+        nrecv = recv(c->fd, l->buff, sizeof(l->buff), 0);
+        if (nrecv < 0 && errno == EINTR)
+            continue;
+        if (nrecv < 0 && errno == EAGAIN)
+            break;
+        if (nrecv <= 0) {
+            c->closing = 1;
+            break;
+        }
+        mqtt_str_init(&incoming, l->buff, nrecv);
+        if (mqtt_cli_incoming(c->m, &incoming))
+            c->closing = 1;
+    }
+}
+
+/**
+ * create a loop, io_uring is tried first unless uring is 0 and kept when
+ * the kernel can run multishot receives, epoll otherwise.
+ */
+linux_loop_t *
+linux_loop_create(int uring, linux_loop_close_pt on_close, void *ud) {
+    linux_loop_t *l;
+
+    l = (linux_loop_t *)malloc(sizeof *l);
+    memset(l, 0, sizeof *l);
+    l->on_close = on_close;
+    l->ud = ud;
+    l->epfd = -1;
+    l->t = linux_time_now();
+    if (uring && !_linux_uring_init(l)) {
+        if (!_linux_uring_probe(l)) {
+            l->uring = 1;
+            return l;
+        }
+        _linux_uring_unit(l);
+    }
+    l->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (l->epfd < 0) {
+        free(l);
+        return 0;
+    }
+    return l;
+}
+
+const char *
+linux_loop_backend(linux_loop_t *l) {
+    return l->uring ? "io_uring" : "epoll";
+}
+
+/**
+ * hand a connected tcp or unix network to the loop, net is consumed.
+ */
+int
+linux_loop_add(linux_loop_t *l, void *net, mqtt_cli_t *m, void *ud) {
+    linux_loop_conn_t *c;
+    linux_tcp_network_t *n;
+
+    n = (linux_tcp_network_t *)net;
+    if (n->transfer != linux_tcp_transfer) {
+        linux_net_close(net);
+        return -1;
+    }
+    c = (linux_loop_conn_t *)malloc(sizeof *c);
+    memset(c, 0, sizeof *c);
+    c->fd = n->fd;
+    c->m = m;
+    c->ud = ud;
+    free(net);
+
+    if (l->uring) {
+        _linux_uring_recv(l, c);
+    } else {
+        struct epoll_event ev;
+
+        fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, c->fd, &ev)) {
+            close(c->fd);
+            free(c);
+            return -1;
+        }
+    }
+    c->next = l->conns;
+    l->conns = c;
+    return 0;
+}
+
+/**
+ * one round: flush every connection, wait up to timeout milliseconds or the
+ * nearest client deadline, dispatch what arrived and advance the clients.
+ */
+int
+linux_loop_run(linux_loop_t *l, uint64_t timeout) {
+    linux_loop_conn_t *c, **pc;
+    uint64_t now;
+
+    for (c = l->conns; c; c = c->next) {
+        uint64_t deadline;
+
+        if (!c->sending && !c->closing) {
+            mqtt_cli_outgoing(c->m, &c->out);
+            c->sent = 0;
+            if (!mqtt_str_empty(&c->out)) {
+                if (l->uring)
+                    _linux_uring_send(l, c);
+                else
+                    _linux_epoll_send(l, c);
+            }
+        }
+        deadline = mqtt_cli_next_deadline(c->m);
+        if (deadline < timeout)
+            timeout = deadline;
+    }
+
+    if (l->uring) {
+        unsigned head, tail;
+
+        if (_linux_uring_enter(l, 1, timeout))
+            return -1;
+        head = *l->ring.cq_head;
+        tail = __atomic_load_n(l->ring.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            _linux_uring_complete(l, &l->ring.cqes[head & *l->ring.cq_mask]);
+            head++;
+            if (head == tail)
+                tail = __atomic_load_n(l->ring.cq_tail, __ATOMIC_ACQUIRE);
+        }
+        __atomic_store_n(l->ring.cq_head, head, __ATOMIC_RELEASE);
+    } else {
+        struct epoll_event events[64];
+        int i, n;
+
+        n = epoll_wait(l->epfd, events, 64, timeout > INT_MAX ? INT_MAX : (int)timeout);
+        for (i = 0; i < n; i++) {
+            c = (linux_loop_conn_t *)events[i].data.ptr;
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+                c->closing = 1;
+            if (events[i].events & EPOLLOUT)
+                _linux_epoll_send(l, c);
+            if (events[i].events & EPOLLIN)
+                _linux_epoll_recv(l, c);
+        }
+    }
+
+    now = linux_time_now();
+    pc = &l->conns;
+    while ((c = *pc)) {
+        if (!c->closing && mqtt_cli_elapsed(c->m, now - l->t))
+            c->closing = 1;
+        if (c->closing) {
+            /* io_uring may still hold the connection, wait for its last completion. */
+            if (c->fd >= 0 && !c->shut) {
+                c->shut = 1;
+                shutdown(c->fd, SHUT_RDWR);
+                if (!l->uring)
+                    epoll_ctl(l->epfd, EPOLL_CTL_DEL, c->fd, 0);
+            }
+            if (!c->sending && !c->recving) {
+                *pc = c->next;
+                if (c->fd >= 0)
+                    close(c->fd);
+                if (l->on_close)
+                    l->on_close(l, c->m, c->ud);
+                free(c);
+                continue;
+            }
+        }
+        pc = &c->next;
+    }
+    l->t = now;
+    return 0;
+}
+
+void
+linux_loop_destroy(linux_loop_t *l) {
+    linux_loop_conn_t *c;
+
+    for (c = l->conns; c; c = c->next) {
+        c->closing = 1;
+    }
+    while (l->conns) {
+        linux_loop_run(l, 10);
+    }
+    if (l->uring)
+        _linux_uring_unit(l);
+    else
+        close(l->epfd);
+    free(l);
+}
+
+#endif /* MQTT_CLI_LINUX_LOOP */
+
 #endif /* MQTT_CLI_LINUX_PLATFORM */
@@ -1,13 +1,30 @@
 #define MQTT_CLI_LINUX_PLATFORM
+#define MQTT_CLI_LINUX_WEBSOCKET
 #define MQTT_CLI_IMPL
 #include "mqtt_cli.h"
 
+#define LIBHTTP_IMPLEMENTATION
+#include "libhttp.h"
+
+#define BASE64_IMPLEMENTATION
+#include "base64.h"
+
+#define URLCODE_IMPLEMENTATION
+#include "urlcode.h"
+
+#define SHA1_IMPLEMENTATION
+#include "sha1.h"
+
+#define WEBSOCKET_IMPLEMENTATION
+#include "websocket.h"
+
 #define PMS5003ST_IMPLEMENTATION
 #include "pms5003st.h"
 
 #define UART_IMPLEMENTATION
 #include "uart.h"
 
+#include <inttypes.h>
 #include <pthread.h>
 
 struct pms5003st_runtime_arg {
@@ -30,9 +47,31 @@ _connack(mqtt_cli_t *m, void *ud, const mqtt_packet_t *pkt) {
             printf("Connack, %s\n", mqtt_crc_name(pkt->v.connack.v4.return_code));
             return;
         }
+    } else if (pkt->ver == MQTT_VERSION_5) {
+        if (pkt->v.connack.v5.reason_code != MQTT_RC_SUCCESS) {
+            printf("Connack, %s\n", mqtt_rc_name(pkt->v.connack.v5.reason_code));
+            return;
+        }
     }
 }
 
+static void
+_state(mqtt_cli_conn_t *c, void *ud, mqtt_cli_state_t from, mqtt_cli_state_t to, uint64_t spent) {
+    (void)c;
+    (void)ud;
+
+    printf("%s -> %s, %" PRIu64 " ms\n", mqtt_cli_state_name(from), mqtt_cli_state_name(to), spent);
+}
+
+static void
+_published(mqtt_cli_t *m, void *ud, uint16_t packet_id, int status) {
+    (void)m;
+    (void)ud;
+
+    if (status)
+        printf("Publish %u failed, %d\n", packet_id, status);
+}
+
 static void *
 pms5330st_runtime(void *arg) {
     struct pms5003st_runtime_arg *rarg = (struct pms5003st_runtime_arg *)arg;
@@ -56,7 +95,7 @@ pms5330st_runtime(void *arg) {
             pms5003st_print(&p);
             message.n = pms5003st_json(&p, str, 1024);
             message.s = str;
-            mqtt_cli_publish(rarg->m, 0, "pms5003st", MQTT_QOS_0, &message, 0);
+            mqtt_cli_post_publish(rarg->m, 0, "pms5003st", MQTT_QOS_1, &message, _published, 0);
             sleep(3);
         }
 
@@ -68,8 +107,8 @@ pms5330st_runtime(void *arg) {
 
 int
 main(int argc, char *argv[]) {
-    if (argc < 2) {
-        printf("usage: %s host dev\n", argv[0]);
+    if (argc < 3) {
+        printf("usage: %s host dev [session]\n", argv[0]);
         return EXIT_FAILURE;
     }
 
@@ -77,7 +116,8 @@ main(int argc, char *argv[]) {
         .client_id = "pms5003st_pub",
         .version = MQTT_VERSION_4,
         .keep_alive = 60,
-        .clean_session = 1,
+        .clean_session = 0,
+        .session_file = argc > 3 ? argv[3] : 0,
         .auth =
             {
                 .username = "pms5003st_pub",
@@ -110,35 +150,14 @@ main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
 
-    while (1) {
-        void *net = linux_tcp_connect(argv[1], MQTT_TCP_PORT);
-        if (!net) {
-            fprintf(stderr, "linux_tcp_connect(): %s\n", strerror(errno));
-            sleep(1);
-            continue;
-        }
-        mqtt_cli_connect(m);
-
-        while (1) {
-            mqtt_str_t outgoing, incoming;
-            uint64_t t1, t2;
-
-            t1 = linux_time_now();
-            mqtt_cli_outgoing(m, &outgoing);
-            if (linux_tcp_transfer(net, &outgoing, &incoming)) {
-                break;
-            }
-            if (mqtt_cli_incoming(m, &incoming)) {
-                break;
-            }
-            t2 = linux_time_now();
-            if (mqtt_cli_elapsed(m, t2 - t1)) {
-                break;
-            }
-        }
+    mqtt_cli_conn_conf_t conn_config = {
+        .seed = linux_time_now() ^ (uint64_t)getpid(),
+        .state = _state,
+    };
+    mqtt_cli_conn_t conn;
 
-        linux_tcp_close(net);
-    }
+    mqtt_cli_conn_init(&conn, m, &conn_config);
+    linux_cli_run(&conn, argv[1], MQTT_TCP_PORT);
 
     mqtt_cli_destroy(m);
 
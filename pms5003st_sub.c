@@ -1,13 +1,198 @@
 #define MQTT_CLI_LINUX_PLATFORM
+#define MQTT_CLI_LINUX_WEBSOCKET
 #define MQTT_CLI_IMPL
 #include "mqtt_cli.h"
 
+#define LIBHTTP_IMPLEMENTATION
+#include "libhttp.h"
+
+#define BASE64_IMPLEMENTATION
+#include "base64.h"
+
+#define URLCODE_IMPLEMENTATION
+#include "urlcode.h"
+
+#define SHA1_IMPLEMENTATION
+#include "sha1.h"
+
+#define WEBSOCKET_IMPLEMENTATION
+#include "websocket.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+
+#define PMS5003ST_SUB_QUEUE_MAX 1024
+
+/*
+ * with more than one worker the sink runs in parallel. "share" opens a
+ * connection per worker on a mqttv5.0 $share/<group>/ subscription, the
+ * broker spreads the load and its sharing strategy decides the order.
+ * "hash" keeps one connection and hands each device, the topic level after
+ * pms5003st/, to one worker by jump consistent hash, so every device is
+ * handled in order. "share" turns into "hash" when the first CONNACK says
+ * the broker has no shared subscriptions.
+ */
+struct pms5003st_job {
+  struct pms5003st_job *next;
+  mqtt_str_t topic;
+  mqtt_str_t message;
+  mqtt_cli_t *m;
+  mqtt_qos_t qos;
+  uint16_t packet_id;
+};
+
+struct pms5003st_worker {
+  int id;
+  pthread_t tid;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  struct pms5003st_job *head, *tail;
+  int n;
+  const char *host;
+  char client_id[64];
+};
+
+static const char *_filter = "pms5003st/#";
+static char _share_filter[256];
+static struct pms5003st_worker *_workers;
+static int _nworkers;
+/* set once the workers run, _hashing when they are fed by _dispatch. */
+static int _started;
+static int _hashing;
+
+static void _sink(int worker, const mqtt_str_t *topic,
+                  const mqtt_str_t *message) {
+  printf("%d [%.*s] %.*s\n", worker, MQTT_STR_PRINT(*topic),
+         MQTT_STR_PRINT(*message));
+}
+
 static void _publish(mqtt_cli_t *m, void *ud, const mqtt_packet_t *pkt) {
-  (void)m;
+  _sink((int)(intptr_t)ud, &pkt->v.publish.topic_name,
+        &pkt->p.publish.message);
+  if (pkt->f.bits.qos > MQTT_QOS_0)
+    mqtt_cli_puback(m, (mqtt_qos_t)pkt->f.bits.qos, pkt->v.publish.packet_id);
+}
+
+/* Lamping and Veach, a device keeps its worker as long as n does not change.
+ */
+static int _jump_hash(uint64_t key, int n) {
+  int64_t b = -1, j = 0;
+
+  while (j < n) {
+    b = j;
+    key = key * 2862933555777941757ULL + 1;
+    j = (int64_t)((b + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1)));
+  }
+  return (int)b;
+}
+
+static void _dispatch(mqtt_cli_t *m, void *ud, const mqtt_packet_t *pkt) {
+  struct pms5003st_worker *w;
+  struct pms5003st_job *job;
+  const mqtt_str_t *topic;
+  uint64_t key;
+  size_t i, prefix;
+
   (void)ud;
 
-  printf("[%.*s] %.*s\n", MQTT_STR_PRINT(pkt->v.publish.topic_name),
-         MQTT_STR_PRINT(pkt->p.publish.message));
+  topic = &pkt->v.publish.topic_name;
+  prefix = sizeof("pms5003st/") - 1;
+  i = topic->n > prefix ? prefix : 0;
+  key = 14695981039346656037ULL;
+  for (; i < topic->n && topic->s[i] != '/'; i++) {
+    key = (key ^ (uint8_t)topic->s[i]) * 1099511628211ULL;
+  }
+  w = &_workers[_jump_hash(key, _nworkers)];
+
+  /*
+   * the loop never waits for a worker. qos 1/2 messages are acked once a
+   * worker handled them, so the broker's receive maximum bounds the queue,
+   * qos 0 has no such bound and is dropped on a full queue.
+   */
+  pthread_mutex_lock(&w->lock);
+  if (pkt->f.bits.qos == MQTT_QOS_0 && w->n >= PMS5003ST_SUB_QUEUE_MAX) {
+    pthread_mutex_unlock(&w->lock);
+    fprintf(stderr, "worker %d: queue full, dropped [%.*s]\n", w->id,
+            MQTT_STR_PRINT(*topic));
+    return;
+  }
+  job = (struct pms5003st_job *)malloc(sizeof *job);
+  memset(job, 0, sizeof *job);
+  mqtt_str_copy(&job->topic, (mqtt_str_t *)topic);
+  mqtt_str_copy(&job->message, (mqtt_str_t *)&pkt->p.publish.message);
+  job->m = m;
+  job->qos = (mqtt_qos_t)pkt->f.bits.qos;
+  job->packet_id = pkt->v.publish.packet_id;
+  if (w->tail)
+    w->tail->next = job;
+  else
+    w->head = job;
+  w->tail = job;
+  w->n++;
+  pthread_cond_signal(&w->ready);
+  pthread_mutex_unlock(&w->lock);
+}
+
+static void *_hash_worker(void *arg) {
+  struct pms5003st_worker *w = (struct pms5003st_worker *)arg;
+
+  while (1) {
+    struct pms5003st_job *job;
+
+    pthread_mutex_lock(&w->lock);
+    while (!w->head)
+      pthread_cond_wait(&w->ready, &w->lock);
+    job = w->head;
+    w->head = job->next;
+    if (!w->head)
+      w->tail = 0;
+    w->n--;
+    pthread_mutex_unlock(&w->lock);
+
+    _sink(w->id, &job->topic, &job->message);
+    if (job->qos > MQTT_QOS_0)
+      mqtt_cli_post_puback(job->m, job->qos, job->packet_id, 0, 0);
+    mqtt_str_free(&job->topic);
+    mqtt_str_free(&job->message);
+    free(job);
+  }
+  return 0;
+}
+
+/* share mode starts with one connection, the first CONNACK settles how. */
+static void _message(mqtt_cli_t *m, void *ud, const mqtt_packet_t *pkt) {
+  if (_hashing)
+    _dispatch(m, ud, pkt);
+  else
+    _publish(m, ud, pkt);
+}
+
+static void *_share_worker(void *arg);
+
+static void _start(int first) {
+  int i;
+
+  for (i = first; i < _nworkers; i++) {
+    if (pthread_create(&_workers[i].tid, 0,
+                       _hashing ? _hash_worker : _share_worker,
+                       &_workers[i])) {
+      fprintf(stderr, "pthread_create(): %s\n", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  }
+  _started = 1;
+}
+
+/* absent in a mqttv5.0 CONNACK means available, older versions have none. */
+static int _shared_available(const mqtt_packet_t *pkt) {
+  mqtt_property_t *property;
+
+  if (pkt->ver != MQTT_VERSION_5)
+    return 0;
+  property = mqtt_properties_find(
+      (mqtt_properties_t *)&pkt->v.connack.v5.properties,
+      MQTT_PROPERTY_SHARED_SUBSCRIPTION_AVAILABLE);
+  return !property || property->b1;
 }
 
 static void _suback(mqtt_cli_t *m, void *ud, const mqtt_packet_t *pkt) {
@@ -39,25 +224,47 @@ static void _connack(mqtt_cli_t *m, void *ud, const mqtt_packet_t *pkt) {
       printf("Connack, %s\n", mqtt_crc_name(pkt->v.connack.v4.return_code));
       return;
     }
+  } else if (pkt->ver == MQTT_VERSION_5) {
+    if (pkt->v.connack.v5.reason_code != MQTT_RC_SUCCESS) {
+      printf("Connack, %s\n", mqtt_rc_name(pkt->v.connack.v5.reason_code));
+      return;
+    }
+  }
+
+  if (!_started) {
+    if (!_shared_available(pkt)) {
+      printf("Shared subscriptions unavailable, hashing to %d workers\n",
+             _nworkers);
+      _hashing = 1;
+      _filter = "pms5003st/#";
+    }
+    /* the connection at hand is worker 0 of the shared group. */
+    _start(_hashing ? 0 : 1);
   }
 
-  const char *topic = "pms5003st";
-  mqtt_qos_t qos = MQTT_QOS_0;
+  mqtt_qos_t qos = MQTT_QOS_1;
 
-  mqtt_cli_subscribe(m, 1, (const char **)&topic, &qos, 0);
+  mqtt_cli_subscribe(m, 1, &_filter, &qos, 0);
 }
 
-int main(int argc, char *argv[]) {
-  if (argc < 1) {
-    printf("usage: %s host\n", argv[0]);
-    return EXIT_FAILURE;
-  }
+static void _state(mqtt_cli_conn_t *c, void *ud, mqtt_cli_state_t from,
+                   mqtt_cli_state_t to, uint64_t spent) {
+  (void)c;
+  (void)ud;
 
+  printf("%s -> %s, %" PRIu64 " ms\n", mqtt_cli_state_name(from),
+         mqtt_cli_state_name(to), spent);
+}
+
+static void _run(const char *host, const char *client_id,
+                 mqtt_version_t version, mqtt_cli_callback_pt handler,
+                 void *ud) {
   mqtt_cli_conf_t config = {
-      .client_id = "pms5003st_sub",
-      .version = MQTT_VERSION_4,
+      .client_id = client_id,
+      .version = version,
       .keep_alive = 60,
-      .clean_session = 1,
+      .clean_session = 0,
+      .manual_ack = 1,
       .auth =
           {
               .username = "pms5003st_sub",
@@ -70,48 +277,86 @@ int main(int argc, char *argv[]) {
               .qos = MQTT_QOS_1,
               .message = {.s = "exit", .n = 4},
           },
+      .v5 =
+          {
+              .receive_maximum = PMS5003ST_SUB_QUEUE_MAX,
+          },
       .cb =
           {
               .connack = _connack,
               .suback = _suback,
               .unsuback = _unsuback,
-              .publish = _publish,
           },
       .ud = 0,
   };
 
   mqtt_cli_t *m = mqtt_cli_create(&config);
+  mqtt_cli_on(m, "pms5003st/#", handler, ud);
 
-  while (1) {
-    void *net = linux_tcp_connect(argv[1], MQTT_TCP_PORT);
-    if (!net) {
-      fprintf(stderr, "linux_tcp_connect(): %s\n", strerror(errno));
-      sleep(1);
-      continue;
-    }
-    mqtt_cli_connect(m);
-
-    while (1) {
-      mqtt_str_t outgoing, incoming;
-      uint64_t t1, t2;
-
-      t1 = linux_time_now();
-      mqtt_cli_outgoing(m, &outgoing);
-      if (linux_tcp_transfer(net, &outgoing, &incoming)) {
-        break;
-      }
-      if (mqtt_cli_incoming(m, &incoming)) {
-        break;
-      }
-      t2 = linux_time_now();
-      if (mqtt_cli_elapsed(m, t2 - t1)) {
-        break;
-      }
-    }
-    linux_tcp_close(net);
-  }
+  mqtt_cli_conn_conf_t conn_config = {
+      .seed = linux_time_now() ^ (uint64_t)getpid() ^ (uint64_t)(intptr_t)ud,
+      .state = _state,
+  };
+  mqtt_cli_conn_t conn;
+
+  mqtt_cli_conn_init(&conn, m, &conn_config);
+  linux_cli_run(&conn, host, MQTT_TCP_PORT);
 
   mqtt_cli_destroy(m);
+}
+
+static void *_share_worker(void *arg) {
+  struct pms5003st_worker *w = (struct pms5003st_worker *)arg;
+
+  _run(w->host, w->client_id, MQTT_VERSION_5, _publish,
+       (void *)(intptr_t)w->id);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  const char *mode;
+  int i;
+
+  if (argc < 2 || (argc > 2 && argc < 4)) {
+    printf("usage: %s host [share|hash workers [group]]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  mode = argc > 2 ? argv[2] : 0;
+  _nworkers = mode ? atoi(argv[3]) : 0;
+  if (mode && (_nworkers <= 0 ||
+               (strcmp(mode, "share") && strcmp(mode, "hash")))) {
+    printf("usage: %s host [share|hash workers [group]]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (!mode) {
+    _started = 1;
+    _run(argv[1], "pms5003st_sub", MQTT_VERSION_4, _publish, 0);
+    return 0;
+  }
+
+  _workers = (struct pms5003st_worker *)calloc(_nworkers, sizeof *_workers);
+  for (i = 0; i < _nworkers; i++) {
+    struct pms5003st_worker *w = &_workers[i];
+
+    w->id = i;
+    w->host = argv[1];
+    snprintf(w->client_id, sizeof(w->client_id), "pms5003st_sub-%d", i);
+    pthread_mutex_init(&w->lock, 0);
+    pthread_cond_init(&w->ready, 0);
+  }
+
+  if (!strcmp(mode, "hash")) {
+    _hashing = 1;
+    _start(0);
+    _run(argv[1], "pms5003st_sub", MQTT_VERSION_4, _dispatch, 0);
+    return 0;
+  }
+
+  snprintf(_share_filter, sizeof(_share_filter), "$share/%s/pms5003st/#",
+           argc > 4 ? argv[4] : "pms5003st");
+  _filter = _share_filter;
+  _run(argv[1], _workers[0].client_id, MQTT_VERSION_5, _message, 0);
 
   return 0;
 }
@@ -0,0 +1,168 @@
+/*
+ * sha1.h -- sha-1 message digest, fips 180-4.
+ *
+ * Copyright (c) zhoukk <izhoukk@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _SHA1_H_
+#define _SHA1_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA1_DIGEST_SIZE 20
+
+typedef struct {
+    uint32_t h[5];
+    uint64_t n;
+    unsigned char buf[64];
+} sha1_ctx_t;
+
+void sha1_init(sha1_ctx_t *ctx);
+
+void sha1_update(sha1_ctx_t *ctx, const void *data, size_t len);
+
+void sha1_final(sha1_ctx_t *ctx, unsigned char digest[SHA1_DIGEST_SIZE]);
+
+void sha1(const void *data, size_t len, unsigned char digest[SHA1_DIGEST_SIZE]);
+
+#endif /* _SHA1_H_ */
+
+#ifdef SHA1_IMPLEMENTATION
+
+#include <string.h>
+
+#define __sha1_rol(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void
+__sha1_block(sha1_ctx_t *ctx, const unsigned char *p) {
+    uint32_t w[80], a, b, c, d, e, t;
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 | (uint32_t)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+    }
+    for (i = 16; i < 80; i++) {
+        t = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+        w[i] = __sha1_rol(t, 1);
+    }
+
+    a = ctx->h[0];
+    b = ctx->h[1];
+    c = ctx->h[2];
+    d = ctx->h[3];
+    e = ctx->h[4];
+    for (i = 0; i < 80; i++) {
+        if (i < 20)
+            t = ((b & c) | (~b & d)) + 0x5A827999;
+        else if (i < 40)
+            t = (b ^ c ^ d) + 0x6ED9EBA1;
+        else if (i < 60)
+            t = ((b & c) | (b & d) | (c & d)) + 0x8F1BBCDC;
+        else
+            t = (b ^ c ^ d) + 0xCA62C1D6;
+        t += __sha1_rol(a, 5) + e + w[i];
+        e = d;
+        d = c;
+        c = __sha1_rol(b, 30);
+        b = a;
+        a = t;
+    }
+    ctx->h[0] += a;
+    ctx->h[1] += b;
+    ctx->h[2] += c;
+    ctx->h[3] += d;
+    ctx->h[4] += e;
+}
+
+void
+sha1_init(sha1_ctx_t *ctx) {
+    ctx->h[0] = 0x67452301;
+    ctx->h[1] = 0xEFCDAB89;
+    ctx->h[2] = 0x98BADCFE;
+    ctx->h[3] = 0x10325476;
+    ctx->h[4] = 0xC3D2E1F0;
+    ctx->n = 0;
+}
+
+void
+sha1_update(sha1_ctx_t *ctx, const void *data, size_t len) {
+    const unsigned char *p;
+    size_t used;
+
+    p = (const unsigned char *)data;
+    used = ctx->n % 64;
+    ctx->n += len;
+    if (used) {
+        size_t fill;
+
+        fill = 64 - used;
+        if (len < fill) {
+            memcpy(ctx->buf + used, p, len);
+            return;
+        }
+        memcpy(ctx->buf + used, p, fill);
+        __sha1_block(ctx, ctx->buf);
+        p += fill;
+        len -= fill;
+    }
+    while (len >= 64) {
+        __sha1_block(ctx, p);
+        p += 64;
+        len -= 64;
+    }
+    memcpy(ctx->buf, p, len);
+}
+
+void
+sha1_final(sha1_ctx_t *ctx, unsigned char digest[SHA1_DIGEST_SIZE]) {
+    unsigned char pad[72];
+    uint64_t bits;
+    size_t used, n;
+    int i;
+
+    bits = ctx->n * 8;
+    used = ctx->n % 64;
+    n = used < 56 ? 56 - used : 120 - used;
+    memset(pad, 0, sizeof pad);
+    pad[0] = 0x80;
+    for (i = 0; i < 8; i++) {
+        pad[n + i] = (unsigned char)(bits >> (56 - i * 8));
+    }
+    sha1_update(ctx, pad, n + 8);
+    for (i = 0; i < 5; i++) {
+        digest[i * 4] = (unsigned char)(ctx->h[i] >> 24);
+        digest[i * 4 + 1] = (unsigned char)(ctx->h[i] >> 16);
+        digest[i * 4 + 2] = (unsigned char)(ctx->h[i] >> 8);
+        digest[i * 4 + 3] = (unsigned char)ctx->h[i];
+    }
+}
+
+void
+sha1(const void *data, size_t len, unsigned char digest[SHA1_DIGEST_SIZE]) {
+    sha1_ctx_t ctx;
+
+    sha1_init(&ctx);
+    sha1_update(&ctx, data, len);
+    sha1_final(&ctx, digest);
+}
+
+#endif /* SHA1_IMPLEMENTATION */
@@ -0,0 +1,301 @@
+/*
+ * websocket.h -- websocket framing, rfc 6455.
+ *
+ * Copyright (c) zhoukk <izhoukk@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _WEBSOCKET_H_
+#define _WEBSOCKET_H_
+
+#include "base64.h"
+#include "sha1.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WEBSOCKET_HEADER_MAX 14
+#define WEBSOCKET_CONTROL_MAX 125
+
+typedef enum {
+    WEBSOCKET_OP_CONTINUATION = 0x0,
+    WEBSOCKET_OP_TEXT         = 0x1,
+    WEBSOCKET_OP_BINARY       = 0x2,
+    WEBSOCKET_OP_CLOSE        = 0x8,
+    WEBSOCKET_OP_PING         = 0x9,
+    WEBSOCKET_OP_PONG         = 0xA,
+} websocket_opcode_t;
+
+/* incremental frame decoder, frames may be split anywhere. */
+typedef struct {
+    int server;
+    int payload;
+    size_t header;
+    size_t need;
+    unsigned char h[WEBSOCKET_HEADER_MAX];
+    int opcode;
+    int masked;
+    unsigned char mask[4];
+    uint64_t remaining;
+    size_t offset;
+    unsigned char control[WEBSOCKET_CONTROL_MAX];
+    size_t control_n;
+} websocket_decoder_t;
+
+/**
+ * write a final frame header into h, mask is 0 for unmasked frames.
+ * returns the header length.
+ */
+size_t websocket_frame_header(unsigned char *h, int opcode, uint64_t len, const unsigned char *mask);
+
+/**
+ * xor data with mask, offset is the position of data within the payload.
+ */
+void websocket_mask(void *data, size_t len, const unsigned char mask[4], size_t offset);
+
+/**
+ * server is non-zero when decoding frames sent by a client. rfc 6455 5.1,
+ * frames from a client must be masked and frames from a server must not,
+ * websocket_decode fails on either mistake.
+ */
+void websocket_decoder_init(websocket_decoder_t *d, int server);
+
+/**
+ * consume *n bytes from *in, appending data payload to out at *out_n.
+ * out may alias *in. stops after a control frame and returns its opcode
+ * with the payload in d->control, 0 when the input is used up, -1 on a
+ * protocol error. mqtt is binary, so data comes only in BINARY and
+ * CONTINUATION frames; TEXT, reserved opcodes and RSV bits are errors.
+ */
+int websocket_decode(websocket_decoder_t *d, const char **in, size_t *n, char *out, size_t *out_n);
+
+/**
+ * Sec-WebSocket-Key for a 16 byte nonce.
+ */
+void websocket_key(const unsigned char nonce[16], char key[25]);
+
+/**
+ * Sec-WebSocket-Accept expected for key.
+ */
+void websocket_accept(const char *key, char accept[29]);
+
+#endif /* _WEBSOCKET_H_ */
+
+#ifdef WEBSOCKET_IMPLEMENTATION
+
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+size_t
+websocket_frame_header(unsigned char *h, int opcode, uint64_t len, const unsigned char *mask) {
+    size_t n;
+    int i;
+
+    h[0] = 0x80 | (opcode & 0x0F);
+    if (len < 126) {
+        h[1] = (unsigned char)len;
+        n = 2;
+    } else if (len <= 0xFFFF) {
+        h[1] = 126;
+        h[2] = (unsigned char)(len >> 8);
+        h[3] = (unsigned char)len;
+        n = 4;
+    } else {
+        h[1] = 127;
+        for (i = 0; i < 8; i++) {
+            h[2 + i] = (unsigned char)(len >> (56 - i * 8));
+        }
+        n = 10;
+    }
+    if (mask) {
+        h[1] |= 0x80;
+        memcpy(h + n, mask, 4);
+        n += 4;
+    }
+    return n;
+}
+
+void
+websocket_mask(void *data, size_t len, const unsigned char mask[4], size_t offset) {
+    unsigned char *p, pattern[16];
+    uint64_t m64;
+    size_t i;
+
+    /* the mask rotated to offset, repeated so it can be applied a word at a time. */
+    for (i = 0; i < sizeof pattern; i++) {
+        pattern[i] = mask[(offset + i) & 3];
+    }
+    p = (unsigned char *)data;
+#ifdef __SSE2__
+    {
+        __m128i m128;
+
+        m128 = _mm_loadu_si128((const __m128i *)pattern);
+        while (len >= 16) {
+            _mm_storeu_si128((__m128i *)p, _mm_xor_si128(_mm_loadu_si128((const __m128i *)p), m128));
+            p += 16;
+            len -= 16;
+        }
+    }
+#endif
+    memcpy(&m64, pattern, 8);
+    while (len >= 8) {
+        uint64_t v;
+
+        memcpy(&v, p, 8);
+        v ^= m64;
+        memcpy(p, &v, 8);
+        p += 8;
+        len -= 8;
+    }
+    for (i = 0; i < len; i++) {
+        p[i] ^= pattern[i];
+    }
+}
+
+void
+websocket_decoder_init(websocket_decoder_t *d, int server) {
+    memset(d, 0, sizeof *d);
+    d->server = server;
+    d->need = 2;
+}
+
+static int
+__websocket_header(websocket_decoder_t *d) {
+    size_t len, i;
+
+    /* no extension was negotiated, so RSV1-3 must be clear. */
+    if (d->h[0] & 0x70)
+        return -1;
+    switch (d->h[0] & 0x0F) {
+    case WEBSOCKET_OP_CONTINUATION:
+    case WEBSOCKET_OP_BINARY:
+    case WEBSOCKET_OP_CLOSE:
+    case WEBSOCKET_OP_PING:
+    case WEBSOCKET_OP_PONG:
+        break;
+    default:
+        return -1;
+    }
+    len = d->h[1] & 0x7F;
+    d->masked = d->h[1] & 0x80;
+    if (!d->masked != !d->server)
+        return -1;
+    d->need = 2 + (len == 126 ? 2 : len == 127 ? 8 : 0) + (d->masked ? 4 : 0);
+    if (d->header < d->need)
+        return 0;
+
+    d->opcode = d->h[0] & 0x0F;
+    if (len == 126) {
+        d->remaining = (uint64_t)d->h[2] << 8 | d->h[3];
+    } else if (len == 127) {
+        d->remaining = 0;
+        for (i = 0; i < 8; i++) {
+            d->remaining = d->remaining << 8 | d->h[2 + i];
+        }
+    } else {
+        d->remaining = len;
+    }
+    if (d->masked)
+        memcpy(d->mask, d->h + d->need - 4, 4);
+    if (d->opcode & 0x08) {
+        if (!(d->h[0] & 0x80) || d->remaining > WEBSOCKET_CONTROL_MAX)
+            return -1;
+        d->control_n = 0;
+    }
+    d->offset = 0;
+    d->payload = 1;
+    return 1;
+}
+
+int
+websocket_decode(websocket_decoder_t *d, const char **in, size_t *n, char *out, size_t *out_n) {
+    while (1) {
+        if (!d->payload) {
+            int rc;
+
+            while (d->header < d->need && *n > 0) {
+                d->h[d->header++] = (unsigned char)*(*in)++;
+                (*n)--;
+            }
+            if (d->header < d->need)
+                return 0;
+            rc = __websocket_header(d);
+            if (rc < 0)
+                return -1;
+            if (rc == 0)
+                continue;
+        }
+        if (d->remaining > 0) {
+            size_t k;
+            unsigned char *dst;
+
+            if (*n == 0)
+                return 0;
+            k = d->remaining < *n ? (size_t)d->remaining : *n;
+            if (d->opcode & 0x08) {
+                dst = d->control + d->control_n;
+                d->control_n += k;
+            } else {
+                dst = (unsigned char *)out + *out_n;
+                *out_n += k;
+            }
+            memmove(dst, *in, k);
+            if (d->masked)
+                websocket_mask(dst, k, d->mask, d->offset);
+            d->offset += k;
+            d->remaining -= k;
+            *in += k;
+            *n -= k;
+            if (d->remaining > 0)
+                return 0;
+        }
+        d->payload = 0;
+        d->header = 0;
+        d->need = 2;
+        if (d->opcode & 0x08)
+            return d->opcode;
+        if (*n == 0)
+            return 0;
+    }
+}
+
+void
+websocket_key(const unsigned char nonce[16], char key[25]) {
+    base64_encode((const char *)nonce, 16, key);
+}
+
+void
+websocket_accept(const char *key, char accept[29]) {
+    unsigned char digest[SHA1_DIGEST_SIZE];
+    sha1_ctx_t ctx;
+
+    sha1_init(&ctx);
+    sha1_update(&ctx, key, strlen(key));
+    sha1_update(&ctx, WEBSOCKET_GUID, sizeof(WEBSOCKET_GUID) - 1);
+    sha1_final(&ctx, digest);
+    base64_encode((const char *)digest, SHA1_DIGEST_SIZE, accept);
+}
+
+#endif /* WEBSOCKET_IMPLEMENTATION */